@@ -1,18 +1,109 @@
+#define _DEFAULT_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <string.h>
 #include <ctype.h>
 #include <assert.h>
 #include <errno.h>
+#include <limits.h>
 #include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <signal.h>
 
+#include "./cvm.h"
 
 #define ARRAY_SIZE(array) (sizeof(array) / sizeof(array[0]))
-#define CVM_STACK_CAPACITY 1024
-#define CVM_PROGRAM_CAPACITY 1024
-#define MAX_LABELS 100
-#define MAX_LABEL_LENGTH 30
-#define MAX_JUMPS 110
+#define CVM_STACK_CAPACITY 1024 // default, see cvm_init
+#define CVM_STACK_CAPACITY_MAX (1L << 32) // words, the most -S accepts
+#define CVM_OUTPUT_CAPACITY (64 * 1024)
+#define CVM_MEMORY_CAPACITY (1024 * 1024) // default, see cvm_set_memory
+#define CVM_MEMORY_CAPACITY_MAX (1L << 40) // bytes, the most -M accepts
+#define CVM_RETURN_STACK_CAPACITY 1024
+#define CVM_DEPTH_UNREACHABLE INT64_MIN // in Cvm_Program.stack_depth
+
+#if defined(__GNUC__) && !defined(CVM_NO_COMPUTED_GOTO)
+#define CVM_HAVE_COMPUTED_GOTO 1
+#endif
+
+// Keeps a rare branch out of the way of a hot loop.
+#if defined(__GNUC__)
+#define CVM_UNLIKELY(condition) __builtin_expect(!!(condition), 0)
+#else
+#define CVM_UNLIKELY(condition) (condition)
+#endif
+
+// Heap allocation and fatal errors go through per-thread hooks so an embedder can
+// route them for the duration of one call, see libcvm.c. Unset, memory comes from
+// libc and a fatal error prints its message and exits, which is all the tools want.
+static _Thread_local const Cvm_Allocator *cvm_allocator = NULL;
+static _Thread_local void (*cvm_fail_handler)(const char *message) = NULL;
+
+static _Noreturn void cvm_fail(const char *format, ...) __attribute__((format(printf, 1, 2)));
+
+static _Noreturn void cvm_fail(const char *format, ...){
+    char message[512];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(message, sizeof(message), format, args);
+    va_end(args);
+    if(cvm_fail_handler != NULL){
+        cvm_fail_handler(message); // does not come back
+    }
+    fprintf(stderr, "ERROR: %s", message);
+    exit(1);
+}
+
+static void *cvm_malloc(size_t size){
+    if(cvm_allocator == NULL){
+        return malloc(size);
+    }
+    return cvm_allocator->malloc(cvm_allocator->user, size);
+}
+
+static void *cvm_calloc(size_t count, size_t size){
+    if(cvm_allocator == NULL){
+        return calloc(count, size);
+    }
+    if(size != 0 && count > SIZE_MAX / size){
+        return NULL;
+    }
+    void *ptr = cvm_allocator->malloc(cvm_allocator->user, count * size);
+    if(ptr != NULL){
+        memset(ptr, 0, count * size);
+    }
+    return ptr;
+}
+
+static void *cvm_realloc(void *ptr, size_t size){
+    if(cvm_allocator == NULL){
+        return realloc(ptr, size);
+    }
+    if(ptr == NULL){
+        return cvm_allocator->malloc(cvm_allocator->user, size);
+    }
+    return cvm_allocator->realloc(cvm_allocator->user, ptr, size);
+}
+
+static void cvm_free(void *ptr){
+    if(ptr == NULL){
+        return;
+    }
+    if(cvm_allocator == NULL){
+        free(ptr);
+        return;
+    }
+    cvm_allocator->free(cvm_allocator->user, ptr);
+}
 
 typedef enum{
     ERROR_OK = 0,
@@ -22,6 +113,10 @@ typedef enum{
     ERROR_DIV_BY_ZERO,
     ERROR_ILLEGAL_INST_ACCESS,
     ERROR_ILLEGAL_OPERAND,
+    ERROR_ILLEGAL_MEMORY_ACCESS,
+    ERROR_OUT_OF_MEMORY,
+    ERROR_RETURN_STACK_OVERFLOW,
+    ERROR_RETURN_STACK_UNDERFLOW,
     ERROR_OK_NO_INST,
 } Error;
 
@@ -41,6 +136,14 @@ const char *error_as_cstr(Error error){
             return "Illegal instruction access";
         case ERROR_ILLEGAL_OPERAND:
             return "Illegal operand";
+        case ERROR_ILLEGAL_MEMORY_ACCESS:
+            return "Illegal memory access";
+        case ERROR_OUT_OF_MEMORY:
+            return "Out of memory";
+        case ERROR_RETURN_STACK_OVERFLOW:
+            return "Return stack overflow";
+        case ERROR_RETURN_STACK_UNDERFLOW:
+            return "Return stack underflow";
         case ERROR_OK_NO_INST:
             return "Ok, no instruction";
         default:
@@ -50,22 +153,6 @@ const char *error_as_cstr(Error error){
 
 typedef int64_t Word;
 
-typedef struct {
-    char *name[MAX_LABEL_LENGTH];
-    Word addr;
-} Label;
-
-Label label_table[MAX_LABELS];
-size_t label_count = 0;
-
-typedef struct{
-    char *label[MAX_LABEL_LENGTH];
-    Word addr;
-} Jump;
-
-Jump jump_table[MAX_JUMPS];
-size_t jump_count = 0;
-
 typedef enum {
     INST_NOP = 0,
     INST_PUSH,
@@ -79,8 +166,28 @@ typedef enum {
     INST_EQ,
     INST_HALT,
     INST_PRINT_DEBUG,
+    // Superinstructions produced by cvm_fuse_program. The fused sequence is left in
+    // place after the head so jumps into its middle keep working; the head runs the
+    // whole sequence in one dispatch and skips over the tail.
+    INST_PLUS_IMM, // push N; plus
+    INST_PUSH2, // push a; push b
+    INST_JMP_IF_EQ, // dup 0; push K; eq; jmp_if L
+    // Linear memory, byte addressed, words stored in host byte order. Operands come
+    // off the stack, pushed in the order written here.
+    INST_LOAD, // addr -> word at addr
+    INST_STORE, // addr value ->
+    INST_MEMCPY, // dst src count ->, overlapping ranges are fine
+    INST_MEMSET, // dst byte count ->
+    INST_ALLOC, // size -> addr of size fresh bytes from the arena, 8-byte aligned
+    INST_RESET, // frees everything alloc handed out
+    INST_NATIVE, // calls the C function registered under the operand, see Cvm_Native
+    INST_CALL, // pushes the address of the next instruction on the return stack and jumps
+    INST_RET, // jumps to the address popped off the return stack
+    INST_YIELD, // ends the current run early so a scheduler can switch contexts, see cvm_run_scheduler
 } Inst_Type;
 
+#define INST_TYPE_COUNT (INST_YIELD + 1)
+
 const char *inst_type_as_sctr(Inst_Type type){
     switch(type){
         case INST_NOP:
@@ -107,6 +214,32 @@ const char *inst_type_as_sctr(Inst_Type type){
             return "INST_HALT";
         case INST_PRINT_DEBUG:
             return "INST_PRINT_DEBUG";
+        case INST_PLUS_IMM:
+            return "INST_PLUS_IMM";
+        case INST_PUSH2:
+            return "INST_PUSH2";
+        case INST_JMP_IF_EQ:
+            return "INST_JMP_IF_EQ";
+        case INST_LOAD:
+            return "INST_LOAD";
+        case INST_STORE:
+            return "INST_STORE";
+        case INST_MEMCPY:
+            return "INST_MEMCPY";
+        case INST_MEMSET:
+            return "INST_MEMSET";
+        case INST_ALLOC:
+            return "INST_ALLOC";
+        case INST_RESET:
+            return "INST_RESET";
+        case INST_NATIVE:
+            return "INST_NATIVE";
+        case INST_CALL:
+            return "INST_CALL";
+        case INST_RET:
+            return "INST_RET";
+        case INST_YIELD:
+            return "INST_YIELD";
         default:
             assert(0 && "inst_type_as_cstr: Unknown instruction type");
     }
@@ -117,19 +250,187 @@ typedef struct{
     Word operand;
 } Inst;
 
+// A straight run of instructions entered only at its first one. cost is what the
+// run retires against -l, length how many instructions it spans. Blocks are indexed
+// by the ip of their first instruction; every other ip has length 0.
+typedef struct {
+    Word cost;
+    Word length;
+} Cvm_Block;
+
+// A loaded program. It is not modified after loading and verification, so one
+// Cvm_Program can back any number of Cvm contexts, including contexts running
+// at the same time on different threads.
+typedef struct {
+    Inst *inst;
+    Word size;
+
+    // Set by the loaders, see cvm_analyze_blocks.
+    Cvm_Block *blocks;
+
+    // Set by cvm_verify_program. routine holds the entry ip of the routine every
+    // reachable instruction belongs to, -1 for code reached from ip 0, and
+    // stack_depth the proven stack depth on entry to it, counted from the depth the
+    // routine was called at; unreachable instructions have CVM_DEPTH_UNREACHABLE.
+    int verified;
+    Word *stack_depth;
+    Word *routine;
+    Word max_stack_depth;
+
+    // Heap allocated, or when mapping is set, the loaded file itself mapped read-only.
+    void *mapping;
+    size_t mapping_size;
+
+    // Native code, compiled on first use by the JIT engine. Published with a
+    // compare-and-swap so concurrent first runs do not need a lock.
+    _Atomic(struct Cvm_Jit *) jit;
+
+    // Handler stream of the threaded engine, decoded and published the same way.
+    _Atomic(struct Cvm_Threaded *) threaded;
+} Cvm_Program;
+
+typedef enum {
+    CVM_OUTPUT_TEXT = 0,
+    CVM_OUTPUT_BINARY,
+} Cvm_Output_Mode;
+
+// Per-execution state: a stack and the registers. program and program_size are a
+// view of the attached Cvm_Program so the engines reach instructions directly.
+// The program is only referenced, so a context costs its stacks, the memory it
+// touched and a few hundred bytes; see cvm_stats.
 typedef struct {
-    Word stack[CVM_STACK_CAPACITY];
+    // stack_capacity is what the engines may use without asking. A push past it
+    // goes through cvm_stack_reserve, which grows the stack up to stack_limit and
+    // only then reports an overflow. allocated and class are where it came from.
+    Word *stack;
     Word stack_size;
+    Word stack_capacity;
+    Word stack_limit;
+    size_t stack_allocated;
+    int stack_class;
 
-    Inst program[CVM_PROGRAM_CAPACITY];
+    const Inst *program;
     Word ip;
     Word program_size;
+    Cvm_Program *image;
+
+    // Return addresses of the calls in progress, kept apart from the data stack so
+    // a routine cannot clobber them. Grows like the data stack, up to
+    // CVM_RETURN_STACK_CAPACITY, through cvm_return_stack_reserve.
+    Word *return_stack;
+    Word return_stack_size;
+    Word return_stack_capacity;
+    size_t return_stack_allocated;
+    int return_stack_class;
 
+    // Linear memory: an anonymous mapping of memory_size bytes followed by a guard
+    // page, made on first use, see cvm_memory. memory_used is the end of the
+    // highest byte written so far and arena the next byte alloc hands out.
     char *memory;
+    size_t memory_size;
+    size_t memory_mapping_size;
+    size_t memory_used;
+    size_t arena;
 
     int halt;
+
+    // Set by yield, which stops the engine right after it. fuel is what the last
+    // run left of its limit, negative when it had none, so lim - fuel is what it
+    // retired. cvm_execute_program_with resumes after a yield; the scheduler does not.
+    int yielded;
+    int fuel;
+
+    // print_debug output, handed to output_fd in large writes by cvm_output_flush.
+    char *output;
+    size_t output_size;
+    int output_fd;
+    Cvm_Output_Mode output_mode;
+
+    // Blocks of the attached program decoded so far by the trace engine, indexed
+    // by entry ip. Allocated on first use and dropped on every attach.
+    struct Cvm_Trace **traces;
+    struct Cvm_Trace *trace_list;
 } Cvm;
 
+static const char cvm_digit_pairs[] =
+    "0001020304050607080910111213141516171819"
+    "2021222324252627282930313233343536373839"
+    "4041424344454647484950515253545556575859"
+    "6061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+// Decimal text of value, without a terminator; buffer needs room for 20 characters.
+size_t cvm_format_word(char *buffer, Word value){
+    char digits[20];
+    char *p = digits + sizeof(digits);
+    uint64_t n = value < 0 ? 0 - (uint64_t) value : (uint64_t) value;
+    while(n >= 100){
+        const char *pair = &cvm_digit_pairs[(n % 100) * 2];
+        n /= 100;
+        *--p = pair[1];
+        *--p = pair[0];
+    }
+    if(n >= 10){
+        *--p = cvm_digit_pairs[n * 2 + 1];
+        *--p = cvm_digit_pairs[n * 2];
+    }
+    else{
+        *--p = (char) ('0' + n);
+    }
+    size_t length = 0;
+    if(value < 0){
+        buffer[length++] = '-';
+    }
+    size_t count = (size_t) (digits + sizeof(digits) - p);
+    memcpy(buffer + length, p, count);
+    return length + count;
+}
+
+void cvm_output_flush(Cvm *cvm){
+    size_t written = 0;
+    while(written < cvm->output_size){
+        ssize_t n = write(cvm->output_fd, cvm->output + written, cvm->output_size - written);
+        if(n < 0 && errno == EINTR){
+            continue;
+        }
+        if(n <= 0){
+            cvm_fail("Could not write program output : %s\n", strerror(errno));
+        }
+        written += (size_t) n;
+    }
+    cvm->output_size = 0;
+}
+
+// Appends value to the output buffer as a line of text, or as a raw Word in
+// binary mode. The buffer goes out once it is nearly full and whenever an engine
+// returns, so output is complete on halt, on error and when the limit runs out.
+static void cvm_output_word(Cvm *cvm, Word value){
+    if(cvm->output == NULL){
+        cvm->output = cvm_malloc(CVM_OUTPUT_CAPACITY);
+        if(cvm->output == NULL){
+            cvm_fail("Out of memory : %s\n", strerror(errno));
+        }
+    }
+    if(cvm->output_size + 24 > CVM_OUTPUT_CAPACITY){
+        cvm_output_flush(cvm);
+    }
+    if(cvm->output_mode == CVM_OUTPUT_BINARY){
+        memcpy(cvm->output + cvm->output_size, &value, sizeof(value));
+        cvm->output_size += sizeof(value);
+    }
+    else{
+        cvm->output_size += cvm_format_word(cvm->output + cvm->output_size, value);
+        cvm->output[cvm->output_size++] = '\n';
+    }
+}
+
+// Where print_debug output goes. Anything still buffered goes to the old target first.
+void cvm_set_output(Cvm *cvm, int fd, Cvm_Output_Mode mode){
+    cvm_output_flush(cvm);
+    cvm->output_fd = fd;
+    cvm->output_mode = mode;
+}
+
 #define MAKE_INST_NOP (Inst) {0}
 #define MAKE_INST_PUSH(value) {.type = INST_PUSH, .operand = value}
 #define MAKE_INST_DUP(addr) {.type=INST_DUP, .operand = addr}
@@ -139,41 +440,255 @@ typedef struct {
 #define MAKE_INST_DIV {.type = INST_DIV}
 #define MAKE_INST_JMP(addr) {.type = INST_JMP, .operand = addr}
 #define MAKE_INST_HALT {.type = INST_HALT}
+#define MAKE_INST_JMP_IF(addr) {.type = INST_JMP_IF, .operand = addr}
+#define MAKE_INST_EQ {.type = INST_EQ}
+#define MAKE_INST_PRINT_DEBUG {.type = INST_PRINT_DEBUG}
+#define MAKE_INST_LOAD {.type = INST_LOAD}
+#define MAKE_INST_STORE {.type = INST_STORE}
+#define MAKE_INST_MEMCPY {.type = INST_MEMCPY}
+#define MAKE_INST_MEMSET {.type = INST_MEMSET}
+#define MAKE_INST_ALLOC {.type = INST_ALLOC}
+#define MAKE_INST_RESET {.type = INST_RESET}
+#define MAKE_INST_NATIVE(index) {.type = INST_NATIVE, .operand = index}
+#define MAKE_INST_CALL(addr) {.type = INST_CALL, .operand = addr}
+#define MAKE_INST_RET {.type = INST_RET}
+#define MAKE_INST_YIELD {.type = INST_YIELD}
 
+// Number of source instructions an instruction stands for. Fused instructions are
+// charged for their whole sequence so -l limits mean the same with and without fusion.
+Word inst_fused_length(Inst_Type type){
+    if(type == INST_PLUS_IMM || type == INST_PUSH2){
+        return 2;
+    }
+    if(type == INST_JMP_IF_EQ){
+        return 4;
+    }
+    return 1;
+}
 
-Inst inst_push(Word operand){
-    return (Inst){
-        .type = INST_PUSH,
-        .operand = operand
-    };
+// The first instruction of the sequence a fused instruction replaced. It is what
+// runs when the whole sequence cannot: not enough budget left, or a check in the
+// middle of the sequence would fail and must fault at the original ip.
+Inst inst_fused_head(Inst inst){
+    if(inst.type == INST_PLUS_IMM || inst.type == INST_PUSH2){
+        return (Inst) MAKE_INST_PUSH(inst.operand);
+    }
+    if(inst.type == INST_JMP_IF_EQ){
+        return (Inst) MAKE_INST_DUP(0);
+    }
+    return inst;
 }
 
-Inst inst_plus(){
-    return (Inst){
-        .type = INST_PLUS
-    };
+// Whether count bytes at addr lie inside the linear memory. Written so that no
+// combination of addr and count can overflow.
+static int cvm_memory_range_ok(const Cvm *cvm, Word addr, Word count){
+    return addr >= 0 && count >= 0
+        && (uint64_t) count <= cvm->memory_size
+        && (uint64_t) addr <= cvm->memory_size - (uint64_t) count;
 }
 
-Error cvm_ex_inst(Cvm *cvm){
-    if(cvm->ip < 0 || cvm->ip >= cvm->program_size){
-        return ERROR_ILLEGAL_INST_ACCESS;
+static void cvm_memory_touch(Cvm *cvm, Word addr, Word count){
+    if((size_t) (addr + count) > cvm->memory_used){
+        cvm->memory_used = (size_t) (addr + count);
     }
+}
 
-    Inst inst = cvm->program[cvm->ip];
+static int cvm_stack_reserve(Cvm *cvm, Word words);
+static int cvm_return_stack_reserve(Cvm *cvm, Word words);
+static char *cvm_memory(Cvm *cvm);
+
+// A C function called from bytecode by the native instruction. frame holds its
+// arity arguments, bottom first, and the function leaves its results in the same
+// slots; the instruction pops the arguments and pushes the results.
+typedef Error (*Cvm_Native_Fn)(Cvm *cvm, Word *frame);
+
+typedef struct {
+    const char *name;
+    Word arity;
+    Word results;
+    Cvm_Native_Fn fn;
+} Cvm_Native;
+
+static Error cvm_native_min(Cvm *cvm, Word *frame){
+    (void) cvm;
+    frame[0] = frame[0] < frame[1] ? frame[0] : frame[1];
+    return ERROR_OK;
+}
+
+static Error cvm_native_max(Cvm *cvm, Word *frame){
+    (void) cvm;
+    frame[0] = frame[0] > frame[1] ? frame[0] : frame[1];
+    return ERROR_OK;
+}
+
+static Error cvm_native_abs(Cvm *cvm, Word *frame){
+    (void) cvm;
+    if(frame[0] == INT64_MIN){
+        return ERROR_ILLEGAL_OPERAND;
+    }
+    frame[0] = frame[0] < 0 ? -frame[0] : frame[0];
+    return ERROR_OK;
+}
+
+// Largest r with r * r <= n, one result bit at a time.
+static Error cvm_native_isqrt(Cvm *cvm, Word *frame){
+    (void) cvm;
+    if(frame[0] < 0){
+        return ERROR_ILLEGAL_OPERAND;
+    }
+    uint64_t n = (uint64_t) frame[0];
+    uint64_t root = 0;
+    for(uint64_t bit = (uint64_t) 1 << 62; bit != 0; bit >>= 2){
+        if(n >= root + bit){
+            n -= root + bit;
+            root = (root >> 1) + bit;
+        }
+        else{
+            root >>= 1;
+        }
+    }
+    frame[0] = (Word) root;
+    return ERROR_OK;
+}
+
+// FNV-1a of count bytes of memory at addr.
+static Error cvm_native_hash(Cvm *cvm, Word *frame){
+    if(!cvm_memory_range_ok(cvm, frame[0], frame[1])){
+        return ERROR_ILLEGAL_MEMORY_ACCESS;
+    }
+    uint64_t hash = 14695981039346656037ull;
+    const unsigned char *bytes = (const unsigned char *) cvm_memory(cvm) + frame[0];
+    for(Word i = 0; i < frame[1]; i++){
+        hash = (hash ^ bytes[i]) * 1099511628211ull;
+    }
+    frame[0] = (Word) hash;
+    return ERROR_OK;
+}
+
+// The count words of memory at addr, as long as there is at least one.
+static const Word *cvm_native_words(Cvm *cvm, Word addr, Word count){
+    if(count < 1 || (uint64_t) count > cvm->memory_size / sizeof(Word)
+            || !cvm_memory_range_ok(cvm, addr, count * (Word) sizeof(Word))){
+        return NULL;
+    }
+    return (const Word *) (cvm_memory(cvm) + addr);
+}
+
+static Error cvm_native_range_min(Cvm *cvm, Word *frame){
+    const Word *words = cvm_native_words(cvm, frame[0], frame[1]);
+    if(words == NULL){
+        return ERROR_ILLEGAL_MEMORY_ACCESS;
+    }
+    Word result;
+    memcpy(&result, &words[0], sizeof(Word));
+    for(Word i = 1; i < frame[1]; i++){
+        Word word;
+        memcpy(&word, &words[i], sizeof(Word));
+        result = word < result ? word : result;
+    }
+    frame[0] = result;
+    return ERROR_OK;
+}
+
+static Error cvm_native_range_max(Cvm *cvm, Word *frame){
+    const Word *words = cvm_native_words(cvm, frame[0], frame[1]);
+    if(words == NULL){
+        return ERROR_ILLEGAL_MEMORY_ACCESS;
+    }
+    Word result;
+    memcpy(&result, &words[0], sizeof(Word));
+    for(Word i = 1; i < frame[1]; i++){
+        Word word;
+        memcpy(&word, &words[i], sizeof(Word));
+        result = word > result ? word : result;
+    }
+    frame[0] = result;
+    return ERROR_OK;
+}
+
+// Sum of the words, wrapping around like the plus instruction does in practice.
+static Error cvm_native_range_sum(Cvm *cvm, Word *frame){
+    const Word *words = cvm_native_words(cvm, frame[0], frame[1]);
+    if(words == NULL){
+        return ERROR_ILLEGAL_MEMORY_ACCESS;
+    }
+    uint64_t result = 0;
+    for(Word i = 0; i < frame[1]; i++){
+        Word word;
+        memcpy(&word, &words[i], sizeof(Word));
+        result += (uint64_t) word;
+    }
+    frame[0] = (Word) result;
+    return ERROR_OK;
+}
 
+#define CVM_NATIVES_CAPACITY 256
+
+// The registry programs call into. The standard set always comes first, in this
+// order, so its indices are the same in every host; cvm_register_native appends.
+static Cvm_Native cvm_natives[CVM_NATIVES_CAPACITY] = {
+    { "min", 2, 1, cvm_native_min },
+    { "max", 2, 1, cvm_native_max },
+    { "abs", 1, 1, cvm_native_abs },
+    { "isqrt", 1, 1, cvm_native_isqrt },
+    { "hash", 2, 1, cvm_native_hash },
+    { "range_min", 2, 1, cvm_native_range_min },
+    { "range_max", 2, 1, cvm_native_range_max },
+    { "range_sum", 2, 1, cvm_native_range_sum },
+};
+static size_t cvm_natives_count = 8;
+
+// The native with the given index, or NULL when there is none.
+const Cvm_Native *cvm_native_at(Word index){
+    if(index < 0 || (size_t) index >= cvm_natives_count){
+        return NULL;
+    }
+    return &cvm_natives[index];
+}
+
+// Index of the native called name, or -1.
+Word cvm_find_native(const char *name, size_t name_count){
+    for(size_t i = 0; i < cvm_natives_count; i++){
+        if(strlen(cvm_natives[i].name) == name_count && memcmp(cvm_natives[i].name, name, name_count) == 0){
+            return (Word) i;
+        }
+    }
+    return -1;
+}
+
+// Adds a host function after everything registered so far and returns its index.
+// Programs refer to natives by index, so a host has to register the same functions
+// in the same order before it assembles, verifies or runs anything.
+Word cvm_register_native(const char *name, Word arity, Word results, Cvm_Native_Fn fn){
+    if(cvm_find_native(name, strlen(name)) >= 0){
+        cvm_fail("Native '%s' is already registered\n", name);
+    }
+    if(cvm_natives_count >= CVM_NATIVES_CAPACITY){
+        cvm_fail("Too many natives, at most %d\n", CVM_NATIVES_CAPACITY);
+    }
+    if(arity < 0 || results < 0){
+        cvm_fail("Native '%s' has a negative arity or result count\n", name);
+    }
+    cvm_natives[cvm_natives_count] = (Cvm_Native){ name, arity, results, fn };
+    return (Word) cvm_natives_count++;
+}
+
+static Error cvm_ex_plain_inst(Cvm *cvm, Inst inst){
+    Word *stack = cvm->stack;
+    Word sp = cvm->stack_size;
     switch(inst.type){
         case INST_NOP:
             cvm->ip++;
             return ERROR_OK_NO_INST;
         case INST_PUSH:
-            if(cvm->stack_size >= CVM_STACK_CAPACITY){
+            if(cvm->stack_size >= cvm->stack_capacity && !cvm_stack_reserve(cvm, cvm->stack_size + 1)){
                 return ERROR_STACK_OVERFLOW;
             }
             cvm->stack[cvm->stack_size++] = inst.operand;
             cvm->ip++;
             break;
         case INST_DUP:
-            if(cvm->stack_size >= CVM_STACK_CAPACITY){
+            if(cvm->stack_size >= cvm->stack_capacity && !cvm_stack_reserve(cvm, cvm->stack_size + 1)){
                 return ERROR_STACK_OVERFLOW;
             }
             if(cvm->stack_size - inst.operand <= 0){
@@ -251,25 +766,213 @@ Error cvm_ex_inst(Cvm *cvm){
             if(cvm->stack_size < 1){
                 return ERROR_STACK_UNDERFLOW;
             }
-            printf("%lld\n", cvm->stack[cvm->stack_size-1]);
+            cvm_output_word(cvm, cvm->stack[cvm->stack_size-1]);
             cvm->stack_size--;
             cvm->ip++;
             break;
+        case INST_LOAD:
+            if(sp < 1){
+                return ERROR_STACK_UNDERFLOW;
+            }
+            if(!cvm_memory_range_ok(cvm, stack[sp - 1], sizeof(Word))){
+                return ERROR_ILLEGAL_MEMORY_ACCESS;
+            }
+            memcpy(&stack[sp - 1], cvm_memory(cvm) + stack[sp - 1], sizeof(Word));
+            cvm->ip++;
+            break;
+        case INST_STORE:
+            if(sp < 2){
+                return ERROR_STACK_UNDERFLOW;
+            }
+            if(!cvm_memory_range_ok(cvm, stack[sp - 2], sizeof(Word))){
+                return ERROR_ILLEGAL_MEMORY_ACCESS;
+            }
+            memcpy(cvm_memory(cvm) + stack[sp - 2], &stack[sp - 1], sizeof(Word));
+            cvm_memory_touch(cvm, stack[sp - 2], sizeof(Word));
+            cvm->stack_size -= 2;
+            cvm->ip++;
+            break;
+        case INST_MEMCPY:
+            if(sp < 3){
+                return ERROR_STACK_UNDERFLOW;
+            }
+            if(!cvm_memory_range_ok(cvm, stack[sp - 3], stack[sp - 1]) || !cvm_memory_range_ok(cvm, stack[sp - 2], stack[sp - 1])){
+                return ERROR_ILLEGAL_MEMORY_ACCESS;
+            }
+            {
+                char *memory = cvm_memory(cvm);
+                memmove(memory + stack[sp - 3], memory + stack[sp - 2], stack[sp - 1]);
+            }
+            cvm_memory_touch(cvm, stack[sp - 3], stack[sp - 1]);
+            cvm->stack_size -= 3;
+            cvm->ip++;
+            break;
+        case INST_MEMSET:
+            if(sp < 3){
+                return ERROR_STACK_UNDERFLOW;
+            }
+            if(!cvm_memory_range_ok(cvm, stack[sp - 3], stack[sp - 1])){
+                return ERROR_ILLEGAL_MEMORY_ACCESS;
+            }
+            memset(cvm_memory(cvm) + stack[sp - 3], (unsigned char) stack[sp - 2], stack[sp - 1]);
+            cvm_memory_touch(cvm, stack[sp - 3], stack[sp - 1]);
+            cvm->stack_size -= 3;
+            cvm->ip++;
+            break;
+        case INST_ALLOC: {
+            if(sp < 1){
+                return ERROR_STACK_UNDERFLOW;
+            }
+            if(stack[sp - 1] < 0){
+                return ERROR_ILLEGAL_OPERAND;
+            }
+            size_t addr = (cvm->arena + sizeof(Word) - 1) & ~(sizeof(Word) - 1);
+            if(addr > cvm->memory_size || (uint64_t) stack[sp - 1] > cvm->memory_size - addr){
+                return ERROR_OUT_OF_MEMORY;
+            }
+            cvm->arena = addr + (size_t) stack[sp - 1];
+            stack[sp - 1] = (Word) addr;
+            cvm->ip++;
+            break;
+        }
+        case INST_RESET:
+            cvm->arena = 0;
+            cvm->ip++;
+            break;
+        case INST_NATIVE: {
+            const Cvm_Native *native = cvm_native_at(inst.operand);
+            if(native == NULL){
+                return ERROR_ILLEGAL_OPERAND;
+            }
+            if(sp < native->arity){
+                return ERROR_STACK_UNDERFLOW;
+            }
+            if(native->results > native->arity && native->results - native->arity > cvm->stack_capacity - sp){
+                if(!cvm_stack_reserve(cvm, sp - native->arity + native->results)){
+                    return ERROR_STACK_OVERFLOW;
+                }
+                stack = cvm->stack;
+            }
+            Error error = native->fn(cvm, &stack[sp - native->arity]);
+            if(error != ERROR_OK){
+                return error;
+            }
+            cvm->stack_size = sp - native->arity + native->results;
+            cvm->ip++;
+            break;
+        }
+        case INST_CALL:
+            if(cvm->return_stack_size >= cvm->return_stack_capacity && !cvm_return_stack_reserve(cvm, cvm->return_stack_size + 1)){
+                return ERROR_RETURN_STACK_OVERFLOW;
+            }
+            cvm->return_stack[cvm->return_stack_size++] = cvm->ip + 1;
+            cvm->ip = inst.operand;
+            break;
+        case INST_RET:
+            if(cvm->return_stack_size < 1){
+                return ERROR_RETURN_STACK_UNDERFLOW;
+            }
+            cvm->ip = cvm->return_stack[--cvm->return_stack_size];
+            break;
+        case INST_YIELD:
+            cvm->yielded = 1;
+            cvm->ip++;
+            break;
+        case INST_PLUS_IMM:
+        case INST_PUSH2:
+        case INST_JMP_IF_EQ:
         default:
             return ERROR_ILLEGAL_INST;
     }
     return ERROR_OK;
 }
 
+// Executes the instruction at ip and reports in *retired how many source instructions
+// it accounted for (0 for a NOP). A fused instruction only runs as a whole when it
+// fits in budget (negative means unlimited) and none of its steps would fault;
+// otherwise just its head runs, so errors and ip are the same as for the unfused code.
+Error cvm_ex_inst_limited(Cvm *cvm, int budget, int *retired){
+    if(cvm->ip < 0 || cvm->ip >= cvm->program_size){
+        return ERROR_ILLEGAL_INST_ACCESS;
+    }
+
+    Inst inst = cvm->program[cvm->ip];
+    Word length = inst_fused_length(inst.type);
+    Word sp = cvm->stack_size;
+
+    if(length > 1 && (cvm->ip + length > cvm->program_size || (budget >= 0 && budget < length))){
+        inst = inst_fused_head(inst);
+    }
+    else if(inst.type == INST_JMP_IF_EQ){
+        // A branch out of the program has to fault from the jmp_if in the tail.
+        Word target = cvm->program[cvm->ip + 3].operand;
+        if(target < 0 || target >= cvm->program_size){
+            inst = inst_fused_head(inst);
+        }
+    }
+
+    if(inst.type == INST_PLUS_IMM){
+        if(sp >= 1 && sp < cvm->stack_capacity){
+            cvm->stack[sp - 1] += inst.operand;
+            cvm->ip += 2;
+            *retired = 2;
+            return ERROR_OK;
+        }
+        inst = inst_fused_head(inst);
+    }
+    else if(inst.type == INST_PUSH2){
+        if(sp + 2 <= cvm->stack_capacity){
+            cvm->stack[sp] = inst.operand;
+            cvm->stack[sp + 1] = cvm->program[cvm->ip + 1].operand;
+            cvm->stack_size += 2;
+            cvm->ip += 2;
+            *retired = 2;
+            return ERROR_OK;
+        }
+        inst = inst_fused_head(inst);
+    }
+    else if(inst.type == INST_JMP_IF_EQ){
+        if(sp >= 1 && sp + 2 <= cvm->stack_capacity){
+            if(cvm->stack[sp - 1] == inst.operand){
+                cvm->ip = cvm->program[cvm->ip + 3].operand;
+            }
+            else{
+                cvm->stack[cvm->stack_size++] = 0;
+                cvm->ip += 4;
+            }
+            *retired = 4;
+            return ERROR_OK;
+        }
+        inst = inst_fused_head(inst);
+    }
+
+    *retired = inst.type == INST_NOP ? 0 : 1;
+    return cvm_ex_plain_inst(cvm, inst);
+}
+
+Error cvm_ex_inst(Cvm *cvm){
+    int retired;
+    return cvm_ex_inst_limited(cvm, -1, &retired);
+}
+
 void cvm_dump_stack(FILE *stream, const Cvm *cvm){
     fprintf(stream, "Stack:\n");
     if (cvm->stack_size <= 0){
         fprintf(stream, "[Empty]\n");
     }
     else {
+        // Formatted in chunks rather than one fprintf per slot; deep stacks are common.
+        char chunk[4096];
+        size_t size = 0;
         for(Word i = 0; i < cvm->stack_size; i++){
-            fprintf(stream, "%lld\n", cvm->stack[i]);
+            if(size + 24 > sizeof(chunk)){
+                fwrite(chunk, 1, size, stream);
+                size = 0;
+            }
+            size += cvm_format_word(chunk + size, cvm->stack[i]);
+            chunk[size++] = '\n';
         }
+        fwrite(chunk, 1, size, stream);
     }
     fprintf(stream, "\n");
 }
@@ -336,6 +1039,30 @@ String_view string_view_chop_by_delim(String_view *sv, char delim){
     return result;
 }
 
+// Assembler state for one translation. Label names and jump operands are views
+// into the source, which has to outlive the context.
+typedef struct {
+    String_view name;
+    Word addr;
+} Label;
+
+typedef struct{
+    String_view label;
+    Word addr;
+} Jump;
+
+typedef struct {
+    // Open addressing hash table, capacity a power of two, empty slots have a NULL name.
+    Label *labels;
+    size_t label_count;
+    size_t label_capacity;
+
+    // One fixup per jump site, patched once the whole source is read.
+    Jump *jumps;
+    size_t jump_count;
+    size_t jump_capacity;
+} Cvm_Asm;
+
 int string_view_eq(String_view a, String_view b){
     if(a.count != b.count){
         return 0;
@@ -353,55 +1080,113 @@ int string_view_to_int(String_view sv){
     return result;
 }
 
+// Parses all of text as a decimal number from min to max. Anything else, trailing
+// characters and out of range values included, leaves *value alone and returns 0.
+int cvm_long_from_cstr(const char *text, long min, long max, long *value){
+    char *end;
+    errno = 0;
+    long result = strtol(text, &end, 10);
+    if(end == text || *end != '\0' || errno != 0 || result < min || result > max){
+        return 0;
+    }
+    *value = result;
+    return 1;
+}
+
 int string_view_is_label(String_view sv){
     return sv.count > 0 && sv.data[sv.count - 1] == ':';
 }
 
-int label_dup(String_view label){
-    for(size_t i = 0; i < label_count; i++){
-        if(string_view_eq(label, cstr_as_string_view((const char *) label_table[i].name))){
-            return 1;
+void cvm_asm_destroy(Cvm_Asm *cvm_asm){
+    cvm_free(cvm_asm->labels);
+    cvm_free(cvm_asm->jumps);
+    *cvm_asm = (Cvm_Asm){0};
+}
+
+static size_t string_view_hash(String_view sv){
+    uint64_t hash = 14695981039346656037ull; // FNV-1a
+    for(size_t i = 0; i < sv.count; i++){
+        hash ^= (unsigned char) sv.data[i];
+        hash *= 1099511628211ull;
+    }
+    return (size_t) hash;
+}
+
+// Slot holding name, or the empty slot where it would go.
+static Label *cvm_asm_label_slot(Label *labels, size_t capacity, String_view name){
+    size_t i = string_view_hash(name) & (capacity - 1);
+    while(labels[i].name.data != NULL && !string_view_eq(labels[i].name, name)){
+        i = (i + 1) & (capacity - 1);
+    }
+    return &labels[i];
+}
+
+Label *cvm_asm_find_label(const Cvm_Asm *cvm_asm, String_view name){
+    if(cvm_asm->label_count == 0){
+        return NULL;
+    }
+    Label *slot = cvm_asm_label_slot(cvm_asm->labels, cvm_asm->label_capacity, name);
+    return slot->name.data != NULL ? slot : NULL;
+}
+
+void cvm_asm_add_label(Cvm_Asm *cvm_asm, String_view name, Word addr){
+    // Keep the load factor under 3/4 so probe sequences stay short.
+    if((cvm_asm->label_count + 1) * 4 > cvm_asm->label_capacity * 3){
+        size_t capacity = cvm_asm->label_capacity == 0 ? 64 : cvm_asm->label_capacity * 2;
+        Label *labels = cvm_calloc(capacity, sizeof(Label));
+        if(labels == NULL){
+            cvm_fail("Out of memory : %s\n", strerror(errno));
+        }
+        for(size_t i = 0; i < cvm_asm->label_capacity; i++){
+            if(cvm_asm->labels[i].name.data != NULL){
+                *cvm_asm_label_slot(labels, capacity, cvm_asm->labels[i].name) = cvm_asm->labels[i];
+            }
         }
+        cvm_free(cvm_asm->labels);
+        cvm_asm->labels = labels;
+        cvm_asm->label_capacity = capacity;
     }
-    return 0;
+
+    Label *slot = cvm_asm_label_slot(cvm_asm->labels, cvm_asm->label_capacity, name);
+    if(slot->name.data != NULL){
+        cvm_fail("Duplicated label '%.*s'\n", (int) name.count, name.data);
+    }
+    slot->name = name;
+    slot->addr = addr;
+    cvm_asm->label_count++;
+}
+
+void cvm_asm_add_jump(Cvm_Asm *cvm_asm, String_view label, Word addr){
+    if(cvm_asm->jump_count >= cvm_asm->jump_capacity){
+        cvm_asm->jump_capacity = cvm_asm->jump_capacity == 0 ? 64 : cvm_asm->jump_capacity * 2;
+        cvm_asm->jumps = cvm_realloc(cvm_asm->jumps, sizeof(Jump) * cvm_asm->jump_capacity);
+        if(cvm_asm->jumps == NULL){
+            cvm_fail("Out of memory : %s\n", strerror(errno));
+        }
+    }
+    cvm_asm->jumps[cvm_asm->jump_count++] = (Jump){ .label = label, .addr = addr };
 }
 
 int string_view_is_comment(String_view sv){
     return sv.count > 0 && sv.data[0] == '#';
 }
 
-Inst cvm_translate_line(String_view line, size_t program_size){
+Inst cvm_translate_line(Cvm_Asm *cvm_asm, String_view line, size_t program_size){
     line = string_view_trim_left(line);
     String_view inst_name = string_view_chop_by_delim(&line,' ');
     String_view op = string_view_chop_by_delim(&line, ' '); // Now line has the in-line comment (if there is any).
 
     if(line.count > 0 && line.data[0] != '#' && inst_name.data[0] != '#'){ // In-line invalid comment
-        fprintf(stderr, "ERROR: Invalid operation '%.*s'\n", (int) line.count, line.data);
-        exit(1);
+        cvm_fail("Invalid operation '%.*s'\n", (int) line.count, line.data);
     }
 
     if(string_view_is_comment(inst_name)){
         return MAKE_INST_NOP;
     }
     else if(string_view_is_label(inst_name)){
-        if(label_count >= MAX_LABELS){
-            fprintf(stderr, "ERROR: Too many labels\n");
-            exit(1);
-        }
-        if(inst_name.count >= MAX_LABEL_LENGTH){
-            fprintf(stderr, "ERROR: Label too long\n");
-            exit(1);
-        }
         inst_name.count -= 1;
-        if(label_dup(inst_name)){
-            fprintf(stderr, "ERROR: Duplicated label\n");
-            exit(1);
-        }
         inst_name = string_view_trim_right(inst_name);
-        label_table[label_count].addr = program_size;
-        memcpy(label_table[label_count].name, inst_name.data, inst_name.count);
-        label_table[label_count].name[inst_name.count] = '\0';
-        label_count++;
+        cvm_asm_add_label(cvm_asm, inst_name, program_size);
         return MAKE_INST_NOP;
     }
     else if(string_view_eq(inst_name, cstr_as_string_view("push"))){
@@ -427,91 +1212,486 @@ Inst cvm_translate_line(String_view line, size_t program_size){
         return (Inst) MAKE_INST_DIV;
     }
     else if(string_view_eq(inst_name, cstr_as_string_view("jmp"))){
-        if(jump_count >= MAX_JUMPS){
-            fprintf(stderr, "ERROR: Too many jumps\n");
-            exit(1);
-        }
         op = string_view_trim_left(op);
         String_view operand = string_view_trim_right(op);
-        jump_table[jump_count].addr = program_size;
-        memcpy(jump_table[jump_count].label, operand.data, operand.count);
-        jump_table[jump_count].label[operand.count] = '\0';
-        jump_count++;
+        cvm_asm_add_jump(cvm_asm, operand, program_size);
         int place_holder = program_size;
         return (Inst) MAKE_INST_JMP(place_holder);
     }
+    else if(string_view_eq(inst_name, cstr_as_string_view("jmp_if"))){
+        op = string_view_trim_left(op);
+        String_view operand = string_view_trim_right(op);
+        cvm_asm_add_jump(cvm_asm, operand, program_size);
+        int place_holder = program_size;
+        return (Inst) MAKE_INST_JMP_IF(place_holder);
+    }
+    else if(string_view_eq(inst_name, cstr_as_string_view("eq"))){
+        return (Inst) MAKE_INST_EQ;
+    }
+    else if(string_view_eq(inst_name, cstr_as_string_view("print_debug"))){
+        return (Inst) MAKE_INST_PRINT_DEBUG;
+    }
+    else if(string_view_eq(inst_name, cstr_as_string_view("nop"))){
+        return MAKE_INST_NOP;
+    }
     else if(string_view_eq(inst_name, cstr_as_string_view("halt"))){
         return (Inst) MAKE_INST_HALT;
     }
+    else if(string_view_eq(inst_name, cstr_as_string_view("load"))){
+        return (Inst) MAKE_INST_LOAD;
+    }
+    else if(string_view_eq(inst_name, cstr_as_string_view("store"))){
+        return (Inst) MAKE_INST_STORE;
+    }
+    else if(string_view_eq(inst_name, cstr_as_string_view("memcpy"))){
+        return (Inst) MAKE_INST_MEMCPY;
+    }
+    else if(string_view_eq(inst_name, cstr_as_string_view("memset"))){
+        return (Inst) MAKE_INST_MEMSET;
+    }
+    else if(string_view_eq(inst_name, cstr_as_string_view("alloc"))){
+        return (Inst) MAKE_INST_ALLOC;
+    }
+    else if(string_view_eq(inst_name, cstr_as_string_view("reset"))){
+        return (Inst) MAKE_INST_RESET;
+    }
+    else if(string_view_eq(inst_name, cstr_as_string_view("native"))){
+        String_view name = string_view_trim(op);
+        Word index = cvm_find_native(name.data, name.count);
+        if(index < 0){
+            cvm_fail("Unknown native '%.*s'\n", (int) name.count, name.data);
+        }
+        return (Inst) MAKE_INST_NATIVE(index);
+    }
+    else if(string_view_eq(inst_name, cstr_as_string_view("call"))){
+        op = string_view_trim_left(op);
+        String_view operand = string_view_trim_right(op);
+        cvm_asm_add_jump(cvm_asm, operand, program_size);
+        int place_holder = program_size;
+        return (Inst) MAKE_INST_CALL(place_holder);
+    }
+    else if(string_view_eq(inst_name, cstr_as_string_view("ret"))){
+        return (Inst) MAKE_INST_RET;
+    }
+    else if(string_view_eq(inst_name, cstr_as_string_view("yield"))){
+        return (Inst) MAKE_INST_YIELD;
+    }
     else{
-        fprintf(stderr, "ERROR: unknown operation '%.*s'", (int) inst_name.count, inst_name.data);
-        exit(1);
+        cvm_fail("unknown operation '%.*s'", (int) inst_name.count, inst_name.data);
     }
 }
 
-void cvm_translate_jumps(Inst *program, size_t program_size){
-    for(size_t i = 0; i < program_size; i++){
-        if(program[i].type == INST_JMP){
-            for(size_t j = 0; j < jump_count; j++){
-                for(size_t k = 0; k < label_count; k++){
-                    if(strcmp((const char *) jump_table[j].label, (const char *) label_table[k].name) == 0){
-                        program[i].operand = label_table[k].addr;
-                        break;
-                    }
-                }
-            }
+// Patches every jump site with the address of its own label.
+void cvm_translate_jumps(const Cvm_Asm *cvm_asm, Inst *program){
+    for(size_t i = 0; i < cvm_asm->jump_count; i++){
+        const Jump *jump = &cvm_asm->jumps[i];
+        const Label *label = cvm_asm_find_label(cvm_asm, jump->label);
+        if(label == NULL){
+            cvm_fail("Unknown label '%.*s'\n", (int) jump->label.count, jump->label.data);
         }
+        program[jump->addr].operand = label->addr;
     }
 }
 
-size_t cvm_translate_source(String_view source, Inst *program, size_t program_capacity){
+// Assembles source into *program, growing it (and *program_capacity) as needed.
+size_t cvm_translate_source(String_view source, Inst **program, size_t *program_capacity){
+    Cvm_Asm cvm_asm = {0};
     size_t program_size = 0;
     while(source.count > 0){
-        assert(program_size < program_capacity);
         String_view line = string_view_trim(string_view_chop_by_delim(&source, '\n'));
         if(line.count <= 0){
             continue;
         }
-        program[program_size] = cvm_translate_line(line, program_size);
+        if(program_size >= *program_capacity){
+            *program_capacity = *program_capacity == 0 ? 256 : *program_capacity * 2;
+            *program = cvm_realloc(*program, sizeof(Inst) * *program_capacity);
+            if(*program == NULL){
+                cvm_fail("Out of memory : %s\n", strerror(errno));
+            }
+        }
+        (*program)[program_size] = cvm_translate_line(&cvm_asm, line, program_size);
         program_size+=1;
     }
-    cvm_translate_jumps(program, program_size);
+    cvm_translate_jumps(&cvm_asm, *program);
+    cvm_asm_destroy(&cvm_asm);
+    return program_size;
+}
+
+// Peephole pass over an assembled program: the head of every recognised sequence
+// is rewritten into a superinstruction. The tail stays where it was, so program
+// size and jump targets are unchanged. Returns how many sequences were fused.
+size_t cvm_fuse_program(Inst *program, size_t program_size){
+    size_t fused = 0;
+    size_t i = 0;
+    while(i < program_size){
+        Inst *p = &program[i];
+        size_t left = program_size - i;
+        if(left >= 4 && p[0].type == INST_DUP && p[0].operand == 0
+                && p[1].type == INST_PUSH && p[2].type == INST_EQ && p[3].type == INST_JMP_IF){
+            p[0].type = INST_JMP_IF_EQ;
+            p[0].operand = p[1].operand;
+        }
+        else if(left >= 2 && p[0].type == INST_PUSH && p[1].type == INST_PLUS){
+            p[0].type = INST_PLUS_IMM;
+        }
+        else if(left >= 2 && p[0].type == INST_PUSH && p[1].type == INST_PUSH){
+            p[0].type = INST_PUSH2;
+        }
+        else{
+            i++;
+            continue;
+        }
+        i += inst_fused_length(p[0].type);
+        fused++;
+    }
+    return fused;
+}
+
+// Removes every instruction whose keep flag is clear and moves jump targets along.
+// A jump to a removed instruction lands on the next one kept; a target outside the
+// program stays outside it. Returns the new program size.
+static size_t cvm_compact_program(Inst *program, size_t program_size, const char *keep){
+    size_t *map = cvm_malloc(sizeof(size_t) * (program_size + 1));
+    if(map == NULL){
+        cvm_fail("Out of memory : %s\n", strerror(errno));
+    }
+    size_t kept = 0;
+    for(size_t i = 0; i < program_size; i++){
+        map[i] = kept;
+        kept += keep[i] != 0;
+    }
+    map[program_size] = kept;
+
+    size_t j = 0;
+    for(size_t i = 0; i < program_size; i++){
+        if(!keep[i]){
+            continue;
+        }
+        Inst inst = program[i];
+        if(inst.type == INST_JMP || inst.type == INST_JMP_IF || inst.type == INST_CALL){
+            if(inst.operand >= 0 && (size_t) inst.operand <= program_size){
+                inst.operand = map[inst.operand];
+            }
+            else if(inst.operand > 0){
+                inst.operand -= program_size - kept;
+            }
+        }
+        program[j++] = inst;
+    }
+    cvm_free(map);
+    return kept;
+}
+
+static size_t cvm_strip_nops(Inst *program, size_t program_size, char *keep){
+    for(size_t i = 0; i < program_size; i++){
+        keep[i] = program[i].type != INST_NOP;
+    }
+    return cvm_compact_program(program, program_size, keep);
+}
+
+// Points jumps and calls that land on an unconditional jmp straight at its final
+// target. A jmp to the very next instruction does nothing and becomes a NOP.
+static void cvm_thread_jumps(Inst *program, size_t program_size){
+    for(size_t i = 0; i < program_size; i++){
+        if(program[i].type != INST_JMP && program[i].type != INST_JMP_IF && program[i].type != INST_CALL){
+            continue;
+        }
+        Word target = program[i].operand;
+        // A chain longer than the program is a cycle of jmps; leave it spinning.
+        for(size_t hops = 0; hops < program_size; hops++){
+            if(target < 0 || (size_t) target >= program_size || program[target].type != INST_JMP){
+                break;
+            }
+            target = program[target].operand;
+        }
+        program[i].operand = target;
+        if(program[i].type == INST_JMP && (size_t) target == i + 1){
+            program[i] = MAKE_INST_NOP;
+        }
+    }
+}
+
+// Result of push a; push b; op, or 0 when folding would change what the program
+// does: division by zero has to fault at run time and overflowing arithmetic is
+// left to the machine.
+static int cvm_fold_binary(Inst_Type type, Word a, Word b, Word *result){
+    switch(type){
+        case INST_PLUS:
+            if((b > 0 && a > INT64_MAX - b) || (b < 0 && a < INT64_MIN - b)){
+                return 0;
+            }
+            *result = a + b;
+            return 1;
+        case INST_MINUS:
+            if((b < 0 && a > INT64_MAX + b) || (b > 0 && a < INT64_MIN + b)){
+                return 0;
+            }
+            *result = a - b;
+            return 1;
+        case INST_MULT:
+            if(a != 0 && b != 0){
+                uint64_t magnitude = (uint64_t) (a < 0 ? -(a + 1) : a) + (a < 0);
+                uint64_t limit = (a < 0) == (b < 0) ? (uint64_t) INT64_MAX : (uint64_t) INT64_MAX + 1;
+                uint64_t other = (uint64_t) (b < 0 ? -(b + 1) : b) + (b < 0);
+                if(other > limit / magnitude){
+                    return 0;
+                }
+            }
+            *result = (Word) ((uint64_t) a * (uint64_t) b);
+            return 1;
+        case INST_DIV:
+            if(b == 0 || (a == INT64_MIN && b == -1)){
+                return 0;
+            }
+            *result = a / b;
+            return 1;
+        case INST_NOP:
+        case INST_PUSH:
+        case INST_DUP:
+        case INST_JMP:
+        case INST_JMP_IF:
+        case INST_EQ:
+        case INST_HALT:
+        case INST_PRINT_DEBUG:
+        case INST_PLUS_IMM:
+        case INST_PUSH2:
+        case INST_JMP_IF_EQ:
+        case INST_LOAD:
+        case INST_STORE:
+        case INST_MEMCPY:
+        case INST_MEMSET:
+        case INST_ALLOC:
+        case INST_RESET:
+        case INST_NATIVE:
+        case INST_CALL:
+        case INST_RET:
+        case INST_YIELD:
+        default:
+            return 0;
+    }
+}
+
+// Collapses push a; push b; op into push result, repeatedly, so whole constant
+// expressions fold. Nothing is folded across a jump or call target.
+static size_t cvm_fold_constants(Inst *program, size_t program_size, char *keep){
+    char *target = cvm_calloc(program_size + 1, 1);
+    size_t *emitted = cvm_malloc(sizeof(size_t) * (program_size + 1));
+    if(target == NULL || emitted == NULL){
+        cvm_fail("Out of memory : %s\n", strerror(errno));
+    }
+    for(size_t i = 0; i < program_size; i++){
+        Inst inst = program[i];
+        if((inst.type == INST_JMP || inst.type == INST_JMP_IF || inst.type == INST_CALL)
+                && inst.operand >= 0 && (size_t) inst.operand < program_size){
+            target[inst.operand] = 1;
+        }
+    }
+
+    size_t emitted_count = 0;
+    for(size_t i = 0; i < program_size; i++){
+        keep[i] = 1;
+        if(emitted_count >= 2 && !target[i]){
+            size_t a = emitted[emitted_count - 2];
+            size_t b = emitted[emitted_count - 1];
+            Word result;
+            if(program[a].type == INST_PUSH && program[b].type == INST_PUSH && !target[b]
+                    && cvm_fold_binary(program[i].type, program[a].operand, program[b].operand, &result)){
+                program[a].operand = result;
+                keep[b] = 0;
+                keep[i] = 0;
+                emitted_count -= 1;
+                continue;
+            }
+        }
+        emitted[emitted_count++] = i;
+    }
+
+    cvm_free(emitted);
+    cvm_free(target);
+    return cvm_compact_program(program, program_size, keep);
+}
+
+// Drops everything that no path from ip 0 reaches, e.g. code after a halt or a jmp.
+static size_t cvm_drop_unreachable(Inst *program, size_t program_size, char *keep){
+    size_t *worklist = cvm_malloc(sizeof(size_t) * (program_size + 1));
+    if(worklist == NULL){
+        cvm_fail("Out of memory : %s\n", strerror(errno));
+    }
+    memset(keep, 0, program_size);
+    size_t worklist_size = 0;
+    if(program_size > 0){
+        keep[0] = 1;
+        worklist[worklist_size++] = 0;
+    }
+    while(worklist_size > 0){
+        size_t ip = worklist[--worklist_size];
+        Inst inst = program[ip];
+        Word next[2];
+        int next_count = 0;
+        if(inst.type == INST_JMP){
+            next[next_count++] = inst.operand;
+        }
+        else if(inst.type == INST_JMP_IF || inst.type == INST_CALL){
+            // The instruction after a call is where its ret comes back to.
+            next[next_count++] = inst.operand;
+            next[next_count++] = (Word) ip + 1;
+        }
+        else if(inst.type != INST_HALT && inst.type != INST_RET){
+            next[next_count++] = (Word) ip + 1;
+        }
+        for(int k = 0; k < next_count; k++){
+            if(next[k] >= 0 && (size_t) next[k] < program_size && !keep[next[k]]){
+                keep[next[k]] = 1;
+                worklist[worklist_size++] = (size_t) next[k];
+            }
+        }
+    }
+    cvm_free(worklist);
+    return cvm_compact_program(program, program_size, keep);
+}
+
+// Optimizes an assembled, unfused program in place and returns its new size.
+// Level 1 strips NOPs and unreachable code, which keeps the number of retired
+// instructions, and so the meaning of -l, exactly as before. Level 2 also threads
+// jumps and folds constants, so programs may retire fewer instructions.
+size_t cvm_optimize_program(Inst *program, size_t program_size, int level){
+    if(level <= 0 || program_size == 0){
+        return program_size;
+    }
+    char *keep = cvm_malloc(program_size);
+    if(keep == NULL){
+        cvm_fail("Out of memory : %s\n", strerror(errno));
+    }
+    program_size = cvm_strip_nops(program, program_size, keep);
+    program_size = cvm_drop_unreachable(program, program_size, keep);
+    // Each pass can open up work for the others, e.g. dropping dead code leaves
+    // jumps to the next instruction, so repeat until nothing changes.
+    for(size_t before = 0; level >= 2 && program_size != before;){
+        before = program_size;
+        cvm_thread_jumps(program, program_size);
+        program_size = cvm_strip_nops(program, program_size, keep);
+        program_size = cvm_fold_constants(program, program_size, keep);
+        program_size = cvm_drop_unreachable(program, program_size, keep);
+    }
+    cvm_free(keep);
     return program_size;
 }
 
+// Instructions in the leaf routine at entry, not counting NOPs, or -1 when it is
+// not a leaf: a straight run closed by a ret, with no jump, call or halt before it.
+static Word cvm_leaf_routine_cost(const Inst *program, size_t program_size, Word entry){
+    if(entry < 0 || (size_t) entry >= program_size){
+        return -1;
+    }
+    Word cost = 0;
+    for(size_t j = (size_t) entry; j < program_size; j++){
+        Inst_Type type = program[j].type;
+        if(type == INST_RET){
+            return cost;
+        }
+        if(type == INST_JMP || type == INST_JMP_IF || type == INST_JMP_IF_EQ || type == INST_CALL || type == INST_HALT){
+            return -1;
+        }
+        cost += type != INST_NOP;
+    }
+    return -1;
+}
+
+// Replaces every call to a leaf routine of at most threshold instructions with a
+// copy of the routine's body, which saves the call, the ret and their dispatches.
+// The routine stays where it is; -O1 drops it once no call reaches it any more.
+// Like -O2 this makes programs retire fewer instructions. Jump targets move along
+// as in cvm_compact_program. Returns how many calls were inlined.
+size_t cvm_inline_calls(Inst **program, size_t *program_size, size_t *program_capacity, size_t threshold){
+    const Inst *inst = *program;
+    size_t size = *program_size;
+    Word *cost = cvm_malloc(sizeof(Word) * (size + 1));
+    size_t *map = cvm_malloc(sizeof(size_t) * (size + 1));
+    if(cost == NULL || map == NULL){
+        cvm_fail("Out of memory : %s\n", strerror(errno));
+    }
+
+    size_t inlined = 0;
+    size_t new_size = 0;
+    for(size_t i = 0; i < size; i++){
+        cost[i] = -1;
+        if(inst[i].type == INST_CALL){
+            Word body = cvm_leaf_routine_cost(inst, size, inst[i].operand);
+            if(body >= 0 && (size_t) body <= threshold){
+                cost[i] = body;
+                inlined++;
+            }
+        }
+        map[i] = new_size;
+        new_size += cost[i] >= 0 ? (size_t) cost[i] : 1;
+    }
+    map[size] = new_size;
+
+    if(inlined > 0){
+        Inst *result = cvm_malloc(sizeof(Inst) * (new_size > 0 ? new_size : 1));
+        if(result == NULL){
+            cvm_fail("Out of memory : %s\n", strerror(errno));
+        }
+        size_t j = 0;
+        for(size_t i = 0; i < size; i++){
+            if(cost[i] >= 0){
+                // Leaf bodies hold no jumps, so the copy needs no retargeting.
+                for(Word k = inst[i].operand; inst[k].type != INST_RET; k++){
+                    if(inst[k].type != INST_NOP){
+                        result[j++] = inst[k];
+                    }
+                }
+                continue;
+            }
+            Inst copy = inst[i];
+            if(copy.type == INST_JMP || copy.type == INST_JMP_IF || copy.type == INST_CALL){
+                if(copy.operand >= 0 && (size_t) copy.operand <= size){
+                    copy.operand = (Word) map[copy.operand];
+                }
+                else if(copy.operand > 0){
+                    copy.operand = copy.operand - (Word) size + (Word) new_size;
+                }
+            }
+            result[j++] = copy;
+        }
+        cvm_free(*program);
+        *program = result;
+        *program_size = new_size;
+        *program_capacity = new_size > 0 ? new_size : 1;
+    }
+
+    cvm_free(map);
+    cvm_free(cost);
+    return inlined;
+}
+
 String_view slurp_file(const char *file_path){
-    FILE *f = fopen(file_path, "r");
+    FILE *f = fopen(file_path, "rb");
     if(f == NULL){
-        fprintf(stderr, "ERROR: Could not open file '%s': %s\n", file_path, strerror(errno));
-        exit(1);
+        cvm_fail("Could not open file '%s': %s\n", file_path, strerror(errno));
     }
 
     if(fseek(f, 0, SEEK_END) < 0){
-        fprintf(stderr, "ERROR: Could not read file '%s': %s\n", file_path, strerror(errno));
-        exit(1);
+        cvm_fail("Could not read file '%s': %s\n", file_path, strerror(errno));
     }
 
     long m = ftell(f);
     if(m < 0){
-        fprintf(stderr, "ERROR: Could not read file '%s': %s\n", file_path, strerror(errno));
-        exit(1);
+        cvm_fail("Could not read file '%s': %s\n", file_path, strerror(errno));
     }
 
-    char *buffer = malloc(m + 1);
+    char *buffer = cvm_malloc(m + 1);
     if(buffer == NULL){
-        fprintf(stderr, "ERROR: Out of memory : %s\n", strerror(errno));
-        exit(1);
+        cvm_fail("Out of memory : %s\n", strerror(errno));
     } 
 
     if(fseek(f, 0, SEEK_SET) < 0){
-        fprintf(stderr, "ERROR: Could not read file '%s': %s\n", file_path, strerror(errno));
-        exit(1);
+        cvm_fail("Could not read file '%s': %s\n", file_path, strerror(errno));
     }
 
     size_t n = fread(buffer, 1, m, f);
     if(ferror(f)){
-        fprintf(stderr, "ERROR: Could not read file '%s': %s\n", file_path, strerror(errno));
-        exit(1);
+        cvm_fail("Could not read file '%s': %s\n", file_path, strerror(errno));
     }
 
     fclose(f);
@@ -522,78 +1702,5038 @@ String_view slurp_file(const char *file_path){
     }; 
 }
 
-void cvm_load_program_from_memory(Cvm *cvm, const Inst *program, size_t program_size){
-    assert(program_size <= CVM_PROGRAM_CAPACITY);
-    memcpy(cvm->program, program, sizeof(Inst) * program_size);
-    cvm->program_size = program_size;
+static size_t cvm_page_size(void){
+    long page = sysconf(_SC_PAGESIZE);
+    return page > 0 ? (size_t) page : 4096;
 }
 
-void cvm_load_program_from_file(Cvm *cvm, const char *file_path){
-    FILE *f = fopen(file_path, "rb");
-    if(f == NULL){
-        fprintf(stderr, "ERROR: Could not open file '%s': %s\n", file_path, strerror(errno));
-        exit(1);
+static size_t cvm_round_to_pages(size_t size){
+    size_t page = cvm_page_size();
+    return (size + page - 1) / page * page;
+}
+
+// Data and return stacks come from a process-wide pool of power-of-two size
+// classes, CVM_STACK_MIN_WORDS words and up. A class carves page-mapped slabs
+// into blocks and keeps freed blocks for the next context, so a context that
+// uses a handful of slots costs a handful of words rather than a mapping of
+// its own. Stacks larger than the largest class are mapped on their own, with
+// a guard page after them. Like the mappings, the pool does not go through the
+// allocator hooks: a block may outlive the env that asked for it.
+#define CVM_STACK_MIN_WORDS 16
+#define CVM_STACK_CLASSES 10 // up to 8192 words
+#define CVM_STACK_SLAB_SIZE (256 * 1024)
+
+typedef struct Cvm_Stack_Block {
+    struct Cvm_Stack_Block *next;
+} Cvm_Stack_Block;
+
+typedef struct {
+    Cvm_Stack_Block *free;
+    char *slab; // unused tail of the newest slab
+    size_t slab_left;
+    size_t blocks_in_use;
+    size_t slab_bytes;
+} Cvm_Stack_Class;
+
+static pthread_mutex_t cvm_stack_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static Cvm_Stack_Class cvm_stack_classes[CVM_STACK_CLASSES];
+
+static size_t cvm_stack_class_words(int class){
+    return (size_t) CVM_STACK_MIN_WORDS << class;
+}
+
+// Smallest class that holds words, or -1 when none does.
+static int cvm_stack_class_of(size_t words){
+    for(int class = 0; class < CVM_STACK_CLASSES; class++){
+        if(words <= cvm_stack_class_words(class)){
+            return class;
+        }
     }
-    if(fseek(f, 0, SEEK_END) < 0){
-        fprintf(stderr, "ERROR: Could not read file '%s': %s\n", file_path, strerror(errno));
-        exit(1);
+    return -1;
+}
+
+static Word *cvm_stack_pool_take(int class){
+    size_t bytes = cvm_stack_class_words(class) * sizeof(Word);
+    Cvm_Stack_Class *pool = &cvm_stack_classes[class];
+    pthread_mutex_lock(&cvm_stack_pool_lock);
+    Word *block = NULL;
+    if(pool->free != NULL){
+        block = (Word *) pool->free;
+        pool->free = pool->free->next;
+    }
+    else{
+        if(pool->slab_left < bytes){
+            size_t slab_size = bytes > CVM_STACK_SLAB_SIZE ? bytes : CVM_STACK_SLAB_SIZE;
+            void *slab = mmap(NULL, slab_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+            if(slab == MAP_FAILED){
+                pthread_mutex_unlock(&cvm_stack_pool_lock);
+                cvm_fail("Could not allocate a stack slab of %zu bytes: %s\n", slab_size, strerror(errno));
+            }
+            pool->slab = slab;
+            pool->slab_left = slab_size;
+            pool->slab_bytes += slab_size;
+        }
+        block = (Word *) pool->slab;
+        pool->slab += bytes;
+        pool->slab_left -= bytes;
     }
+    pool->blocks_in_use++;
+    pthread_mutex_unlock(&cvm_stack_pool_lock);
+    return block;
+}
 
-    long m = ftell(f);
-    if(m < 0){
-        fprintf(stderr, "ERROR: Could not read file '%s': %s\n", file_path, strerror(errno));
-        exit(1);
+static void cvm_stack_pool_give(int class, Word *stack){
+    Cvm_Stack_Class *pool = &cvm_stack_classes[class];
+    pthread_mutex_lock(&cvm_stack_pool_lock);
+    Cvm_Stack_Block *block = (Cvm_Stack_Block *) stack;
+    block->next = pool->free;
+    pool->free = block;
+    pool->blocks_in_use--;
+    pthread_mutex_unlock(&cvm_stack_pool_lock);
+}
+
+// Bytes the pool has mapped, and how many of them live contexts hold.
+void cvm_stack_pool_stats(size_t *mapped, size_t *in_use){
+    *mapped = 0;
+    *in_use = 0;
+    pthread_mutex_lock(&cvm_stack_pool_lock);
+    for(int class = 0; class < CVM_STACK_CLASSES; class++){
+        *mapped += cvm_stack_classes[class].slab_bytes;
+        *in_use += cvm_stack_classes[class].blocks_in_use * cvm_stack_class_words(class) * sizeof(Word);
     }
-    
-    assert(m % sizeof(cvm->program[0]) == 0);
-    assert((size_t)m <= CVM_PROGRAM_CAPACITY * sizeof(cvm->program[0]));
+    pthread_mutex_unlock(&cvm_stack_pool_lock);
+}
 
-    if(fseek(f, 0, SEEK_SET) < 0){
-        fprintf(stderr, "ERROR: Could not opne file '%s': %s\n", file_path, strerror(errno));
-        exit(1);
+// Room for at least words words: a pool block when a class is big enough and
+// a mapping with a guard page after it when not. *size is what was handed out,
+// in words, and *class its class or -1 for a mapping.
+static Word *cvm_stack_alloc(size_t words, size_t *size, int *class){
+    *class = cvm_stack_class_of(words);
+    if(*class >= 0){
+        *size = cvm_stack_class_words(*class);
+        return cvm_stack_pool_take(*class);
+    }
+    size_t stack_bytes = cvm_round_to_pages(words * sizeof(Word));
+    void *stack = mmap(NULL, stack_bytes + cvm_page_size(), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if(stack == MAP_FAILED){
+        cvm_fail("Could not allocate a stack of %zu words: %s\n", words, strerror(errno));
     }
+    if(mprotect((char *) stack + stack_bytes, cvm_page_size(), PROT_NONE) < 0){
+        cvm_fail("Could not protect the stack guard page: %s\n", strerror(errno));
+    }
+    *size = stack_bytes / sizeof(Word);
+    return stack;
+}
 
-    cvm->program_size = fread(cvm->program, sizeof(cvm->program[0]), m / sizeof(cvm->program[0]), f);
+static void cvm_stack_release(Word *stack, size_t size, int class){
+    if(stack == NULL){
+        return;
+    }
+    if(class >= 0){
+        cvm_stack_pool_give(class, stack);
+    }
+    else{
+        munmap(stack, size * sizeof(Word) + cvm_page_size());
+    }
+}
 
-    if(ferror(f)){
-        fprintf(stderr, "ERROR: Could not opne file '%s': %s\n", file_path, strerror(errno));
-        exit(1);
+// Moves *stack to a larger allocation holding at least words words, but never
+// more than limit, copying every word of the old one: engines keep the stack
+// size in a local, so the one in the Cvm may be stale. Returns 0, leaving the
+// stack alone, when words is over limit.
+static int cvm_stack_grow(Word **stack, Word *capacity, size_t *size, int *class, Word limit, Word words){
+    if(words <= *capacity){
+        return 1;
+    }
+    if(words > limit){
+        return 0;
+    }
+    size_t wanted = (size_t) words;
+    if(wanted < *size * 2){
+        wanted = *size * 2;
+    }
+    if(wanted > (size_t) limit){
+        wanted = (size_t) limit;
     }
+    size_t new_size;
+    int new_class;
+    Word *grown = cvm_stack_alloc(wanted, &new_size, &new_class);
+    memcpy(grown, *stack, sizeof(Word) * (size_t) *capacity);
+    cvm_stack_release(*stack, *size, *class);
+    *stack = grown;
+    *size = new_size;
+    *class = new_class;
+    *capacity = (Word) new_size < limit ? (Word) new_size : limit;
+    return 1;
+}
 
-    fclose(f);
+// Makes room for words words on the data stack, growing it up to stack_limit.
+// Engines call this when a push would overflow and reload their copy of the
+// stack pointer and capacity afterwards.
+static int cvm_stack_reserve(Cvm *cvm, Word words){
+    return cvm_stack_grow(&cvm->stack, &cvm->stack_capacity, &cvm->stack_allocated, &cvm->stack_class,
+                          cvm->stack_limit, words);
 }
 
-void cvm_save_program_to_file(Inst *program, size_t program_size, const char *file_path){
-    FILE *f = fopen(file_path, "wb");
-    if(f == NULL){
-        fprintf(stderr, "ERROR: Could not open file '%s': %s\n", file_path, strerror(errno));
-        exit(1);
+static int cvm_return_stack_reserve(Cvm *cvm, Word words){
+    return cvm_stack_grow(&cvm->return_stack, &cvm->return_stack_capacity, &cvm->return_stack_allocated,
+                          &cvm->return_stack_class, CVM_RETURN_STACK_CAPACITY, words);
+}
+
+// Replaces the linear memory with memory_size zeroed bytes, reserved on first use.
+void cvm_set_memory(Cvm *cvm, size_t memory_size){
+    if(cvm->memory != NULL){
+        munmap(cvm->memory, cvm->memory_mapping_size);
     }
-    
-    fwrite(program, sizeof(program[0]), program_size, f);
+    cvm->memory = NULL;
+    cvm->memory_size = memory_size;
+    cvm->memory_mapping_size = 0;
+    cvm->memory_used = 0;
+    cvm->arena = 0;
+}
 
-    if(ferror(f)){
-        fprintf(stderr, "ERROR: Could not write to file '%s': %s\n", file_path, strerror(errno));
-        exit(1);
+// The linear memory, reserved the first time anything reads or writes it and
+// committed as it is touched, with a guard page after it so a bounds check that
+// is ever wrong faults instead of corrupting the heap. A context that never
+// touches memory costs no mapping at all.
+static char *cvm_memory(Cvm *cvm){
+    if(cvm->memory == NULL){
+        size_t memory_bytes = cvm_round_to_pages(cvm->memory_size);
+        size_t mapping_size = memory_bytes + cvm_page_size();
+        void *memory = mmap(NULL, mapping_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if(memory == MAP_FAILED){
+            cvm_fail("Could not allocate %zu bytes of memory: %s\n", cvm->memory_size, strerror(errno));
+        }
+        if(mprotect((char *) memory + memory_bytes, cvm_page_size(), PROT_NONE) < 0){
+            cvm_fail("Could not protect the memory guard page: %s\n", strerror(errno));
+        }
+        cvm->memory = memory;
+        cvm->memory_mapping_size = mapping_size;
     }
+    return cvm->memory;
+}
 
-    fclose(f);
+// Zeroes whatever the last program wrote, by handing the pages back, and empties
+// the arena.
+static void cvm_reset_memory(Cvm *cvm){
+    if(cvm->memory_used > 0){
+        madvise(cvm->memory, cvm_round_to_pages(cvm->memory_used), MADV_DONTNEED);
+    }
+    cvm->memory_used = 0;
+    cvm->arena = 0;
 }
 
-Error cvm_execute_program(Cvm *cvm, int lim){
-    Error error;
-    for(int i=lim; i != 0 && !cvm->halt; i--){
-        error = cvm_ex_inst(cvm);
+// Prepares a zeroed Cvm whose stack may grow to stack_capacity words. Both
+// stacks start out in the smallest pool class and grow as they are used.
+void cvm_init(Cvm *cvm, size_t stack_capacity){
+    *cvm = (Cvm){0};
 
-        if(error == ERROR_OK_NO_INST){
-            i++;
-            error = ERROR_OK;
-            continue;
+    cvm->stack_limit = (Word) stack_capacity;
+    cvm->stack = cvm_stack_alloc(CVM_STACK_MIN_WORDS, &cvm->stack_allocated, &cvm->stack_class);
+    cvm->stack_capacity = (Word) cvm->stack_allocated < cvm->stack_limit ? (Word) cvm->stack_allocated : cvm->stack_limit;
+    cvm->return_stack = cvm_stack_alloc(CVM_STACK_MIN_WORDS, &cvm->return_stack_allocated, &cvm->return_stack_class);
+    cvm->return_stack_capacity = (Word) cvm->return_stack_allocated;
+    cvm->output_fd = STDOUT_FILENO;
+    cvm_set_memory(cvm, CVM_MEMORY_CAPACITY);
+}
+
+// What cvm holds, see Cvm_Stats. The Cvm itself is counted in total.
+void cvm_stats(const Cvm *cvm, Cvm_Stats *stats){
+    stats->stack = cvm->stack_allocated * sizeof(Word);
+    stats->return_stack = cvm->return_stack_allocated * sizeof(Word);
+    stats->memory = cvm->memory_used > 0 ? cvm_round_to_pages(cvm->memory_used) : 0;
+    stats->output = cvm->output != NULL ? CVM_OUTPUT_CAPACITY : 0;
+    stats->total = sizeof(Cvm) + stats->stack + stats->return_stack + stats->memory + stats->output;
+}
+
+static void cvm_trace_release(Cvm *cvm);
+
+void cvm_destroy(Cvm *cvm){
+    cvm_output_flush(cvm);
+    cvm_trace_release(cvm);
+    cvm_stack_release(cvm->stack, cvm->stack_allocated, cvm->stack_class);
+    cvm_stack_release(cvm->return_stack, cvm->return_stack_allocated, cvm->return_stack_class);
+    if(cvm->memory != NULL){
+        munmap(cvm->memory, cvm->memory_mapping_size);
+    }
+    cvm_free(cvm->output);
+    *cvm = (Cvm){0};
+}
+
+// Points the context at program and resets it to run from the start, with
+// zeroed memory.
+void cvm_attach_program(Cvm *cvm, Cvm_Program *program){
+    cvm_trace_release(cvm);
+    cvm_reset_memory(cvm);
+    cvm->image = program;
+    cvm->program = program->inst;
+    cvm->program_size = program->size;
+    cvm->stack_size = 0;
+    cvm->return_stack_size = 0;
+    cvm->ip = 0;
+    cvm->halt = 0;
+}
+
+static void cvm_jit_release(Cvm_Program *program);
+static void cvm_threaded_release(Cvm_Program *program);
+
+static void cvm_release_program(Cvm_Program *program){
+    cvm_jit_release(program);
+    cvm_threaded_release(program);
+    cvm_free(program->blocks);
+    program->blocks = NULL;
+    if(program->mapping != NULL){
+        munmap(program->mapping, program->mapping_size);
+    }
+    else{
+        cvm_free(program->inst);
+    }
+    program->inst = NULL;
+    program->size = 0;
+    program->mapping = NULL;
+    program->mapping_size = 0;
+    program->verified = 0;
+}
+
+static Inst *cvm_alloc_program(Cvm_Program *program, size_t program_size){
+    cvm_release_program(program);
+    program->inst = cvm_malloc(sizeof(Inst) * (program_size > 0 ? program_size : 1));
+    if(program->inst == NULL){
+        cvm_fail("Out of memory : %s\n", strerror(errno));
+    }
+    return program->inst;
+}
+
+void cvm_program_destroy(Cvm_Program *program){
+    cvm_release_program(program);
+    cvm_free(program->stack_depth);
+    cvm_free(program->routine);
+    *program = (Cvm_Program){0};
+}
+
+// Splits the program into basic blocks so engines can charge -l fuel once per block
+// instead of once per instruction. A block starts at ip 0, at every jump and call
+// target, after every jmp, jmp_if, call, ret, halt and yield, and wherever a run of NOPs starts or ends. NOPs
+// are kept apart so a block that runs the fuel down to exactly zero stops on the
+// same ip as per-instruction counting would. Call again after editing inst by hand.
+//
+// A fused instruction whose tail does not match only has a meaning as a whole, so
+// a program containing one gets no blocks and is always counted per instruction.
+static int cvm_verify_fused_tail(const Cvm_Program *program, Word ip);
+
+void cvm_analyze_blocks(Cvm_Program *program){
+    Word size = program->size;
+    cvm_free(program->blocks);
+    program->blocks = NULL;
+    for(Word i = 0; i < size; i++){
+        if(inst_fused_length(program->inst[i].type) > 1 && !cvm_verify_fused_tail(program, i)){
+            return;
         }
-        
-        if(error != ERROR_OK){
-            break;
+    }
+
+    program->blocks = cvm_calloc(size + 1, sizeof(Cvm_Block));
+    char *leader = cvm_calloc(size + 1, 1);
+    if(program->blocks == NULL || leader == NULL){
+        cvm_fail("Out of memory : %s\n", strerror(errno));
+    }
+
+    leader[0] = 1;
+    for(Word i = 0; i < size; i++){
+        Inst inst = program->inst[i];
+        if(inst.type == INST_JMP || inst.type == INST_JMP_IF || inst.type == INST_CALL){
+            if(inst.operand >= 0 && inst.operand < size){
+                leader[inst.operand] = 1;
+            }
+            leader[i + 1] = 1;
+        }
+        else if(inst.type == INST_HALT || inst.type == INST_RET || inst.type == INST_YIELD){
+            leader[i + 1] = 1;
+        }
+        if(i > 0 && (inst.type == INST_NOP) != (program->inst[i - 1].type == INST_NOP)){
+            leader[i] = 1;
         }
     }
-    return error;
-}
\ No newline at end of file
+
+    for(Word i = 0; i < size; i++){
+        if(!leader[i]){
+            continue;
+        }
+        Cvm_Block *block = &program->blocks[i];
+        Word j = i;
+        do{
+            block->cost += program->inst[j].type != INST_NOP;
+            block->length++;
+            j++;
+        } while(j < size && !leader[j]);
+    }
+    cvm_free(leader);
+}
+
+void cvm_load_program_from_memory(Cvm_Program *program, const Inst *inst, size_t program_size){
+    cvm_alloc_program(program, program_size);
+    memcpy(program->inst, inst, sizeof(Inst) * program_size);
+    program->size = program_size;
+    cvm_analyze_blocks(program);
+}
+
+// Compact on-disk format, all multi-byte fields little-endian or LEB128:
+//
+//   "CVMB" | version u8 | flags u8 | varint inst count
+//   [flags & CVM_FILE_FLAG_CONSTANT_POOL: varint pool count, zigzag varint values]
+//   per instruction: opcode u8, then an operand for opcodes that take one, either
+//   a zigzag varint or, when the opcode has CVM_OPCODE_POOL_OPERAND set, a varint
+//   index into the constant pool
+//   crc32 u32 of everything before it
+//
+// Files that do not start with the magic are the legacy format: a raw dump of Inst.
+#define CVM_FILE_MAGIC "CVMB"
+#define CVM_FILE_MAGIC_SIZE 4
+#define CVM_FILE_VERSION 1
+#define CVM_FILE_FLAG_CONSTANT_POOL 0x01
+#define CVM_OPCODE_POOL_OPERAND 0x80
+
+int inst_has_operand(Inst_Type type){
+    switch(type){
+        case INST_PUSH:
+        case INST_DUP:
+        case INST_JMP:
+        case INST_JMP_IF:
+        case INST_PLUS_IMM:
+        case INST_PUSH2:
+        case INST_JMP_IF_EQ:
+        case INST_NATIVE:
+        case INST_CALL:
+            return 1;
+        case INST_NOP:
+        case INST_PLUS:
+        case INST_MINUS:
+        case INST_MULT:
+        case INST_DIV:
+        case INST_EQ:
+        case INST_HALT:
+        case INST_PRINT_DEBUG:
+        case INST_LOAD:
+        case INST_STORE:
+        case INST_MEMCPY:
+        case INST_MEMSET:
+        case INST_ALLOC:
+        case INST_RESET:
+        case INST_RET:
+        case INST_YIELD:
+        default:
+            return 0;
+    }
+}
+
+static uint32_t cvm_crc32(const unsigned char *data, size_t count){
+    static uint32_t table[256];
+    static int table_ready = 0;
+    if(!table_ready){
+        for(uint32_t i = 0; i < 256; i++){
+            uint32_t c = i;
+            for(int k = 0; k < 8; k++){
+                c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            }
+            table[i] = c;
+        }
+        table_ready = 1;
+    }
+
+    uint32_t crc = 0xFFFFFFFFu;
+    for(size_t i = 0; i < count; i++){
+        crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return crc ^ 0xFFFFFFFFu;
+}
+
+static uint64_t zigzag_encode(Word value){
+    return ((uint64_t) value << 1) ^ (uint64_t) (value >> 63);
+}
+
+static Word zigzag_decode(uint64_t value){
+    return (Word) ((value >> 1) ^ (~(value & 1) + 1));
+}
+
+static size_t varint_size(uint64_t value){
+    size_t size = 1;
+    while(value >= 0x80){
+        value >>= 7;
+        size++;
+    }
+    return size;
+}
+
+typedef struct {
+    unsigned char *data;
+    size_t count;
+    size_t capacity;
+} Byte_Buffer;
+
+static void byte_buffer_push(Byte_Buffer *buffer, unsigned char byte){
+    if(buffer->count >= buffer->capacity){
+        buffer->capacity = buffer->capacity == 0 ? 256 : buffer->capacity * 2;
+        buffer->data = cvm_realloc(buffer->data, buffer->capacity);
+        if(buffer->data == NULL){
+            cvm_fail("Out of memory : %s\n", strerror(errno));
+        }
+    }
+    buffer->data[buffer->count++] = byte;
+}
+
+static void byte_buffer_push_varint(Byte_Buffer *buffer, uint64_t value){
+    while(value >= 0x80){
+        byte_buffer_push(buffer, (unsigned char) (value | 0x80));
+        value >>= 7;
+    }
+    byte_buffer_push(buffer, (unsigned char) value);
+}
+
+typedef struct {
+    const unsigned char *data;
+    size_t count;
+    size_t pos;
+} Byte_Reader;
+
+static int byte_reader_u8(Byte_Reader *reader, unsigned char *byte){
+    if(reader->pos >= reader->count){
+        return 0;
+    }
+    *byte = reader->data[reader->pos++];
+    return 1;
+}
+
+static int byte_reader_varint(Byte_Reader *reader, uint64_t *value){
+    *value = 0;
+    for(int shift = 0; shift < 64; shift += 7){
+        unsigned char byte;
+        if(!byte_reader_u8(reader, &byte)){
+            return 0;
+        }
+        *value |= (uint64_t) (byte & 0x7F) << shift;
+        if(!(byte & 0x80)){
+            return 1;
+        }
+    }
+    return 0;
+}
+
+typedef struct {
+    Word value;
+    size_t count;
+    size_t index;
+} Pool_Entry;
+
+static int pool_entry_compare_value(const void *a, const void *b){
+    Word x = ((const Pool_Entry *) a)->value;
+    Word y = ((const Pool_Entry *) b)->value;
+    return (x > y) - (x < y);
+}
+
+static int pool_entry_compare_count(const void *a, const void *b){
+    size_t x = ((const Pool_Entry *) a)->count;
+    size_t y = ((const Pool_Entry *) b)->count;
+    return (x < y) - (x > y);
+}
+
+// Operands that are both wide and repeated go to the constant pool, most used
+// first so they get the shortest indices. Returns the pool sorted by value with
+// index set, or NULL when a pool would not make the file smaller.
+static Pool_Entry *cvm_build_constant_pool(const Inst *program, size_t program_size, size_t *pool_size){
+    *pool_size = 0;
+    Pool_Entry *entries = cvm_malloc(sizeof(Pool_Entry) * (program_size + 1));
+    if(entries == NULL){
+        cvm_fail("Out of memory : %s\n", strerror(errno));
+    }
+
+    size_t count = 0;
+    for(size_t i = 0; i < program_size; i++){
+        if(inst_has_operand(program[i].type) && varint_size(zigzag_encode(program[i].operand)) >= 3){
+            entries[count++] = (Pool_Entry){ .value = program[i].operand, .count = 1 };
+        }
+    }
+    qsort(entries, count, sizeof(Pool_Entry), pool_entry_compare_value);
+
+    size_t unique = 0;
+    for(size_t i = 0; i < count; i++){
+        if(unique > 0 && entries[unique - 1].value == entries[i].value){
+            entries[unique - 1].count++;
+        }
+        else{
+            entries[unique++] = entries[i];
+        }
+    }
+
+    size_t kept = 0;
+    for(size_t i = 0; i < unique; i++){
+        if(entries[i].count >= 2){
+            entries[kept++] = entries[i];
+        }
+    }
+    qsort(entries, kept, sizeof(Pool_Entry), pool_entry_compare_count);
+
+    long saved = -(long) varint_size(kept);
+    for(size_t i = 0; i < kept; i++){
+        size_t inline_size = varint_size(zigzag_encode(entries[i].value));
+        entries[i].index = i;
+        saved += (long) (entries[i].count * (inline_size - varint_size(i)) - inline_size);
+    }
+    if(kept == 0 || saved <= 0){
+        cvm_free(entries);
+        return NULL;
+    }
+
+    qsort(entries, kept, sizeof(Pool_Entry), pool_entry_compare_value);
+    *pool_size = kept;
+    return entries;
+}
+
+static const Pool_Entry *cvm_find_in_pool(const Pool_Entry *pool, size_t pool_size, Word value){
+    Pool_Entry key = { .value = value };
+    return bsearch(&key, pool, pool_size, sizeof(Pool_Entry), pool_entry_compare_value);
+}
+
+static void cvm_load_error(const char *file_path, const char *reason){
+    cvm_fail("Could not load program '%s': %s\n", file_path, reason);
+}
+
+static const char *cvm_decode_error(Word *pool, const char *reason){
+    cvm_free(pool);
+    return reason;
+}
+
+// Decodes the compact format into program. Returns NULL, or why data is not a
+// valid program; program may then hold part of it.
+static const char *cvm_decode_program(Cvm_Program *program, const unsigned char *data, size_t count){
+    Word *pool = NULL;
+    if(count < CVM_FILE_MAGIC_SIZE + 2 + 4){
+        return cvm_decode_error(pool, "truncated header");
+    }
+
+    size_t body = count - 4;
+    uint32_t expected = (uint32_t) data[body]
+        | (uint32_t) data[body + 1] << 8
+        | (uint32_t) data[body + 2] << 16
+        | (uint32_t) data[body + 3] << 24;
+    if(cvm_crc32(data, body) != expected){
+        return cvm_decode_error(pool, "checksum mismatch");
+    }
+
+    Byte_Reader reader = { .data = data, .count = body, .pos = CVM_FILE_MAGIC_SIZE };
+    unsigned char version, flags;
+    byte_reader_u8(&reader, &version);
+    byte_reader_u8(&reader, &flags);
+    if(version != CVM_FILE_VERSION){
+        return cvm_decode_error(pool, "unsupported format version");
+    }
+
+    uint64_t program_size;
+    if(!byte_reader_varint(&reader, &program_size)){
+        return cvm_decode_error(pool, "truncated header");
+    }
+    // Every instruction takes at least its opcode byte.
+    if(program_size > reader.count - reader.pos){
+        return cvm_decode_error(pool, "truncated instruction stream");
+    }
+
+    uint64_t pool_size = 0;
+    if(flags & CVM_FILE_FLAG_CONSTANT_POOL){
+        if(!byte_reader_varint(&reader, &pool_size) || pool_size > reader.count - reader.pos){
+            return cvm_decode_error(pool, "truncated constant pool");
+        }
+        pool = cvm_malloc(sizeof(Word) * (pool_size + 1));
+        if(pool == NULL){
+            cvm_fail("Out of memory : %s\n", strerror(errno));
+        }
+        for(uint64_t i = 0; i < pool_size; i++){
+            uint64_t value;
+            if(!byte_reader_varint(&reader, &value)){
+                return cvm_decode_error(pool, "truncated constant pool");
+            }
+            pool[i] = zigzag_decode(value);
+        }
+    }
+
+    Inst *insts = cvm_alloc_program(program, program_size);
+    for(uint64_t i = 0; i < program_size; i++){
+        unsigned char opcode;
+        if(!byte_reader_u8(&reader, &opcode)){
+            return cvm_decode_error(pool, "truncated instruction stream");
+        }
+        int from_pool = opcode & CVM_OPCODE_POOL_OPERAND;
+        opcode &= ~CVM_OPCODE_POOL_OPERAND;
+        if(opcode >= INST_TYPE_COUNT){
+            return cvm_decode_error(pool, "unknown opcode");
+        }
+
+        Inst inst = { .type = (Inst_Type) opcode };
+        if(inst_has_operand(inst.type)){
+            uint64_t value;
+            if(!byte_reader_varint(&reader, &value)){
+                return cvm_decode_error(pool, "truncated instruction stream");
+            }
+            if(from_pool){
+                if(value >= pool_size){
+                    return cvm_decode_error(pool, "constant pool index out of range");
+                }
+                inst.operand = pool[value];
+            }
+            else{
+                inst.operand = zigzag_decode(value);
+            }
+        }
+        else if(from_pool){
+            return cvm_decode_error(pool, "operand on an opcode that takes none");
+        }
+        insts[i] = inst;
+    }
+    if(reader.pos != reader.count){
+        return cvm_decode_error(pool, "trailing bytes after the instruction stream");
+    }
+
+    cvm_free(pool);
+    program->size = program_size;
+    return NULL;
+}
+
+// Loads either format: the compact one is recognised by its magic, anything
+// else is treated as a legacy raw dump of Inst. The file is mapped rather than
+// read. A legacy file already has the in-memory layout, so the program then
+// points straight into the read-only mapping and nothing is copied.
+void cvm_load_program_from_file(Cvm_Program *program, const char *file_path){
+    int fd = open(file_path, O_RDONLY);
+    if(fd < 0){
+        cvm_fail("Could not open file '%s': %s\n", file_path, strerror(errno));
+    }
+
+    struct stat st;
+    if(fstat(fd, &st) < 0){
+        close(fd);
+        cvm_fail("Could not read file '%s': %s\n", file_path, strerror(errno));
+    }
+    size_t count = (size_t) st.st_size;
+
+    cvm_release_program(program);
+    if(count == 0){
+        close(fd);
+        return;
+    }
+
+    void *data = mmap(NULL, count, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(data == MAP_FAILED){
+        cvm_fail("Could not read file '%s': %s\n", file_path, strerror(errno));
+    }
+
+    if(count >= CVM_FILE_MAGIC_SIZE && memcmp(data, CVM_FILE_MAGIC, CVM_FILE_MAGIC_SIZE) == 0){
+        const char *reason = cvm_decode_program(program, data, count);
+        munmap(data, count);
+        if(reason != NULL){
+            cvm_release_program(program);
+            cvm_load_error(file_path, reason);
+        }
+    }
+    else{
+        if(count % sizeof(Inst) != 0){
+            munmap(data, count);
+            cvm_load_error(file_path, "size is not a whole number of instructions");
+        }
+        program->inst = data;
+        program->size = count / sizeof(Inst);
+        program->mapping = data;
+        program->mapping_size = count;
+    }
+    cvm_analyze_blocks(program);
+}
+
+// Loads either format from count bytes at data, which are copied. Returns NULL, or
+// why the bytes are not a program; program is then left empty.
+const char *cvm_load_program_from_bytes(Cvm_Program *program, const void *data, size_t count){
+    if(count >= CVM_FILE_MAGIC_SIZE && memcmp(data, CVM_FILE_MAGIC, CVM_FILE_MAGIC_SIZE) == 0){
+        cvm_release_program(program);
+        const char *reason = cvm_decode_program(program, data, count);
+        if(reason != NULL){
+            cvm_release_program(program);
+            return reason;
+        }
+        cvm_analyze_blocks(program);
+        return NULL;
+    }
+    if(count % sizeof(Inst) != 0){
+        cvm_release_program(program);
+        return "size is not a whole number of instructions";
+    }
+    cvm_load_program_from_memory(program, data, count / sizeof(Inst));
+    return NULL;
+}
+
+void cvm_save_program_to_file(Inst *program, size_t program_size, const char *file_path){
+    size_t pool_size;
+    Pool_Entry *pool = cvm_build_constant_pool(program, program_size, &pool_size);
+
+    Byte_Buffer buffer = {0};
+    for(size_t i = 0; i < CVM_FILE_MAGIC_SIZE; i++){
+        byte_buffer_push(&buffer, CVM_FILE_MAGIC[i]);
+    }
+    byte_buffer_push(&buffer, CVM_FILE_VERSION);
+    byte_buffer_push(&buffer, pool != NULL ? CVM_FILE_FLAG_CONSTANT_POOL : 0);
+    byte_buffer_push_varint(&buffer, program_size);
+
+    if(pool != NULL){
+        byte_buffer_push_varint(&buffer, pool_size);
+        Word *values = cvm_malloc(sizeof(Word) * pool_size);
+        if(values == NULL){
+            cvm_fail("Out of memory : %s\n", strerror(errno));
+        }
+        for(size_t i = 0; i < pool_size; i++){
+            values[pool[i].index] = pool[i].value;
+        }
+        for(size_t i = 0; i < pool_size; i++){
+            byte_buffer_push_varint(&buffer, zigzag_encode(values[i]));
+        }
+        cvm_free(values);
+    }
+
+    for(size_t i = 0; i < program_size; i++){
+        Inst inst = program[i];
+        if(!inst_has_operand(inst.type)){
+            byte_buffer_push(&buffer, (unsigned char) inst.type);
+            continue;
+        }
+        const Pool_Entry *entry = cvm_find_in_pool(pool, pool_size, inst.operand);
+        if(entry != NULL){
+            byte_buffer_push(&buffer, (unsigned char) inst.type | CVM_OPCODE_POOL_OPERAND);
+            byte_buffer_push_varint(&buffer, entry->index);
+        }
+        else{
+            byte_buffer_push(&buffer, (unsigned char) inst.type);
+            byte_buffer_push_varint(&buffer, zigzag_encode(inst.operand));
+        }
+    }
+
+    uint32_t crc = cvm_crc32(buffer.data, buffer.count);
+    for(int i = 0; i < 4; i++){
+        byte_buffer_push(&buffer, (unsigned char) (crc >> (8 * i)));
+    }
+
+    FILE *f = fopen(file_path, "wb");
+    if(f == NULL){
+        cvm_fail("Could not open file '%s': %s\n", file_path, strerror(errno));
+    }
+
+    fwrite(buffer.data, 1, buffer.count, f);
+
+    if(ferror(f)){
+        cvm_fail("Could not write to file '%s': %s\n", file_path, strerror(errno));
+    }
+
+    fclose(f);
+    cvm_free(buffer.data);
+    cvm_free(pool);
+}
+
+// Writes the legacy format: a raw dump of the Inst array in host layout.
+void cvm_save_program_to_file_raw(Inst *program, size_t program_size, const char *file_path){
+    FILE *f = fopen(file_path, "wb");
+    if(f == NULL){
+        cvm_fail("Could not open file '%s': %s\n", file_path, strerror(errno));
+    }
+    
+    fwrite(program, sizeof(program[0]), program_size, f);
+
+    if(ferror(f)){
+        cvm_fail("Could not write to file '%s': %s\n", file_path, strerror(errno));
+    }
+
+    fclose(f);
+}
+
+// Snapshot file, in host layout like the legacy program format since it is only
+// meant to be mapped back on the machine that wrote it:
+//
+//   Cvm_Snapshot_Header | program_size Inst | stack_size Word
+//   | return_stack_size Word | memory_used bytes
+#define CVM_SNAPSHOT_MAGIC "CVMSNAP3"
+#define CVM_SNAPSHOT_MAGIC_SIZE 8
+
+typedef struct {
+    char magic[CVM_SNAPSHOT_MAGIC_SIZE];
+    Word program_size;
+    Word stack_size;
+    Word return_stack_size;
+    Word ip;
+    Word halt;
+    Word memory_used;
+    Word arena;
+} Cvm_Snapshot_Header;
+
+// A saved Cvm. program points into the mapped file, so every context restored
+// from the snapshot shares its pages; only the stacks and the written part of
+// memory are copied per context.
+typedef struct {
+    Cvm_Program program;
+    const Word *stack;
+    Word stack_size;
+    const Word *return_stack;
+    Word return_stack_size;
+    Word ip;
+    int halt;
+    const char *memory;
+    size_t memory_used;
+    size_t arena;
+} Cvm_Snapshot;
+
+void cvm_save_snapshot(const Cvm *cvm, const char *file_path){
+    Cvm_Snapshot_Header header = {
+        .program_size = cvm->program_size,
+        .stack_size = cvm->stack_size,
+        .return_stack_size = cvm->return_stack_size,
+        .ip = cvm->ip,
+        .halt = cvm->halt,
+        .memory_used = (Word) cvm->memory_used,
+        .arena = (Word) cvm->arena,
+    };
+    memcpy(header.magic, CVM_SNAPSHOT_MAGIC, CVM_SNAPSHOT_MAGIC_SIZE);
+
+    FILE *f = fopen(file_path, "wb");
+    if(f == NULL){
+        cvm_fail("Could not open file '%s': %s\n", file_path, strerror(errno));
+    }
+
+    fwrite(&header, sizeof(header), 1, f);
+    fwrite(cvm->program, sizeof(Inst), cvm->program_size, f);
+    fwrite(cvm->stack, sizeof(Word), cvm->stack_size, f);
+    fwrite(cvm->return_stack, sizeof(Word), cvm->return_stack_size, f);
+    fwrite(cvm->memory, 1, cvm->memory_used, f);
+
+    if(ferror(f)){
+        cvm_fail("Could not write to file '%s': %s\n", file_path, strerror(errno));
+    }
+
+    fclose(f);
+}
+
+static void cvm_snapshot_error(const char *file_path, const char *reason){
+    cvm_fail("Could not load snapshot '%s': %s\n", file_path, reason);
+}
+
+// Maps the snapshot read-only and private. Nothing is copied until a context is
+// restored from it.
+void cvm_load_snapshot(Cvm_Snapshot *snapshot, const char *file_path){
+    int fd = open(file_path, O_RDONLY);
+    if(fd < 0){
+        cvm_fail("Could not open file '%s': %s\n", file_path, strerror(errno));
+    }
+
+    struct stat st;
+    if(fstat(fd, &st) < 0){
+        cvm_fail("Could not read file '%s': %s\n", file_path, strerror(errno));
+    }
+    size_t count = (size_t) st.st_size;
+    if(count < sizeof(Cvm_Snapshot_Header)){
+        cvm_snapshot_error(file_path, "truncated header");
+    }
+
+    void *data = mmap(NULL, count, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(data == MAP_FAILED){
+        cvm_fail("Could not read file '%s': %s\n", file_path, strerror(errno));
+    }
+    close(fd);
+
+    const Cvm_Snapshot_Header *header = data;
+    if(memcmp(header->magic, CVM_SNAPSHOT_MAGIC, CVM_SNAPSHOT_MAGIC_SIZE) != 0){
+        cvm_snapshot_error(file_path, "not a snapshot");
+    }
+    size_t left = count - sizeof(*header);
+    if(header->program_size < 0 || (size_t) header->program_size > left / sizeof(Inst)){
+        cvm_snapshot_error(file_path, "size does not match the header");
+    }
+    left -= sizeof(Inst) * header->program_size;
+    if(header->stack_size < 0 || (size_t) header->stack_size > left / sizeof(Word)){
+        cvm_snapshot_error(file_path, "size does not match the header");
+    }
+    left -= sizeof(Word) * header->stack_size;
+    if(header->return_stack_size < 0 || (size_t) header->return_stack_size > left / sizeof(Word)){
+        cvm_snapshot_error(file_path, "size does not match the header");
+    }
+    left -= sizeof(Word) * header->return_stack_size;
+    if(header->memory_used < 0 || (size_t) header->memory_used != left || header->arena < 0){
+        cvm_snapshot_error(file_path, "size does not match the header");
+    }
+
+    *snapshot = (Cvm_Snapshot){0};
+    snapshot->program.inst = (Inst *) (header + 1);
+    snapshot->program.size = header->program_size;
+    snapshot->program.mapping = data;
+    snapshot->program.mapping_size = count;
+    snapshot->stack = (const Word *) (snapshot->program.inst + header->program_size);
+    snapshot->stack_size = header->stack_size;
+    snapshot->return_stack = snapshot->stack + header->stack_size;
+    snapshot->return_stack_size = header->return_stack_size;
+    snapshot->ip = header->ip;
+    snapshot->halt = header->halt != 0;
+    snapshot->memory = (const char *) (snapshot->return_stack + header->return_stack_size);
+    snapshot->memory_used = (size_t) header->memory_used;
+    snapshot->arena = (size_t) header->arena;
+    cvm_analyze_blocks(&snapshot->program);
+}
+
+void cvm_snapshot_destroy(Cvm_Snapshot *snapshot){
+    cvm_program_destroy(&snapshot->program);
+    *snapshot = (Cvm_Snapshot){0};
+}
+
+// Forks a context off the snapshot: attaches the shared program and copies the
+// saved stacks, memory and registers. Any number of contexts, on any threads, can
+// be restored from one snapshot.
+Error cvm_restore_snapshot(Cvm *cvm, Cvm_Snapshot *snapshot){
+    cvm_attach_program(cvm, &snapshot->program);
+    if(!cvm_stack_reserve(cvm, snapshot->stack_size)){
+        return ERROR_STACK_OVERFLOW;
+    }
+    if(!cvm_return_stack_reserve(cvm, snapshot->return_stack_size)){
+        return ERROR_RETURN_STACK_OVERFLOW;
+    }
+    if(snapshot->memory_used > cvm->memory_size || snapshot->arena > cvm->memory_size){
+        return ERROR_OUT_OF_MEMORY;
+    }
+    memcpy(cvm->stack, snapshot->stack, sizeof(Word) * snapshot->stack_size);
+    cvm->stack_size = snapshot->stack_size;
+    memcpy(cvm->return_stack, snapshot->return_stack, sizeof(Word) * snapshot->return_stack_size);
+    cvm->return_stack_size = snapshot->return_stack_size;
+    if(snapshot->memory_used > 0){
+        memcpy(cvm_memory(cvm), snapshot->memory, snapshot->memory_used);
+    }
+    cvm->memory_used = snapshot->memory_used;
+    cvm->arena = snapshot->arena;
+    cvm->ip = snapshot->ip;
+    cvm->halt = snapshot->halt;
+    return ERROR_OK;
+}
+
+static int cvm_at_block(const Cvm *cvm, const Cvm_Block *blocks){
+    return blocks != NULL && cvm->ip >= 0 && cvm->ip < cvm->program_size && blocks[cvm->ip].length > 0;
+}
+
+// Charges fuel per instruction. A negative fuel is unlimited and left alone. Runs
+// at least one instruction and stops at the next block entry (when blocks are
+// given), when the fuel runs out, on halt, on yield or on error.
+static Error cvm_execute_exact(Cvm *cvm, int *fuel, const Cvm_Block *blocks){
+    Error error = ERROR_OK;
+    do{
+        int retired = 0;
+        error = cvm_ex_inst_limited(cvm, *fuel, &retired);
+
+        if(error == ERROR_OK_NO_INST){
+            error = ERROR_OK;
+            continue;
+        }
+        
+        if(error != ERROR_OK){
+            break;
+        }
+        if(*fuel > 0){
+            *fuel -= retired;
+        }
+    } while(*fuel != 0 && !cvm->halt && !cvm->yielded && !cvm_at_block(cvm, blocks));
+    return error;
+}
+
+// Runs one block that has already been paid for. Fused instructions only get the
+// budget left in the block, so none of them runs on into the next one.
+static Error cvm_execute_block(Cvm *cvm, const Cvm_Block *block){
+    Word left = block->cost;
+    for(Word steps = 0; steps < block->length && !cvm->halt && !cvm->yielded;){
+        int retired = 0;
+        Error error = cvm_ex_inst_limited(cvm, (int) left, &retired);
+        if(error == ERROR_OK_NO_INST){
+            steps++;
+            continue;
+        }
+        if(error != ERROR_OK){
+            return error;
+        }
+        left -= retired;
+        steps += retired;
+    }
+    return ERROR_OK;
+}
+
+// Fuel is charged once per block entry when the whole block fits in what is left.
+// The block that would run the fuel out, and a resume point in the middle of a
+// block, are counted per instruction, so -l stops on exactly the same instruction
+// as counting every instruction would.
+Error cvm_execute_program(Cvm *cvm, int lim){
+    const Cvm_Block *blocks = cvm->image != NULL ? cvm->image->blocks : NULL;
+    Error error = ERROR_OK;
+    int i = lim;
+    while(i != 0 && !cvm->halt && !cvm->yielded && error == ERROR_OK){
+        if(!cvm_at_block(cvm, blocks) || (i > 0 && i < blocks[cvm->ip].cost)){
+            error = cvm_execute_exact(cvm, &i, blocks);
+            continue;
+        }
+        const Cvm_Block *block = &blocks[cvm->ip];
+        if(i > 0){
+            i -= block->cost;
+        }
+        error = cvm_execute_block(cvm, block);
+    }
+    cvm->fuel = i;
+    cvm_output_flush(cvm);
+    return error;
+}
+
+typedef struct {
+    Word ip;
+    Word depth;
+    const char *reason;
+} Cvm_Verify_Diag;
+
+static int cvm_verify_fail(Cvm_Verify_Diag *diag, Word ip, Word depth, const char *reason){
+    if(diag != NULL){
+        diag->ip = ip;
+        diag->depth = depth;
+        diag->reason = reason;
+    }
+    return 0;
+}
+
+// State of one cvm_verify_program walk. Every routine is walked once, with depths
+// counted from the depth it is called at. Per routine, indexed by its entry ip and
+// with the code reached from ip 0 at index size: need is how many words it takes
+// from below that depth, grow how far it reaches above it, counting the routines it
+// calls, and net the depth it returns at, CVM_DEPTH_UNREACHABLE until a ret is
+// reached.
+typedef struct {
+    Cvm_Program *program;
+    Word *worklist;
+    Word worklist_size;
+    Word *need;
+    Word *grow;
+    Word *net;
+    Cvm_Verify_Diag *diag;
+} Cvm_Verifier;
+
+static Word cvm_verifier_slot(const Cvm_Verifier *verifier, Word routine){
+    return routine < 0 ? verifier->program->size : routine;
+}
+
+// Follows control from one instruction of routine to another. routine is -1 for
+// code reached from ip 0 and the entry ip for code reached through a call.
+static int cvm_verify_edge(Cvm_Verifier *verifier, Word routine, Word from, Word to, Word depth){
+    Cvm_Program *program = verifier->program;
+    if(to < 0 || to >= program->size){
+        if(to == program->size && to == from + 1){
+            return cvm_verify_fail(verifier->diag, from, depth, "execution falls off the end of the program");
+        }
+        return cvm_verify_fail(verifier->diag, from, depth, "jump target out of range");
+    }
+    if(program->stack_depth[to] == CVM_DEPTH_UNREACHABLE){
+        program->stack_depth[to] = depth;
+        program->routine[to] = routine;
+        verifier->worklist[verifier->worklist_size++] = to;
+        return 1;
+    }
+    if(program->routine[to] != routine){
+        return cvm_verify_fail(verifier->diag, to, depth, "code is shared between routines");
+    }
+    if(program->stack_depth[to] != depth){
+        return cvm_verify_fail(verifier->diag, to, depth, "inconsistent stack depth where control flow joins");
+    }
+    return 1;
+}
+
+// The instruction at ip reads count words off a stack depth deep. Code reached
+// from ip 0 has to hold them itself; a routine may reach into its caller's words,
+// which every call then has to provide.
+static int cvm_verify_take(Cvm_Verifier *verifier, Word routine, Word ip, Word depth, Word count, const char *reason){
+    if(depth >= count){
+        return 1;
+    }
+    if(routine < 0){
+        return cvm_verify_fail(verifier->diag, ip, depth, reason);
+    }
+    if(count - depth > verifier->need[routine]){
+        verifier->need[routine] = count - depth;
+    }
+    return 1;
+}
+
+static int cvm_verify_fused_tail(const Cvm_Program *program, Word ip){
+    Inst head = program->inst[ip];
+    if(ip + inst_fused_length(head.type) > program->size){
+        return 0;
+    }
+    const Inst *tail = &program->inst[ip + 1];
+    if(head.type == INST_PLUS_IMM){
+        return tail[0].type == INST_PLUS;
+    }
+    if(head.type == INST_PUSH2){
+        return tail[0].type == INST_PUSH;
+    }
+    return head.type == INST_JMP_IF_EQ
+        && tail[0].type == INST_PUSH && tail[0].operand == head.operand
+        && tail[1].type == INST_EQ
+        && tail[2].type == INST_JMP_IF;
+}
+
+// Charges every reachable call with what its routine needs below and grows above
+// the call's depth, until nothing changes. Without recursion that settles in one
+// round per level of calls; recursion that keeps changing them after that would
+// need an unbounded stack. Code reached from ip 0 has nothing below it to give.
+static int cvm_verify_calls(Cvm_Verifier *verifier){
+    Cvm_Program *program = verifier->program;
+    Word routines = 1;
+    for(Word ip = 0; ip < program->size; ip++){
+        if(program->routine[ip] == ip){
+            routines++;
+        }
+    }
+
+    for(Word round = 0; ; round++){
+        int settled = 1;
+        for(Word call = 0; call < program->size; call++){
+            if(program->inst[call].type != INST_CALL || program->stack_depth[call] == CVM_DEPTH_UNREACHABLE){
+                continue;
+            }
+            Word depth = program->stack_depth[call];
+            Word callee = program->inst[call].operand;
+            Word caller = cvm_verifier_slot(verifier, program->routine[call]);
+            int changed = 0;
+            if(verifier->need[callee] - depth > verifier->need[caller]){
+                if(program->routine[call] < 0){
+                    return cvm_verify_fail(verifier->diag, call, depth, "called routine underflows the stack");
+                }
+                verifier->need[caller] = verifier->need[callee] - depth;
+                changed = 1;
+            }
+            if(depth + verifier->grow[callee] > verifier->grow[caller]){
+                verifier->grow[caller] = depth + verifier->grow[callee];
+                changed = 1;
+            }
+            if(changed && round >= routines){
+                return cvm_verify_fail(verifier->diag, call, depth, "recursion makes the stack depth unbounded");
+            }
+            settled = settled && !changed;
+        }
+        if(settled){
+            break;
+        }
+    }
+    program->max_stack_depth = verifier->grow[program->size];
+    return 1;
+}
+
+// Walks every path from ip 0 with an empty stack and proves that no reachable
+// instruction can underflow the stack, use an illegal opcode or operand, or
+// transfer control outside the program, and that the stack depth is bounded by
+// max_stack_depth. A routine is walked once from its entry, whatever depth it is
+// called at: it has to leave at one depth relative to its entry and must not share
+// code with other routines, and every call has to hold the words the routine takes
+// from below its entry. The depth of the return stack is not bounded; call and ret
+// keep their checks. On success the program may run on
+// cvm_execute_program_unchecked in any state cvm_can_run_unchecked accepts. On
+// failure diag describes the first problem.
+int cvm_verify_program(Cvm_Program *program, Cvm_Verify_Diag *diag){
+    program->verified = 0;
+    program->max_stack_depth = 0;
+    if(program->size <= 0){
+        return cvm_verify_fail(diag, 0, 0, "empty program");
+    }
+
+    size_t size = (size_t) program->size;
+    Word *stack_depth = cvm_realloc(program->stack_depth, sizeof(Word) * size);
+    Word *routine_of = cvm_realloc(program->routine, sizeof(Word) * size);
+    Cvm_Verifier verifier = {
+        .program = program,
+        .worklist = cvm_malloc(sizeof(Word) * size),
+        .need = cvm_calloc(size + 1, sizeof(Word)),
+        .grow = cvm_calloc(size + 1, sizeof(Word)),
+        .net = cvm_malloc(sizeof(Word) * size),
+        .diag = diag,
+    };
+    if(stack_depth == NULL || routine_of == NULL || verifier.worklist == NULL
+       || verifier.need == NULL || verifier.grow == NULL || verifier.net == NULL){
+        cvm_fail("Out of memory : %s\n", strerror(errno));
+    }
+    program->stack_depth = stack_depth;
+    program->routine = routine_of;
+    for(Word i = 0; i < program->size; i++){
+        stack_depth[i] = CVM_DEPTH_UNREACHABLE;
+        verifier.net[i] = CVM_DEPTH_UNREACHABLE;
+    }
+
+    stack_depth[0] = 0;
+    routine_of[0] = -1;
+    verifier.worklist[verifier.worklist_size++] = 0;
+
+    int ok = 1;
+    while(ok && verifier.worklist_size > 0){
+        Word ip = verifier.worklist[--verifier.worklist_size];
+        Word depth = stack_depth[ip];
+        Word routine = routine_of[ip];
+        Inst inst = program->inst[ip];
+        Word slot = cvm_verifier_slot(&verifier, routine);
+        if(depth > verifier.grow[slot]){
+            verifier.grow[slot] = depth;
+        }
+
+        // A fused instruction is checked as the sequence it stands for: the tail
+        // must still be in place, and the walk carries on through the head alone.
+        if(inst_fused_length(inst.type) > 1){
+            if(!cvm_verify_fused_tail(program, ip)){
+                ok = cvm_verify_fail(diag, ip, depth, "fused instruction does not match the instructions after it");
+                break;
+            }
+            inst = inst_fused_head(inst);
+        }
+
+        switch(inst.type){
+            case INST_NOP:
+                ok = cvm_verify_edge(&verifier, routine, ip, ip + 1, depth);
+                break;
+            case INST_PUSH:
+                ok = cvm_verify_edge(&verifier, routine, ip, ip + 1, depth + 1);
+                break;
+            case INST_DUP:
+                if(inst.operand < 0){
+                    ok = cvm_verify_fail(diag, ip, depth, "negative dup operand");
+                    break;
+                }
+                // No stack is that deep, and need stays far from overflowing.
+                if(inst.operand >= CVM_STACK_CAPACITY_MAX){
+                    ok = cvm_verify_fail(diag, ip, depth, "dup reaches below the bottom of the stack");
+                    break;
+                }
+                ok = cvm_verify_take(&verifier, routine, ip, depth, inst.operand + 1, "dup reaches below the bottom of the stack")
+                    && cvm_verify_edge(&verifier, routine, ip, ip + 1, depth + 1);
+                break;
+            case INST_PLUS:
+            case INST_MINUS:
+            case INST_MULT:
+            case INST_DIV:
+            case INST_EQ:
+                ok = cvm_verify_take(&verifier, routine, ip, depth, 2, "stack underflow")
+                    && cvm_verify_edge(&verifier, routine, ip, ip + 1, depth - 1);
+                break;
+            case INST_JMP:
+                ok = cvm_verify_edge(&verifier, routine, ip, inst.operand, depth);
+                break;
+            case INST_JMP_IF:
+                // The condition is only popped when the jump is taken.
+                ok = cvm_verify_take(&verifier, routine, ip, depth, 1, "stack underflow")
+                    && cvm_verify_edge(&verifier, routine, ip, inst.operand, depth - 1)
+                    && cvm_verify_edge(&verifier, routine, ip, ip + 1, depth);
+                break;
+            case INST_HALT:
+                break;
+            case INST_PRINT_DEBUG:
+                ok = cvm_verify_take(&verifier, routine, ip, depth, 1, "stack underflow")
+                    && cvm_verify_edge(&verifier, routine, ip, ip + 1, depth - 1);
+                break;
+            case INST_LOAD:
+            case INST_ALLOC:
+                ok = cvm_verify_take(&verifier, routine, ip, depth, 1, "stack underflow")
+                    && cvm_verify_edge(&verifier, routine, ip, ip + 1, depth);
+                break;
+            case INST_STORE:
+                ok = cvm_verify_take(&verifier, routine, ip, depth, 2, "stack underflow")
+                    && cvm_verify_edge(&verifier, routine, ip, ip + 1, depth - 2);
+                break;
+            case INST_MEMCPY:
+            case INST_MEMSET:
+                ok = cvm_verify_take(&verifier, routine, ip, depth, 3, "stack underflow")
+                    && cvm_verify_edge(&verifier, routine, ip, ip + 1, depth - 3);
+                break;
+            case INST_RESET:
+            case INST_YIELD:
+                ok = cvm_verify_edge(&verifier, routine, ip, ip + 1, depth);
+                break;
+            case INST_NATIVE: {
+                const Cvm_Native *native = cvm_native_at(inst.operand);
+                if(native == NULL){
+                    ok = cvm_verify_fail(diag, ip, depth, "unknown native");
+                    break;
+                }
+                ok = cvm_verify_take(&verifier, routine, ip, depth, native->arity, "stack underflow")
+                    && cvm_verify_edge(&verifier, routine, ip, ip + 1, depth - native->arity + native->results);
+                break;
+            }
+            case INST_CALL:
+                ok = cvm_verify_edge(&verifier, inst.operand, ip, inst.operand, 0);
+                // Once the routine is known to return, so is the call.
+                if(ok && verifier.net[inst.operand] != CVM_DEPTH_UNREACHABLE){
+                    ok = cvm_verify_edge(&verifier, routine, ip, ip + 1, depth + verifier.net[inst.operand]);
+                }
+                break;
+            case INST_RET:
+                if(routine < 0){
+                    ok = cvm_verify_fail(diag, ip, depth, "ret outside of a routine");
+                    break;
+                }
+                if(verifier.net[routine] != CVM_DEPTH_UNREACHABLE){
+                    if(verifier.net[routine] != depth){
+                        ok = cvm_verify_fail(diag, ip, depth, "routine returns with different stack depths");
+                    }
+                    break;
+                }
+                verifier.net[routine] = depth;
+                // Calls reached so far; the ones found later pick up net themselves.
+                for(Word call = 0; ok && call < program->size; call++){
+                    if(program->inst[call].type == INST_CALL && program->inst[call].operand == routine
+                       && stack_depth[call] != CVM_DEPTH_UNREACHABLE){
+                        ok = cvm_verify_edge(&verifier, routine_of[call], call, call + 1, stack_depth[call] + depth);
+                    }
+                }
+                break;
+            case INST_PLUS_IMM:
+            case INST_PUSH2:
+            case INST_JMP_IF_EQ:
+            default:
+                ok = cvm_verify_fail(diag, ip, depth, "illegal instruction");
+                break;
+        }
+    }
+    ok = ok && cvm_verify_calls(&verifier);
+
+    cvm_free(verifier.net);
+    cvm_free(verifier.grow);
+    cvm_free(verifier.need);
+    cvm_free(verifier.worklist);
+    program->verified = ok;
+    return ok;
+}
+
+void cvm_verify_diag_print(FILE *stream, const Cvm_Program *program, const Cvm_Verify_Diag *diag){
+    fprintf(stream, "ERROR: Verification failed at ip %lld", (long long) diag->ip);
+    if(diag->ip >= 0 && diag->ip < program->size){
+        Inst inst = program->inst[diag->ip];
+        if((unsigned) inst.type < INST_TYPE_COUNT){
+            fprintf(stream, " (%s %lld)", inst_type_as_sctr(inst.type), (long long) inst.operand);
+        }
+    }
+    fprintf(stream, ", stack depth %lld: %s\n", (long long) diag->depth, diag->reason);
+}
+
+// Fast path for programs accepted by cvm_verify_program: stack bounds, dup operands,
+// opcodes and jump targets were all proven statically, so the only checks left are
+// division by zero, memory bounds and the return stack. Only valid in a state
+// cvm_can_run_unchecked accepts, with the stack holding max_stack_depth words.
+//
+// Fuel is charged as cvm_execute_program does: a whole block on entry when it
+// fits in what is left, and per instruction in the block that would run it out
+// and from a resume point in the middle of a block. left is what the current
+// charge still covers; a fused instruction runs whole only when it covers them all.
+Error cvm_execute_program_unchecked(Cvm *cvm, int lim){
+    const Inst *program = cvm->program;
+    const Cvm_Block *blocks = cvm->image->blocks;
+    Word *stack = cvm->stack;
+    Word sp = cvm->stack_size;
+    Word ip = cvm->ip;
+    Error error = ERROR_OK;
+
+    int i = lim;
+    Word left = i < 0 ? INT64_MAX : 0;
+    int exact = 0;
+    if(left == 0){
+        goto charge;
+    }
+    for(;;){
+        Inst inst = program[ip];
+        switch(inst.type){
+            case INST_NOP:
+                ip++;
+                continue;
+            case INST_PUSH:
+                stack[sp++] = inst.operand;
+                ip++;
+                break;
+            case INST_DUP:
+                stack[sp] = stack[sp - 1 - inst.operand];
+                sp++;
+                ip++;
+                break;
+            case INST_PLUS:
+                stack[sp - 2] += stack[sp - 1];
+                sp--;
+                ip++;
+                break;
+            case INST_MINUS:
+                stack[sp - 2] -= stack[sp - 1];
+                sp--;
+                ip++;
+                break;
+            case INST_MULT:
+                stack[sp - 2] *= stack[sp - 1];
+                sp--;
+                ip++;
+                break;
+            case INST_DIV:
+                if(stack[sp - 1] == 0){
+                    error = ERROR_DIV_BY_ZERO;
+                    goto done;
+                }
+                stack[sp - 2] /= stack[sp - 1];
+                sp--;
+                ip++;
+                break;
+            case INST_JMP:
+                ip = inst.operand;
+                break;
+            case INST_JMP_IF:
+                if(stack[sp - 1]){
+                    sp--;
+                    ip = inst.operand;
+                }
+                else{
+                    ip++;
+                }
+                break;
+            case INST_EQ:
+                stack[sp - 2] = stack[sp - 2] == stack[sp - 1];
+                sp--;
+                ip++;
+                break;
+            case INST_HALT:
+                cvm->halt = 1;
+                goto done;
+            case INST_PRINT_DEBUG:
+                cvm_output_word(cvm, stack[sp - 1]);
+                sp--;
+                ip++;
+                break;
+            case INST_PLUS_IMM:
+                if(left < 2){
+                    stack[sp++] = inst.operand;
+                    ip++;
+                    break;
+                }
+                stack[sp - 1] += inst.operand;
+                ip += 2;
+                left--;
+                break;
+            case INST_PUSH2:
+                if(left < 2){
+                    stack[sp++] = inst.operand;
+                    ip++;
+                    break;
+                }
+                stack[sp] = inst.operand;
+                stack[sp + 1] = program[ip + 1].operand;
+                sp += 2;
+                ip += 2;
+                left--;
+                break;
+            case INST_JMP_IF_EQ:
+                if(left < 4){
+                    stack[sp] = stack[sp - 1];
+                    sp++;
+                    ip++;
+                    break;
+                }
+                if(stack[sp - 1] == inst.operand){
+                    ip = program[ip + 3].operand;
+                }
+                else{
+                    stack[sp++] = 0;
+                    ip += 4;
+                }
+                left -= 3;
+                break;
+            case INST_LOAD:
+            case INST_STORE:
+            case INST_MEMCPY:
+            case INST_MEMSET:
+            case INST_ALLOC:
+            case INST_RESET:
+            case INST_NATIVE:
+                // Addresses are only known at run time, so memory keeps its checks,
+                // and natives do their own.
+                cvm->stack_size = sp;
+                cvm->ip = ip;
+                error = cvm_ex_plain_inst(cvm, inst);
+                sp = cvm->stack_size;
+                ip = cvm->ip;
+                if(error != ERROR_OK){
+                    goto done;
+                }
+                break;
+            case INST_CALL:
+                if(cvm->return_stack_size >= cvm->return_stack_capacity && !cvm_return_stack_reserve(cvm, cvm->return_stack_size + 1)){
+                    error = ERROR_RETURN_STACK_OVERFLOW;
+                    goto done;
+                }
+                cvm->return_stack[cvm->return_stack_size++] = ip + 1;
+                ip = inst.operand;
+                break;
+            case INST_RET: {
+                if(cvm->return_stack_size < 1){
+                    error = ERROR_RETURN_STACK_UNDERFLOW;
+                    goto done;
+                }
+                // Calls only push proven return points, and cvm_can_run_unchecked
+                // walked the rest of the return stack before the run.
+                ip = cvm->return_stack[--cvm->return_stack_size];
+                break;
+            }
+            case INST_YIELD:
+                cvm->yielded = 1;
+                ip++;
+                left--;
+                goto done;
+            default:
+                error = ERROR_ILLEGAL_INST;
+                goto done;
+        }
+        if(CVM_UNLIKELY(--left == 0)){
+        charge:
+            // NOPs are free, so the charge goes to the first block past them; only
+            // block entries have a cost.
+            for(;;){
+                if(i == 0){
+                    goto done;
+                }
+                if(program[ip].type != INST_NOP){
+                    break;
+                }
+                ip++;
+            }
+            left = blocks != NULL ? blocks[ip].cost : 0;
+            exact = left == 0 || i < left;
+            if(exact){
+                left = 1;
+            }
+            i -= (int) left;
+        }
+    }
+
+done:
+    // As with cvm_execute_exact, an instruction that fails is not charged for; a
+    // block that fails has been.
+    if(error != ERROR_OK && exact){
+        i += (int) left;
+    }
+    cvm->stack_size = sp;
+    cvm->ip = ip;
+    cvm->fuel = i;
+    cvm_output_flush(cvm);
+    return error;
+}
+
+// Whether the VM is in a state cvm_verify_program reasoned about: at a reachable
+// ip, and with every return address just past a reachable call of the routine it
+// returns from, down to code reached from ip 0, so that the proven depths of the
+// frames add up to the stack size.
+static int cvm_can_run_unchecked(const Cvm *cvm){
+    const Cvm_Program *program = cvm->image;
+    if(program == NULL || !program->verified
+       || program->max_stack_depth > cvm->stack_limit
+       || cvm->ip < 0 || cvm->ip >= cvm->program_size
+       || program->stack_depth[cvm->ip] == CVM_DEPTH_UNREACHABLE){
+        return 0;
+    }
+    Word base = cvm->stack_size - program->stack_depth[cvm->ip];
+    Word routine = program->routine[cvm->ip];
+    for(Word i = cvm->return_stack_size; i-- > 0;){
+        Word call = cvm->return_stack[i] - 1;
+        if(routine < 0 || call < 0 || call >= program->size
+           || program->inst[call].type != INST_CALL || program->inst[call].operand != routine
+           || program->stack_depth[call] == CVM_DEPTH_UNREACHABLE){
+            return 0;
+        }
+        base -= program->stack_depth[call];
+        routine = program->routine[call];
+    }
+    return routine < 0 && base == 0;
+}
+
+typedef enum {
+    CVM_ENGINE_SWITCH = 0,
+    CVM_ENGINE_THREADED,
+    CVM_ENGINE_JIT,
+    CVM_ENGINE_TOS,
+    CVM_ENGINE_TRACE,
+    CVM_ENGINE_AUTO,
+} Cvm_Engine;
+
+// auto runs verified programs unchecked and everything else on this engine. Any
+// other engine is used as asked, verified or not, so engines can be compared.
+#ifndef CVM_AUTO_ENGINE
+#ifdef CVM_HAVE_COMPUTED_GOTO
+#define CVM_AUTO_ENGINE CVM_ENGINE_THREADED
+#else
+#define CVM_AUTO_ENGINE CVM_ENGINE_SWITCH
+#endif
+#endif
+
+#ifndef CVM_DEFAULT_ENGINE
+#define CVM_DEFAULT_ENGINE CVM_ENGINE_AUTO
+#endif
+
+const char *cvm_engine_as_cstr(Cvm_Engine engine){
+    switch(engine){
+        case CVM_ENGINE_SWITCH:
+            return "switch";
+        case CVM_ENGINE_THREADED:
+            return "threaded";
+        case CVM_ENGINE_JIT:
+            return "jit";
+        case CVM_ENGINE_TOS:
+            return "tos";
+        case CVM_ENGINE_TRACE:
+            return "trace";
+        case CVM_ENGINE_AUTO:
+            return "auto";
+        default:
+            assert(0 && "cvm_engine_as_cstr: Unknown engine");
+    }
+}
+
+int cvm_engine_from_cstr(const char *name, Cvm_Engine *engine){
+    if(strcmp(name, "switch") == 0){
+        *engine = CVM_ENGINE_SWITCH;
+        return 1;
+    }
+    if(strcmp(name, "threaded") == 0){
+        *engine = CVM_ENGINE_THREADED;
+        return 1;
+    }
+    if(strcmp(name, "jit") == 0){
+        *engine = CVM_ENGINE_JIT;
+        return 1;
+    }
+    if(strcmp(name, "tos") == 0){
+        *engine = CVM_ENGINE_TOS;
+        return 1;
+    }
+    if(strcmp(name, "trace") == 0){
+        *engine = CVM_ENGINE_TRACE;
+        return 1;
+    }
+    if(strcmp(name, "auto") == 0){
+        *engine = CVM_ENGINE_AUTO;
+        return 1;
+    }
+    return 0;
+}
+
+#ifdef CVM_HAVE_COMPUTED_GOTO
+
+// One pre-decoded instruction: the address of its handler inside
+// cvm_execute_program_threaded and the operand copied out of the Inst.
+typedef struct {
+    const void *label;
+    Word operand;
+} Cvm_Threaded_Inst;
+
+// A program decoded for cvm_execute_program_threaded: size + 1 slots, the last a
+// sentinel for running off the end, and for block entries, which dispatch to
+// op_block, the handler the block starts with.
+typedef struct Cvm_Threaded {
+    Cvm_Threaded_Inst *code;
+    const void **bodies;
+} Cvm_Threaded;
+
+static void cvm_threaded_free(Cvm_Threaded *threaded){
+    cvm_free(threaded->bodies);
+    cvm_free(threaded->code);
+    cvm_free(threaded);
+}
+
+static void cvm_threaded_release(Cvm_Program *program){
+    Cvm_Threaded *threaded = atomic_exchange(&program->threaded, NULL);
+    if(threaded != NULL){
+        cvm_threaded_free(threaded);
+    }
+}
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+
+// Same semantics as cvm_execute_program, but the program is decoded into a stream
+// of handler addresses and every handler jumps straight to the next one. The
+// stream is decoded on the first run and shared by every context attached to the
+// program, like the JIT's code. Jump targets are validated while decoding and
+// running off the end of the program lands on a sentinel slot, so the dispatch
+// itself never checks ip. Every block entry goes through op_block, which charges
+// the fuel for the whole block and then jumps to the real handler kept in bodies.
+Error cvm_execute_program_threaded(Cvm *cvm, int lim){
+    static const void *const labels[] = {
+        [INST_NOP] = &&op_nop,
+        [INST_PUSH] = &&op_push,
+        [INST_DUP] = &&op_dup,
+        [INST_PLUS] = &&op_plus,
+        [INST_MINUS] = &&op_minus,
+        [INST_MULT] = &&op_mult,
+        [INST_DIV] = &&op_div,
+        [INST_JMP] = &&op_jmp,
+        [INST_JMP_IF] = &&op_jmp_if,
+        [INST_EQ] = &&op_eq,
+        [INST_HALT] = &&op_halt,
+        [INST_PRINT_DEBUG] = &&op_print_debug,
+        [INST_PLUS_IMM] = &&op_plus_imm,
+        [INST_PUSH2] = &&op_push2,
+        [INST_JMP_IF_EQ] = &&op_jmp_if_eq,
+        [INST_LOAD] = &&op_interpret,
+        [INST_STORE] = &&op_interpret,
+        [INST_MEMCPY] = &&op_interpret,
+        [INST_MEMSET] = &&op_interpret,
+        [INST_ALLOC] = &&op_interpret,
+        [INST_RESET] = &&op_interpret,
+        [INST_NATIVE] = &&op_interpret,
+        [INST_CALL] = &&op_call,
+        [INST_RET] = &&op_ret,
+        [INST_YIELD] = &&op_yield,
+    };
+
+    Error error = ERROR_OK;
+    int i = lim;
+    if(i == 0 || cvm->halt){
+        cvm->fuel = i;
+        return error;
+    }
+
+    const Cvm_Block *blocks = cvm->image != NULL ? cvm->image->blocks : NULL;
+    if(blocks == NULL){
+        return cvm_execute_program(cvm, lim);
+    }
+
+    Word size = cvm->program_size;
+    Cvm_Threaded *threaded = atomic_load(&cvm->image->threaded);
+    if(threaded == NULL){
+        threaded = cvm_malloc(sizeof(*threaded));
+        Cvm_Threaded_Inst *code = cvm_malloc(sizeof(code[0]) * (size + 1));
+        const void **bodies = cvm_malloc(sizeof(bodies[0]) * (size + 1));
+        if(threaded == NULL || code == NULL || bodies == NULL){
+            cvm_fail("Out of memory : %s\n", strerror(errno));
+        }
+
+        for(Word j = 0; j < size; j++){
+            Inst inst = cvm->program[j];
+            if(inst.type < 0 || (size_t) inst.type >= ARRAY_SIZE(labels)){
+                code[j].label = &&op_illegal;
+            }
+            else if((inst.type == INST_JMP || inst.type == INST_JMP_IF) && (inst.operand < 0 || inst.operand >= size)){
+                code[j].label = inst.type == INST_JMP ? &&op_jmp_out : &&op_jmp_if_out;
+            }
+            else if(j + inst_fused_length(inst.type) > size
+                    || (inst.type == INST_JMP_IF_EQ && (cvm->program[j + 3].operand < 0 || cvm->program[j + 3].operand >= size))){
+                // Incomplete sequence or a target that faults: only run the head and
+                // let the tail take the ordinary paths.
+                code[j].label = inst.type == INST_JMP_IF_EQ ? &&op_dup_top : &&op_push;
+            }
+            else{
+                code[j].label = labels[inst.type];
+            }
+            code[j].operand = inst.operand;
+        }
+        code[size].label = &&op_illegal_access;
+        code[size].operand = 0;
+
+        for(Word j = 0; j < size; j++){
+            // A fused instruction must not run past the start of the next block.
+            Word len = inst_fused_length(cvm->program[j].type);
+            for(Word k = j + 1; k < j + len && k < size; k++){
+                if(blocks[k].length > 0){
+                    code[j].label = cvm->program[j].type == INST_JMP_IF_EQ ? &&op_dup_top : &&op_push;
+                    break;
+                }
+            }
+            if(blocks[j].length > 0){
+                bodies[j] = code[j].label;
+                code[j].label = &&op_block;
+            }
+        }
+        *threaded = (Cvm_Threaded){ .code = code, .bodies = bodies };
+        Cvm_Threaded *expected = NULL;
+        if(!atomic_compare_exchange_strong(&cvm->image->threaded, &expected, threaded)){
+            // Another context decoded the same program first; use its stream.
+            cvm_threaded_free(threaded);
+            threaded = expected;
+        }
+    }
+    const Cvm_Threaded_Inst *code = threaded->code;
+    const void *const *bodies = threaded->bodies;
+
+    Word *stack = cvm->stack;
+    Word sp = cvm->stack_size;
+    Word ip = cvm->ip;
+    Word cap = cvm->stack_capacity;
+
+#define DISPATCH() goto *code[ip].label
+#define NEXT() DISPATCH()
+#define FAIL(e) do { error = (e); goto done; } while(0)
+// The stack moves when it grows, here or in the interpreter.
+#define REFRESH() do { stack = cvm->stack; cap = cvm->stack_capacity; } while(0)
+#define GROW(n) do { if(!cvm_stack_reserve(cvm, (n))) FAIL(ERROR_STACK_OVERFLOW); REFRESH(); } while(0)
+
+    if(ip < 0 || ip >= size){
+        FAIL(ERROR_ILLEGAL_INST_ACCESS);
+    }
+    if(blocks[ip].length == 0){
+        goto exact;
+    }
+    DISPATCH();
+
+op_block:
+    if(i == 0){
+        goto done;
+    }
+    if(i > 0){
+        if(i < blocks[ip].cost){
+            goto exact;
+        }
+        i -= blocks[ip].cost;
+    }
+    goto *bodies[ip];
+exact:
+    // The last block before the fuel runs out, or a resume point in the middle of one.
+    cvm->stack_size = sp;
+    cvm->ip = ip;
+    error = cvm_execute_exact(cvm, &i, blocks);
+    sp = cvm->stack_size;
+    REFRESH();
+    ip = cvm->ip;
+    if(error != ERROR_OK || cvm->halt || cvm->yielded || i == 0){
+        goto done;
+    }
+    DISPATCH();
+
+op_nop:
+    ip++;
+    DISPATCH();
+op_push:
+    if(sp >= cap){
+        GROW(sp + 1);
+    }
+    stack[sp++] = code[ip].operand;
+    ip++;
+    NEXT();
+op_dup:
+    if(sp >= cap){
+        GROW(sp + 1);
+    }
+    if(sp - code[ip].operand <= 0){
+        FAIL(ERROR_STACK_UNDERFLOW);
+    }
+    if(code[ip].operand < 0){
+        FAIL(ERROR_ILLEGAL_OPERAND);
+    }
+    stack[sp] = stack[sp - 1 - code[ip].operand];
+    sp++;
+    ip++;
+    NEXT();
+op_plus:
+    if(sp < 2){
+        FAIL(ERROR_STACK_UNDERFLOW);
+    }
+    stack[sp - 2] += stack[sp - 1];
+    sp--;
+    ip++;
+    NEXT();
+op_minus:
+    if(sp < 2){
+        FAIL(ERROR_STACK_UNDERFLOW);
+    }
+    stack[sp - 2] -= stack[sp - 1];
+    sp--;
+    ip++;
+    NEXT();
+op_mult:
+    if(sp < 2){
+        FAIL(ERROR_STACK_UNDERFLOW);
+    }
+    stack[sp - 2] *= stack[sp - 1];
+    sp--;
+    ip++;
+    NEXT();
+op_div:
+    if(sp < 2){
+        FAIL(ERROR_STACK_UNDERFLOW);
+    }
+    if(stack[sp - 1] == 0){
+        FAIL(ERROR_DIV_BY_ZERO);
+    }
+    stack[sp - 2] /= stack[sp - 1];
+    sp--;
+    ip++;
+    NEXT();
+op_jmp:
+    ip = code[ip].operand;
+    NEXT();
+op_jmp_if:
+    if(sp < 1){
+        FAIL(ERROR_STACK_UNDERFLOW);
+    }
+    if(stack[sp - 1]){
+        sp--;
+        ip = code[ip].operand;
+    }
+    else{
+        ip++;
+    }
+    NEXT();
+op_eq:
+    if(sp < 2){
+        FAIL(ERROR_STACK_UNDERFLOW);
+    }
+    stack[sp - 2] = stack[sp - 2] == stack[sp - 1];
+    sp--;
+    ip++;
+    NEXT();
+op_halt:
+    cvm->halt = 1;
+    goto done;
+op_print_debug:
+    if(sp < 1){
+        FAIL(ERROR_STACK_UNDERFLOW);
+    }
+    cvm_output_word(cvm, stack[sp - 1]);
+    sp--;
+    ip++;
+    NEXT();
+op_plus_imm:
+    if(sp < 1 || sp >= cap){
+        goto op_push;
+    }
+    stack[sp - 1] += code[ip].operand;
+    ip += 2;
+    NEXT();
+op_push2:
+    if(sp + 2 > cap){
+        goto op_push;
+    }
+    stack[sp] = code[ip].operand;
+    stack[sp + 1] = code[ip + 1].operand;
+    sp += 2;
+    ip += 2;
+    NEXT();
+op_jmp_if_eq:
+    if(sp < 1 || sp + 2 > cap){
+        goto op_dup_top;
+    }
+    if(stack[sp - 1] == code[ip].operand){
+        ip = code[ip + 3].operand;
+    }
+    else{
+        stack[sp++] = 0;
+        ip += 4;
+    }
+    NEXT();
+op_dup_top:
+    if(sp >= cap){
+        GROW(sp + 1);
+    }
+    if(sp <= 0){
+        FAIL(ERROR_STACK_UNDERFLOW);
+    }
+    stack[sp] = stack[sp - 1];
+    sp++;
+    ip++;
+    NEXT();
+op_interpret:
+    // Memory and native instructions run on the interpreter; the block has paid for them.
+    cvm->stack_size = sp;
+    cvm->ip = ip;
+    error = cvm_ex_plain_inst(cvm, cvm->program[ip]);
+    sp = cvm->stack_size;
+    REFRESH();
+    ip = cvm->ip;
+    if(error != ERROR_OK){
+        goto done;
+    }
+    DISPATCH();
+op_call:
+    if(cvm->return_stack_size >= cvm->return_stack_capacity && !cvm_return_stack_reserve(cvm, cvm->return_stack_size + 1)){
+        FAIL(ERROR_RETURN_STACK_OVERFLOW);
+    }
+    cvm->return_stack[cvm->return_stack_size++] = ip + 1;
+    ip = code[ip].operand;
+    goto land;
+op_ret:
+    if(cvm->return_stack_size < 1){
+        FAIL(ERROR_RETURN_STACK_UNDERFLOW);
+    }
+    ip = cvm->return_stack[--cvm->return_stack_size];
+    goto land;
+op_yield:
+    // Always the last instruction of its block, which has been paid for.
+    cvm->yielded = 1;
+    ip++;
+    goto done;
+land:
+    // Call targets are not checked while decoding and return addresses are only
+    // known now. As for jmp, landing outside only faults with fuel left.
+    if(ip < 0 || ip >= size){
+        if(i == 0) goto done;
+        FAIL(ERROR_ILLEGAL_INST_ACCESS);
+    }
+    NEXT();
+op_illegal:
+    FAIL(ERROR_ILLEGAL_INST);
+op_illegal_access:
+    // Running off the end only faults if there was fuel left to run on.
+    if(i == 0) goto done;
+    FAIL(ERROR_ILLEGAL_INST_ACCESS);
+op_jmp_out:
+    // The jump itself succeeds, the next dispatch is what faults.
+    ip = code[ip].operand;
+    if(i == 0) goto done;
+    FAIL(ERROR_ILLEGAL_INST_ACCESS);
+op_jmp_if_out:
+    if(sp < 1){
+        FAIL(ERROR_STACK_UNDERFLOW);
+    }
+    if(stack[sp - 1]){
+        sp--;
+        ip = code[ip].operand;
+        if(i == 0) goto done;
+        FAIL(ERROR_ILLEGAL_INST_ACCESS);
+    }
+    ip++;
+    NEXT();
+
+#undef GROW
+#undef REFRESH
+#undef FAIL
+#undef NEXT
+#undef DISPATCH
+
+done:
+    cvm->stack_size = sp;
+    cvm->ip = ip;
+    cvm->fuel = i;
+    cvm_output_flush(cvm);
+    return error;
+}
+
+#pragma GCC diagnostic pop
+
+#else
+
+static void cvm_threaded_release(Cvm_Program *program){
+    (void) program;
+}
+
+Error cvm_execute_program_threaded(Cvm *cvm, int lim){
+    return cvm_execute_program(cvm, lim);
+}
+
+#endif
+
+#ifdef CVM_HAVE_COMPUTED_GOTO
+
+// One decoded block: a handler and operand per instruction slot, closed by an
+// end-of-block entry, and links to the blocks it was seen to continue into.
+// Blocks of NOPs decode to the end entry alone.
+typedef struct Cvm_Trace {
+    Word ip;
+    Word cost;
+    Word length;
+    struct Cvm_Trace *fallthrough;
+    struct Cvm_Trace *taken;
+    struct Cvm_Trace *next_allocated;
+    Cvm_Threaded_Inst code[];
+} Cvm_Trace;
+
+static void cvm_trace_release(Cvm *cvm){
+    while(cvm->trace_list != NULL){
+        Cvm_Trace *trace = cvm->trace_list;
+        cvm->trace_list = trace->next_allocated;
+        cvm_free(trace);
+    }
+    cvm_free(cvm->traces);
+    cvm->traces = NULL;
+}
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+
+// Same semantics as cvm_execute_program. Blocks are decoded the first time their
+// entry ip is reached and kept in cvm->traces until the next attach, so a large
+// program only pays for the parts it runs. Inside a block nothing looks at ip:
+// handlers step through the decoded slots and ip is recovered from the slot on
+// the way out. Fuel is charged per block, as in cvm_execute_program.
+Error cvm_execute_program_trace(Cvm *cvm, int lim){
+    static const void *const labels[] = {
+        [INST_NOP] = &&op_nop,
+        [INST_PUSH] = &&op_push,
+        [INST_DUP] = &&op_dup,
+        [INST_PLUS] = &&op_plus,
+        [INST_MINUS] = &&op_minus,
+        [INST_MULT] = &&op_mult,
+        [INST_DIV] = &&op_div,
+        [INST_JMP] = &&op_jmp,
+        [INST_JMP_IF] = &&op_jmp_if,
+        [INST_EQ] = &&op_eq,
+        [INST_HALT] = &&op_halt,
+        [INST_PRINT_DEBUG] = &&op_print_debug,
+        [INST_PLUS_IMM] = &&op_plus_imm,
+        [INST_PUSH2] = &&op_push2,
+        [INST_JMP_IF_EQ] = &&op_jmp_if_eq,
+        [INST_LOAD] = &&op_interpret,
+        [INST_STORE] = &&op_interpret,
+        [INST_MEMCPY] = &&op_interpret,
+        [INST_MEMSET] = &&op_interpret,
+        [INST_ALLOC] = &&op_interpret,
+        [INST_RESET] = &&op_interpret,
+        [INST_NATIVE] = &&op_interpret,
+        [INST_CALL] = &&op_call,
+        [INST_RET] = &&op_ret,
+        [INST_YIELD] = &&op_yield,
+    };
+
+    Error error = ERROR_OK;
+    int i = lim;
+    if(i == 0 || cvm->halt){
+        cvm->fuel = i;
+        return error;
+    }
+
+    const Cvm_Block *blocks = cvm->image != NULL ? cvm->image->blocks : NULL;
+    if(blocks == NULL){
+        return cvm_execute_program(cvm, lim);
+    }
+
+    const Inst *program = cvm->program;
+    const Word size = cvm->program_size;
+    if(cvm->traces == NULL){
+        cvm->traces = cvm_calloc(size + 1, sizeof(cvm->traces[0]));
+        if(cvm->traces == NULL){
+            cvm_fail("Out of memory : %s\n", strerror(errno));
+        }
+    }
+
+    Word *stack = cvm->stack;
+    Word sp = cvm->stack_size;
+    Word ip = cvm->ip;
+    Word cap = cvm->stack_capacity;
+    Cvm_Trace *trace = NULL;
+    Cvm_Trace **link = NULL;
+    const Cvm_Threaded_Inst *pc = NULL;
+
+#define DISPATCH() goto *pc->label
+#define NEXT() do { pc++; DISPATCH(); } while(0)
+#define SYNC_IP() (ip = trace->ip + (pc - trace->code))
+#define FAIL(e) do { error = (e); SYNC_IP(); goto done; } while(0)
+// The stack moves when it grows, here or in the interpreter.
+#define REFRESH() do { stack = cvm->stack; cap = cvm->stack_capacity; } while(0)
+#define GROW(n) do { if(!cvm_stack_reserve(cvm, (n))) FAIL(ERROR_STACK_OVERFLOW); REFRESH(); } while(0)
+// Leaves the block for a successor, following the link once it is known.
+#define FOLLOW(successor, target) do { \
+        if(trace->successor != NULL){ trace = trace->successor; goto enter; } \
+        link = &trace->successor; ip = (target); goto resolve; \
+    } while(0)
+
+resolve:
+    // Running off the end or jumping out only faults if there was fuel left.
+    if(ip < 0 || ip >= size){
+        if(i == 0) goto done;
+        error = ERROR_ILLEGAL_INST_ACCESS;
+        goto done;
+    }
+    trace = cvm->traces[ip];
+    if(trace == NULL){
+        if(blocks[ip].length == 0){
+            goto exact;
+        }
+        Word length = blocks[ip].length;
+        Word slots = program[ip].type == INST_NOP ? 0 : length;
+        trace = cvm_malloc(sizeof(*trace) + sizeof(trace->code[0]) * (slots + 1));
+        if(trace == NULL){
+            cvm_fail("Out of memory : %s\n", strerror(errno));
+        }
+        *trace = (Cvm_Trace){ .ip = ip, .cost = blocks[ip].cost, .length = length, .next_allocated = cvm->trace_list };
+        for(Word j = 0; j < slots; j++){
+            Inst inst = program[ip + j];
+            if(inst.type < 0 || (size_t) inst.type >= ARRAY_SIZE(labels)){
+                trace->code[j].label = &&op_illegal;
+            }
+            else if(j + inst_fused_length(inst.type) > length){
+                // The tail belongs to the next block: only run the head here.
+                trace->code[j].label = inst.type == INST_JMP_IF_EQ ? &&op_dup_top : &&op_push;
+            }
+            else{
+                trace->code[j].label = labels[inst.type];
+            }
+            trace->code[j].operand = inst.operand;
+        }
+        trace->code[slots].label = &&op_block_end;
+        trace->code[slots].operand = ip + length;
+        cvm->trace_list = trace;
+        cvm->traces[ip] = trace;
+    }
+    if(link != NULL){
+        *link = trace;
+        link = NULL;
+    }
+enter:
+    if(i == 0){
+        ip = trace->ip;
+        goto done;
+    }
+    if(i > 0){
+        if(i < trace->cost){
+            ip = trace->ip;
+            goto exact;
+        }
+        i -= trace->cost;
+    }
+    pc = trace->code;
+    DISPATCH();
+exact:
+    // The last block before the fuel runs out, or a resume point in the middle of one.
+    cvm->stack_size = sp;
+    cvm->ip = ip;
+    error = cvm_execute_exact(cvm, &i, blocks);
+    sp = cvm->stack_size;
+    REFRESH();
+    ip = cvm->ip;
+    if(error != ERROR_OK || cvm->halt || cvm->yielded || i == 0){
+        goto done;
+    }
+    goto resolve;
+
+op_block_end:
+    FOLLOW(fallthrough, pc->operand);
+op_nop:
+    NEXT();
+op_push:
+    if(sp >= cap){
+        GROW(sp + 1);
+    }
+    stack[sp++] = pc->operand;
+    NEXT();
+op_dup:
+    if(sp >= cap){
+        GROW(sp + 1);
+    }
+    if(sp - pc->operand <= 0){
+        FAIL(ERROR_STACK_UNDERFLOW);
+    }
+    if(pc->operand < 0){
+        FAIL(ERROR_ILLEGAL_OPERAND);
+    }
+    stack[sp] = stack[sp - 1 - pc->operand];
+    sp++;
+    NEXT();
+op_plus:
+    if(sp < 2){
+        FAIL(ERROR_STACK_UNDERFLOW);
+    }
+    stack[sp - 2] += stack[sp - 1];
+    sp--;
+    NEXT();
+op_minus:
+    if(sp < 2){
+        FAIL(ERROR_STACK_UNDERFLOW);
+    }
+    stack[sp - 2] -= stack[sp - 1];
+    sp--;
+    NEXT();
+op_mult:
+    if(sp < 2){
+        FAIL(ERROR_STACK_UNDERFLOW);
+    }
+    stack[sp - 2] *= stack[sp - 1];
+    sp--;
+    NEXT();
+op_div:
+    if(sp < 2){
+        FAIL(ERROR_STACK_UNDERFLOW);
+    }
+    if(stack[sp - 1] == 0){
+        FAIL(ERROR_DIV_BY_ZERO);
+    }
+    stack[sp - 2] /= stack[sp - 1];
+    sp--;
+    NEXT();
+op_jmp:
+    FOLLOW(taken, pc->operand);
+op_jmp_if:
+    if(sp < 1){
+        FAIL(ERROR_STACK_UNDERFLOW);
+    }
+    if(stack[sp - 1]){
+        sp--;
+        FOLLOW(taken, pc->operand);
+    }
+    NEXT();
+op_eq:
+    if(sp < 2){
+        FAIL(ERROR_STACK_UNDERFLOW);
+    }
+    stack[sp - 2] = stack[sp - 2] == stack[sp - 1];
+    sp--;
+    NEXT();
+op_halt:
+    SYNC_IP();
+    cvm->halt = 1;
+    goto done;
+op_print_debug:
+    if(sp < 1){
+        FAIL(ERROR_STACK_UNDERFLOW);
+    }
+    cvm_output_word(cvm, stack[sp - 1]);
+    sp--;
+    NEXT();
+op_plus_imm:
+    if(sp < 1 || sp >= cap){
+        goto op_push;
+    }
+    stack[sp - 1] += pc->operand;
+    pc += 2;
+    DISPATCH();
+op_push2:
+    if(sp + 2 > cap){
+        goto op_push;
+    }
+    stack[sp] = pc[0].operand;
+    stack[sp + 1] = pc[1].operand;
+    sp += 2;
+    pc += 2;
+    DISPATCH();
+op_jmp_if_eq:
+    if(sp < 1 || sp + 2 > cap){
+        goto op_dup_top;
+    }
+    if(stack[sp - 1] == pc->operand){
+        pc += 3;
+        FOLLOW(taken, pc->operand);
+    }
+    stack[sp++] = 0;
+    pc += 4;
+    DISPATCH();
+op_dup_top:
+    if(sp >= cap){
+        GROW(sp + 1);
+    }
+    if(sp <= 0){
+        FAIL(ERROR_STACK_UNDERFLOW);
+    }
+    stack[sp] = stack[sp - 1];
+    sp++;
+    NEXT();
+op_interpret:
+    // Memory and native instructions run on the interpreter; the block has paid for them.
+    SYNC_IP();
+    cvm->stack_size = sp;
+    cvm->ip = ip;
+    error = cvm_ex_plain_inst(cvm, program[ip]);
+    sp = cvm->stack_size;
+    REFRESH();
+    if(error != ERROR_OK){
+        goto done;
+    }
+    NEXT();
+op_call:
+    if(cvm->return_stack_size >= cvm->return_stack_capacity && !cvm_return_stack_reserve(cvm, cvm->return_stack_size + 1)){
+        FAIL(ERROR_RETURN_STACK_OVERFLOW);
+    }
+    SYNC_IP();
+    cvm->return_stack[cvm->return_stack_size++] = ip + 1;
+    FOLLOW(taken, pc->operand);
+op_ret:
+    if(cvm->return_stack_size < 1){
+        FAIL(ERROR_RETURN_STACK_UNDERFLOW);
+    }
+    ip = cvm->return_stack[--cvm->return_stack_size];
+    // taken remembers where the last return went, which is usually where the next one goes.
+    if(trace->taken != NULL && trace->taken->ip == ip){
+        trace = trace->taken;
+        goto enter;
+    }
+    link = &trace->taken;
+    goto resolve;
+op_yield:
+    // Always the last instruction of its block, which has been paid for.
+    SYNC_IP();
+    cvm->yielded = 1;
+    ip++;
+    goto done;
+op_illegal:
+    FAIL(ERROR_ILLEGAL_INST);
+
+#undef FOLLOW
+#undef GROW
+#undef REFRESH
+#undef FAIL
+#undef SYNC_IP
+#undef NEXT
+#undef DISPATCH
+
+done:
+    cvm->stack_size = sp;
+    cvm->ip = ip;
+    cvm->fuel = i;
+    cvm_output_flush(cvm);
+    return error;
+}
+
+#pragma GCC diagnostic pop
+
+#else
+
+static void cvm_trace_release(Cvm *cvm){
+    (void) cvm;
+}
+
+Error cvm_execute_program_trace(Cvm *cvm, int lim){
+    return cvm_execute_program(cvm, lim);
+}
+
+#endif
+
+// Same semantics as cvm_execute_program, with the top of the stack, stack_size
+// and ip cached in locals for the whole run instead of going through the Cvm on
+// every instruction. The memory slot of the top element is stale while it is
+// cached. Everything is spilled back before returning and before handing an
+// instruction to cvm_ex_inst_limited, so cvm_dump_stack sees the same stack.
+Error cvm_execute_program_tos(Cvm *cvm, int lim){
+    const Inst *program = cvm->program;
+    const Word size = cvm->program_size;
+    Word cap = cvm->stack_capacity;
+    Word *stack = cvm->stack;
+    Word sp = cvm->stack_size;
+    Word ip = cvm->ip;
+    Word tos = sp > 0 ? stack[sp - 1] : 0;
+    Error error = ERROR_OK;
+
+#define SPILL() do { if(sp > 0) stack[sp - 1] = tos; cvm->stack_size = sp; cvm->ip = ip; } while(0)
+#define RELOAD() do { stack = cvm->stack; cap = cvm->stack_capacity; sp = cvm->stack_size; ip = cvm->ip; tos = sp > 0 ? stack[sp - 1] : 0; } while(0)
+#define FAIL(e) do { error = (e); goto done; } while(0)
+// The cached top survives a move, so growing only has to refetch the stack.
+#define GROW(n) do { if(!cvm_stack_reserve(cvm, (n))) FAIL(ERROR_STACK_OVERFLOW); stack = cvm->stack; cap = cvm->stack_capacity; } while(0)
+
+    int i = lim;
+    if(cvm->halt){
+        cvm->fuel = i;
+        return error;
+    }
+
+    while(i != 0){
+        if(ip < 0 || ip >= size){
+            FAIL(ERROR_ILLEGAL_INST_ACCESS);
+        }
+        Inst inst = program[ip];
+        switch(inst.type){
+            case INST_NOP:
+                ip++;
+                continue;
+            case INST_PUSH:
+                if(sp >= cap){
+                    GROW(sp + 1);
+                }
+                if(sp > 0){
+                    stack[sp - 1] = tos;
+                }
+                tos = inst.operand;
+                sp++;
+                ip++;
+                break;
+            case INST_DUP: {
+                if(sp >= cap){
+                    GROW(sp + 1);
+                }
+                if(sp - inst.operand <= 0){
+                    FAIL(ERROR_STACK_UNDERFLOW);
+                }
+                if(inst.operand < 0){
+                    FAIL(ERROR_ILLEGAL_OPERAND);
+                }
+                Word value = inst.operand == 0 ? tos : stack[sp - 1 - inst.operand];
+                stack[sp - 1] = tos;
+                tos = value;
+                sp++;
+                ip++;
+                break;
+            }
+            case INST_PLUS:
+                if(sp < 2){
+                    FAIL(ERROR_STACK_UNDERFLOW);
+                }
+                tos = stack[sp - 2] + tos;
+                sp--;
+                ip++;
+                break;
+            case INST_MINUS:
+                if(sp < 2){
+                    FAIL(ERROR_STACK_UNDERFLOW);
+                }
+                tos = stack[sp - 2] - tos;
+                sp--;
+                ip++;
+                break;
+            case INST_MULT:
+                if(sp < 2){
+                    FAIL(ERROR_STACK_UNDERFLOW);
+                }
+                tos = stack[sp - 2] * tos;
+                sp--;
+                ip++;
+                break;
+            case INST_DIV:
+                if(sp < 2){
+                    FAIL(ERROR_STACK_UNDERFLOW);
+                }
+                if(tos == 0){
+                    FAIL(ERROR_DIV_BY_ZERO);
+                }
+                tos = stack[sp - 2] / tos;
+                sp--;
+                ip++;
+                break;
+            case INST_JMP:
+                ip = inst.operand;
+                break;
+            case INST_JMP_IF:
+                if(sp < 1){
+                    FAIL(ERROR_STACK_UNDERFLOW);
+                }
+                if(tos){
+                    sp--;
+                    tos = sp > 0 ? stack[sp - 1] : 0;
+                    ip = inst.operand;
+                }
+                else{
+                    ip++;
+                }
+                break;
+            case INST_EQ:
+                if(sp < 2){
+                    FAIL(ERROR_STACK_UNDERFLOW);
+                }
+                tos = stack[sp - 2] == tos;
+                sp--;
+                ip++;
+                break;
+            case INST_HALT:
+                cvm->halt = 1;
+                goto done;
+            case INST_PRINT_DEBUG:
+                if(sp < 1){
+                    FAIL(ERROR_STACK_UNDERFLOW);
+                }
+                cvm_output_word(cvm, tos);
+                sp--;
+                tos = sp > 0 ? stack[sp - 1] : 0;
+                ip++;
+                break;
+            case INST_PLUS_IMM:
+                if((i > 0 && i < 2) || ip + 2 > size || sp < 1 || sp >= cap){
+                    goto slow;
+                }
+                tos += inst.operand;
+                ip += 2;
+                i--;
+                break;
+            case INST_PUSH2:
+                if((i > 0 && i < 2) || ip + 2 > size || sp + 2 > cap){
+                    goto slow;
+                }
+                if(sp > 0){
+                    stack[sp - 1] = tos;
+                }
+                stack[sp] = inst.operand;
+                tos = program[ip + 1].operand;
+                sp += 2;
+                ip += 2;
+                i--;
+                break;
+            case INST_JMP_IF_EQ: {
+                if((i > 0 && i < 4) || ip + 4 > size || sp < 1 || sp + 2 > cap){
+                    goto slow;
+                }
+                Word target = program[ip + 3].operand;
+                if(target < 0 || target >= size){
+                    goto slow;
+                }
+                if(tos == inst.operand){
+                    ip = target;
+                }
+                else{
+                    stack[sp - 1] = tos;
+                    tos = 0;
+                    sp++;
+                    ip += 4;
+                }
+                i -= 3;
+                break;
+            }
+            case INST_CALL:
+                if(cvm->return_stack_size >= cvm->return_stack_capacity && !cvm_return_stack_reserve(cvm, cvm->return_stack_size + 1)){
+                    FAIL(ERROR_RETURN_STACK_OVERFLOW);
+                }
+                cvm->return_stack[cvm->return_stack_size++] = ip + 1;
+                ip = inst.operand;
+                break;
+            case INST_RET:
+                if(cvm->return_stack_size < 1){
+                    FAIL(ERROR_RETURN_STACK_UNDERFLOW);
+                }
+                ip = cvm->return_stack[--cvm->return_stack_size];
+                break;
+            case INST_LOAD:
+            case INST_STORE:
+            case INST_MEMCPY:
+            case INST_MEMSET:
+            case INST_ALLOC:
+            case INST_RESET:
+            case INST_NATIVE:
+            case INST_YIELD:
+            default:
+            slow: {
+                // Partial fused sequences, memory, natives, yield and illegal opcodes go through the interpreter.
+                int retired = 0;
+                SPILL();
+                error = cvm_ex_inst_limited(cvm, i, &retired);
+                RELOAD();
+                if(error != ERROR_OK){
+                    goto out;
+                }
+                i -= retired;
+                if(cvm->halt || cvm->yielded){
+                    goto out;
+                }
+                continue;
+            }
+        }
+        i--;
+    }
+
+done:
+    SPILL();
+out:
+    cvm->fuel = i;
+    cvm_output_flush(cvm);
+    return error;
+
+#undef GROW
+#undef FAIL
+#undef RELOAD
+#undef SPILL
+}
+
+#if defined(__x86_64__) && !defined(CVM_NO_JIT)
+#define CVM_HAVE_JIT 1
+#endif
+
+#ifdef CVM_HAVE_JIT
+
+// x86-64 template JIT. Every instruction is translated on its own from a fixed
+// template. The top of the stack lives in rdi and the words below it in memory;
+// the rest of the state is kept in callee-saved registers:
+//
+//   rbx  stack base       r12  stack_size      r13  remaining limit
+//   r14  Cvm *            r15  stack_capacity  rdi  top of stack, if r12 > 0
+//
+// The slot rdi stands for is stale in memory until the code exits. Every failing
+// check jumps to an out-of-line stub that stores ip and stack_size back into the
+// Cvm, spills rdi and returns the Error, so the state on exit is exactly what
+// cvm_ex_inst leaves behind. Anything without a template (print_debug, call, ret,
+// yield, fused instructions that cannot run as a whole, illegal opcodes) exits with
+// CVM_JIT_SLOW_PATH and cvm_execute_program_jit runs that one instruction on the
+// interpreter before re-entering the native code at the new ip.
+#define CVM_JIT_SLOW_PATH -1
+
+typedef int (*Cvm_Jit_Entry)(Cvm *cvm, Word *limit, const void *target);
+
+struct Cvm_Jit {
+    unsigned char *code;
+    size_t code_size;
+    size_t *offsets; // native offset of every ip
+    Cvm_Jit_Entry entry;
+};
+
+typedef struct {
+    size_t patch_at;
+    Word ip;
+    int status;
+} Jit_Stub;
+
+typedef struct {
+    size_t patch_at;
+    Word target;
+} Jit_Fixup;
+
+typedef struct {
+    Byte_Buffer code;
+    Jit_Stub *stubs;
+    size_t stubs_count;
+    size_t stubs_capacity;
+    Jit_Fixup *fixups;
+    size_t fixups_count;
+    size_t fixups_capacity;
+} Jit_Builder;
+
+static void jit_emit_bytes(Jit_Builder *b, const unsigned char *bytes, size_t count){
+    for(size_t i = 0; i < count; i++){
+        byte_buffer_push(&b->code, bytes[i]);
+    }
+}
+
+#define JIT_EMIT(b, ...) jit_emit_bytes((b), (const unsigned char[]){__VA_ARGS__}, sizeof((const unsigned char[]){__VA_ARGS__}))
+
+static void jit_emit_u32(Jit_Builder *b, uint32_t value){
+    for(int i = 0; i < 4; i++){
+        byte_buffer_push(&b->code, (unsigned char) (value >> (8 * i)));
+    }
+}
+
+static void jit_emit_u64(Jit_Builder *b, uint64_t value){
+    for(int i = 0; i < 8; i++){
+        byte_buffer_push(&b->code, (unsigned char) (value >> (8 * i)));
+    }
+}
+
+static void jit_patch_rel32(Jit_Builder *b, size_t patch_at, size_t target){
+    uint32_t rel = (uint32_t) (target - (patch_at + 4));
+    for(int i = 0; i < 4; i++){
+        b->code.data[patch_at + i] = (unsigned char) (rel >> (8 * i));
+    }
+}
+
+static void *jit_grow(void *items, size_t *capacity, size_t item_size){
+    *capacity = *capacity == 0 ? 64 : *capacity * 2;
+    items = cvm_realloc(items, *capacity * item_size);
+    if(items == NULL){
+        cvm_fail("Out of memory : %s\n", strerror(errno));
+    }
+    return items;
+}
+
+// Emits the rel32 of a jump whose opcode was just emitted, aimed at a stub that
+// leaves with the given ip and status.
+static void jit_emit_to_stub(Jit_Builder *b, Word ip, int status){
+    if(b->stubs_count >= b->stubs_capacity){
+        b->stubs = jit_grow(b->stubs, &b->stubs_capacity, sizeof(Jit_Stub));
+    }
+    b->stubs[b->stubs_count++] = (Jit_Stub){ .patch_at = b->code.count, .ip = ip, .status = status };
+    jit_emit_u32(b, 0);
+}
+
+// Conditional jump (0F cc) to an exit stub.
+static void jit_exit_if(Jit_Builder *b, unsigned char cc, Word ip, int status){
+    JIT_EMIT(b, 0x0F, cc);
+    jit_emit_to_stub(b, ip, status);
+}
+
+static void jit_exit(Jit_Builder *b, Word ip, int status){
+    JIT_EMIT(b, 0xE9);
+    jit_emit_to_stub(b, ip, status);
+}
+
+#define JIT_JB 0x82
+#define JIT_JAE 0x83
+#define JIT_JE 0x84
+#define JIT_JNE 0x85
+#define JIT_JBE 0x86
+#define JIT_JA 0x87
+#define JIT_JL 0x8C
+#define JIT_JLE 0x8E
+
+// Charges n instructions and leaves with ERROR_OK at next_ip once the limit runs out.
+static void jit_emit_charge(Jit_Builder *b, int n, Word next_ip){
+    JIT_EMIT(b, 0x49, 0x83, 0xED, (unsigned char) n); // sub r13, n
+    jit_exit_if(b, JIT_JE, next_ip, ERROR_OK);
+}
+
+// Unconditional transfer to another ip, or the fault of an out-of-range target.
+static void jit_emit_goto(Jit_Builder *b, Word target, Word program_size){
+    if(target < 0 || target >= program_size){
+        jit_exit(b, target, ERROR_ILLEGAL_INST_ACCESS);
+        return;
+    }
+    JIT_EMIT(b, 0xE9);
+    if(b->fixups_count >= b->fixups_capacity){
+        b->fixups = jit_grow(b->fixups, &b->fixups_capacity, sizeof(Jit_Fixup));
+    }
+    b->fixups[b->fixups_count++] = (Jit_Fixup){ .patch_at = b->code.count, .target = target };
+    jit_emit_u32(b, 0);
+}
+
+// Stores rdi into its slot before something is pushed over it. With an empty stack
+// rdi holds nothing and goes to slot 0 instead, which the push then owns.
+static void jit_emit_spill_tos(Jit_Builder *b){
+    JIT_EMIT(b, 0x4A, 0x8D, 0x4C, 0xE3, 0xF8); // lea rcx, [rbx + r12*8 - 8]
+    JIT_EMIT(b, 0x4D, 0x85, 0xE4); // test r12, r12
+    JIT_EMIT(b, 0x48, 0x0F, 0x44, 0xCB); // cmovz rcx, rbx
+    JIT_EMIT(b, 0x48, 0x89, 0x39); // mov [rcx], rdi
+}
+
+// Loads rdi from the new top slot after a pop, from slot 0 when the stack is empty.
+static void jit_emit_reload_tos(Jit_Builder *b){
+    JIT_EMIT(b, 0x4A, 0x8D, 0x4C, 0xE3, 0xF8); // lea rcx, [rbx + r12*8 - 8]
+    JIT_EMIT(b, 0x4D, 0x85, 0xE4); // test r12, r12
+    JIT_EMIT(b, 0x48, 0x0F, 0x44, 0xCB); // cmovz rcx, rbx
+    JIT_EMIT(b, 0x48, 0x8B, 0x39); // mov rdi, [rcx]
+}
+
+static void jit_emit_underflow_check(Jit_Builder *b, int needed, Word ip){
+    JIT_EMIT(b, 0x49, 0x83, 0xFC, (unsigned char) needed); // cmp r12, needed
+    jit_exit_if(b, JIT_JL, ip, ERROR_STACK_UNDERFLOW);
+}
+
+static void jit_emit_overflow_check(Jit_Builder *b, Word ip){
+    JIT_EMIT(b, 0x4D, 0x39, 0xFC); // cmp r12, r15
+    jit_exit_if(b, JIT_JAE, ip, ERROR_STACK_OVERFLOW);
+}
+
+// Binary operator on the slot under the top and rdi: rdi = [sp-2] op rdi.
+static void jit_emit_binop(Jit_Builder *b, Inst_Type type, Word ip){
+    jit_emit_underflow_check(b, 2, ip);
+    switch(type){
+        case INST_PLUS:
+            JIT_EMIT(b, 0x4A, 0x03, 0x7C, 0xE3, 0xF0); // add rdi, [rbx + r12*8 - 16]
+            break;
+        case INST_MINUS:
+            JIT_EMIT(b, 0x4A, 0x8B, 0x44, 0xE3, 0xF0); // mov rax, [rbx + r12*8 - 16]
+            JIT_EMIT(b, 0x48, 0x29, 0xF8); // sub rax, rdi
+            JIT_EMIT(b, 0x48, 0x89, 0xC7); // mov rdi, rax
+            break;
+        case INST_MULT:
+            JIT_EMIT(b, 0x4A, 0x0F, 0xAF, 0x7C, 0xE3, 0xF0); // imul rdi, [rbx + r12*8 - 16]
+            break;
+        case INST_EQ:
+            JIT_EMIT(b, 0x4A, 0x39, 0x7C, 0xE3, 0xF0); // cmp [rbx + r12*8 - 16], rdi
+            JIT_EMIT(b, 0x0F, 0x94, 0xC0); // sete al
+            JIT_EMIT(b, 0x0F, 0xB6, 0xF8); // movzx edi, al
+            break;
+        case INST_DIV:
+            JIT_EMIT(b, 0x48, 0x85, 0xFF); // test rdi, rdi
+            jit_exit_if(b, JIT_JE, ip, ERROR_DIV_BY_ZERO);
+            JIT_EMIT(b, 0x4A, 0x8B, 0x44, 0xE3, 0xF0); // mov rax, [rbx + r12*8 - 16]
+            JIT_EMIT(b, 0x48, 0x99); // cqo
+            JIT_EMIT(b, 0x48, 0xF7, 0xFF); // idiv rdi
+            JIT_EMIT(b, 0x48, 0x89, 0xC7); // mov rdi, rax
+            break;
+        case INST_NOP:
+        case INST_PUSH:
+        case INST_DUP:
+        case INST_JMP:
+        case INST_JMP_IF:
+        case INST_HALT:
+        case INST_PRINT_DEBUG:
+        case INST_PLUS_IMM:
+        case INST_PUSH2:
+        case INST_JMP_IF_EQ:
+        case INST_LOAD:
+        case INST_STORE:
+        case INST_MEMCPY:
+        case INST_MEMSET:
+        case INST_ALLOC:
+        case INST_RESET:
+        case INST_NATIVE:
+        case INST_CALL:
+        case INST_RET:
+        case INST_YIELD:
+        default:
+            assert(0 && "jit_emit_binop: Not a binary operator");
+    }
+    JIT_EMIT(b, 0x49, 0xFF, 0xCC); // dec r12
+    jit_emit_charge(b, 1, ip + 1);
+}
+
+// Leaves for the interpreter when fewer than n instructions of budget remain,
+// i.e. when the limit is in 1..n-1 (it is never 0 here).
+static void jit_emit_budget_check(Jit_Builder *b, int n, Word ip){
+    JIT_EMIT(b, 0x49, 0x8D, 0x45, 0xFF); // lea rax, [r13 - 1]
+    JIT_EMIT(b, 0x48, 0x83, 0xF8, (unsigned char) (n - 2)); // cmp rax, n - 2
+    jit_exit_if(b, JIT_JBE, ip, CVM_JIT_SLOW_PATH);
+}
+
+static void jit_emit_inst(Jit_Builder *b, const Cvm_Program *program, Word ip){
+    Inst inst = program->inst[ip];
+    Word size = program->size;
+
+    switch(inst.type){
+        case INST_NOP:
+            break;
+        case INST_PUSH:
+            jit_emit_overflow_check(b, ip);
+            jit_emit_spill_tos(b);
+            JIT_EMIT(b, 0x48, 0xBF); // mov rdi, imm64
+            jit_emit_u64(b, (uint64_t) inst.operand);
+            JIT_EMIT(b, 0x49, 0xFF, 0xC4); // inc r12
+            jit_emit_charge(b, 1, ip + 1);
+            break;
+        case INST_DUP:
+            jit_emit_overflow_check(b, ip);
+            if(inst.operand < 0){
+                // The interpreter computes sp - operand first, which only wraps to a
+                // non-positive value for INT64_MIN; any other negative operand is illegal.
+                jit_exit(b, ip, inst.operand == INT64_MIN ? ERROR_STACK_UNDERFLOW : ERROR_ILLEGAL_OPERAND);
+                break;
+            }
+            JIT_EMIT(b, 0x48, 0xB9); // mov rcx, imm64
+            jit_emit_u64(b, (uint64_t) inst.operand);
+            JIT_EMIT(b, 0x49, 0x39, 0xCC); // cmp r12, rcx
+            jit_exit_if(b, JIT_JLE, ip, ERROR_STACK_UNDERFLOW);
+            // The stack is not empty here, so rdi spills to its own slot. dup 0
+            // copies rdi itself, anything deeper is already in memory.
+            if(inst.operand > 0){
+                JIT_EMIT(b, 0x4C, 0x89, 0xE0); // mov rax, r12
+                JIT_EMIT(b, 0x48, 0x29, 0xC8); // sub rax, rcx
+                JIT_EMIT(b, 0x48, 0x8B, 0x44, 0xC3, 0xF8); // mov rax, [rbx + rax*8 - 8]
+            }
+            JIT_EMIT(b, 0x4A, 0x89, 0x7C, 0xE3, 0xF8); // mov [rbx + r12*8 - 8], rdi
+            if(inst.operand > 0){
+                JIT_EMIT(b, 0x48, 0x89, 0xC7); // mov rdi, rax
+            }
+            JIT_EMIT(b, 0x49, 0xFF, 0xC4); // inc r12
+            jit_emit_charge(b, 1, ip + 1);
+            break;
+        case INST_PLUS:
+        case INST_MINUS:
+        case INST_MULT:
+        case INST_DIV:
+        case INST_EQ:
+            jit_emit_binop(b, inst.type, ip);
+            break;
+        case INST_JMP:
+            jit_emit_charge(b, 1, inst.operand);
+            jit_emit_goto(b, inst.operand, size);
+            break;
+        case INST_JMP_IF: {
+            jit_emit_underflow_check(b, 1, ip);
+            JIT_EMIT(b, 0x48, 0x85, 0xFF); // test rdi, rdi
+            JIT_EMIT(b, 0x0F, JIT_JE); // je not_taken
+            size_t not_taken = b->code.count;
+            jit_emit_u32(b, 0);
+            JIT_EMIT(b, 0x49, 0xFF, 0xCC); // dec r12
+            jit_emit_reload_tos(b);
+            jit_emit_charge(b, 1, inst.operand);
+            jit_emit_goto(b, inst.operand, size);
+            jit_patch_rel32(b, not_taken, b->code.count);
+            jit_emit_charge(b, 1, ip + 1);
+            break;
+        }
+        case INST_HALT:
+            JIT_EMIT(b, 0x41, 0xC7, 0x86); // mov dword [r14 + halt], 1
+            jit_emit_u32(b, (uint32_t) offsetof(Cvm, halt));
+            jit_emit_u32(b, 1);
+            jit_exit(b, ip, ERROR_OK);
+            break;
+        case INST_PLUS_IMM:
+            if(ip + 2 > size){
+                jit_exit(b, ip, CVM_JIT_SLOW_PATH);
+                break;
+            }
+            jit_emit_budget_check(b, 2, ip);
+            JIT_EMIT(b, 0x49, 0x83, 0xFC, 0x01); // cmp r12, 1
+            jit_exit_if(b, JIT_JL, ip, CVM_JIT_SLOW_PATH);
+            JIT_EMIT(b, 0x4D, 0x39, 0xFC); // cmp r12, r15
+            jit_exit_if(b, JIT_JAE, ip, CVM_JIT_SLOW_PATH);
+            JIT_EMIT(b, 0x48, 0xB8); // mov rax, imm64
+            jit_emit_u64(b, (uint64_t) inst.operand);
+            JIT_EMIT(b, 0x48, 0x01, 0xC7); // add rdi, rax
+            jit_emit_charge(b, 2, ip + 2);
+            // Skip the tail, which has native code of its own.
+            jit_emit_goto(b, ip + 2, size);
+            break;
+        case INST_PUSH2:
+            if(ip + 2 > size){
+                jit_exit(b, ip, CVM_JIT_SLOW_PATH);
+                break;
+            }
+            jit_emit_budget_check(b, 2, ip);
+            JIT_EMIT(b, 0x49, 0x8D, 0x44, 0x24, 0x02); // lea rax, [r12 + 2]
+            JIT_EMIT(b, 0x4C, 0x39, 0xF8); // cmp rax, r15
+            jit_exit_if(b, JIT_JA, ip, CVM_JIT_SLOW_PATH);
+            jit_emit_spill_tos(b);
+            JIT_EMIT(b, 0x48, 0xB8); // mov rax, imm64
+            jit_emit_u64(b, (uint64_t) inst.operand);
+            JIT_EMIT(b, 0x4A, 0x89, 0x44, 0xE3, 0x00); // mov [rbx + r12*8], rax
+            JIT_EMIT(b, 0x48, 0xBF); // mov rdi, imm64
+            jit_emit_u64(b, (uint64_t) program->inst[ip + 1].operand);
+            JIT_EMIT(b, 0x49, 0x83, 0xC4, 0x02); // add r12, 2
+            jit_emit_charge(b, 2, ip + 2);
+            // Skip the tail, which has native code of its own.
+            jit_emit_goto(b, ip + 2, size);
+            break;
+        case INST_JMP_IF_EQ: {
+            Word target = ip + 4 <= size ? program->inst[ip + 3].operand : -1;
+            if(target < 0 || target >= size){
+                jit_exit(b, ip, CVM_JIT_SLOW_PATH);
+                break;
+            }
+            jit_emit_budget_check(b, 4, ip);
+            JIT_EMIT(b, 0x49, 0x83, 0xFC, 0x01); // cmp r12, 1
+            jit_exit_if(b, JIT_JL, ip, CVM_JIT_SLOW_PATH);
+            JIT_EMIT(b, 0x49, 0x8D, 0x44, 0x24, 0x02); // lea rax, [r12 + 2]
+            JIT_EMIT(b, 0x4C, 0x39, 0xF8); // cmp rax, r15
+            jit_exit_if(b, JIT_JA, ip, CVM_JIT_SLOW_PATH);
+            JIT_EMIT(b, 0x48, 0xB8); // mov rax, imm64
+            jit_emit_u64(b, (uint64_t) inst.operand);
+            JIT_EMIT(b, 0x48, 0x39, 0xF8); // cmp rax, rdi
+            JIT_EMIT(b, 0x0F, JIT_JNE); // jne not_equal
+            size_t not_equal = b->code.count;
+            jit_emit_u32(b, 0);
+            jit_emit_charge(b, 4, target);
+            jit_emit_goto(b, target, size);
+            jit_patch_rel32(b, not_equal, b->code.count);
+            JIT_EMIT(b, 0x4A, 0x89, 0x7C, 0xE3, 0xF8); // mov [rbx + r12*8 - 8], rdi
+            JIT_EMIT(b, 0x31, 0xFF); // xor edi, edi
+            JIT_EMIT(b, 0x49, 0xFF, 0xC4); // inc r12
+            jit_emit_charge(b, 4, ip + 4);
+            // Skip the tail, which has native code of its own.
+            jit_emit_goto(b, ip + 4, size);
+            break;
+        }
+        case INST_PRINT_DEBUG:
+        case INST_LOAD:
+        case INST_STORE:
+        case INST_MEMCPY:
+        case INST_MEMSET:
+        case INST_ALLOC:
+        case INST_RESET:
+        case INST_NATIVE:
+        case INST_CALL:
+        case INST_RET:
+        case INST_YIELD:
+        default:
+            jit_exit(b, ip, CVM_JIT_SLOW_PATH);
+            break;
+    }
+}
+
+static struct Cvm_Jit *cvm_jit_compile(const Cvm_Program *program){
+    Jit_Builder b = {0};
+    Word size = program->size;
+    size_t *offsets = cvm_malloc(sizeof(size_t) * (size + 1));
+    if(offsets == NULL){
+        cvm_fail("Out of memory : %s\n", strerror(errno));
+    }
+
+    // int entry(Cvm *cvm, Word *limit, const void *target)
+    JIT_EMIT(&b, 0x53); // push rbx
+    JIT_EMIT(&b, 0x41, 0x54); // push r12
+    JIT_EMIT(&b, 0x41, 0x55); // push r13
+    JIT_EMIT(&b, 0x41, 0x56); // push r14
+    JIT_EMIT(&b, 0x41, 0x57); // push r15
+    JIT_EMIT(&b, 0x56); // push rsi
+    JIT_EMIT(&b, 0x49, 0x89, 0xFE); // mov r14, rdi
+    JIT_EMIT(&b, 0x49, 0x8B, 0x9E); // mov rbx, [r14 + stack]
+    jit_emit_u32(&b, (uint32_t) offsetof(Cvm, stack));
+    JIT_EMIT(&b, 0x4D, 0x8B, 0xA6); // mov r12, [r14 + stack_size]
+    jit_emit_u32(&b, (uint32_t) offsetof(Cvm, stack_size));
+    JIT_EMIT(&b, 0x4D, 0x8B, 0xBE); // mov r15, [r14 + stack_capacity]
+    jit_emit_u32(&b, (uint32_t) offsetof(Cvm, stack_capacity));
+    JIT_EMIT(&b, 0x4C, 0x8B, 0x2E); // mov r13, [rsi]
+    jit_emit_reload_tos(&b);
+    JIT_EMIT(&b, 0xFF, 0xE2); // jmp rdx
+
+    // Shared exit, entered with the status in eax and ip in rsi.
+    size_t epilogue = b.code.count;
+    JIT_EMIT(&b, 0x49, 0x89, 0xB6); // mov [r14 + ip], rsi
+    jit_emit_u32(&b, (uint32_t) offsetof(Cvm, ip));
+    JIT_EMIT(&b, 0x4D, 0x89, 0xA6); // mov [r14 + stack_size], r12
+    jit_emit_u32(&b, (uint32_t) offsetof(Cvm, stack_size));
+    jit_emit_spill_tos(&b);
+    JIT_EMIT(&b, 0x59); // pop rcx
+    JIT_EMIT(&b, 0x4C, 0x89, 0x29); // mov [rcx], r13
+    JIT_EMIT(&b, 0x41, 0x5F); // pop r15
+    JIT_EMIT(&b, 0x41, 0x5E); // pop r14
+    JIT_EMIT(&b, 0x41, 0x5D); // pop r13
+    JIT_EMIT(&b, 0x41, 0x5C); // pop r12
+    JIT_EMIT(&b, 0x5B); // pop rbx
+    JIT_EMIT(&b, 0xC3); // ret
+
+    for(Word ip = 0; ip < size; ip++){
+        offsets[ip] = b.code.count;
+        jit_emit_inst(&b, program, ip);
+    }
+    // Falling off the end faults at ip == program_size.
+    offsets[size] = b.code.count;
+    jit_exit(&b, size, ERROR_ILLEGAL_INST_ACCESS);
+
+    for(size_t i = 0; i < b.fixups_count; i++){
+        jit_patch_rel32(&b, b.fixups[i].patch_at, offsets[b.fixups[i].target]);
+    }
+    for(size_t i = 0; i < b.stubs_count; i++){
+        jit_patch_rel32(&b, b.stubs[i].patch_at, b.code.count);
+        JIT_EMIT(&b, 0x48, 0xBE); // mov rsi, imm64
+        jit_emit_u64(&b, (uint64_t) b.stubs[i].ip);
+        JIT_EMIT(&b, 0xB8); // mov eax, imm32
+        jit_emit_u32(&b, (uint32_t) b.stubs[i].status);
+        JIT_EMIT(&b, 0xE9); // jmp epilogue
+        size_t patch_at = b.code.count;
+        jit_emit_u32(&b, 0);
+        jit_patch_rel32(&b, patch_at, epilogue);
+    }
+
+    struct Cvm_Jit *jit = cvm_malloc(sizeof(struct Cvm_Jit));
+    if(jit == NULL){
+        cvm_fail("Out of memory : %s\n", strerror(errno));
+    }
+    jit->code_size = b.code.count;
+    jit->code = mmap(NULL, jit->code_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(jit->code == MAP_FAILED){
+        cvm_fail("Could not allocate JIT code: %s\n", strerror(errno));
+    }
+    memcpy(jit->code, b.code.data, b.code.count);
+    if(mprotect(jit->code, jit->code_size, PROT_READ | PROT_EXEC) < 0){
+        cvm_fail("Could not make JIT code executable: %s\n", strerror(errno));
+    }
+    // ISO C has no object to function pointer conversion; copy the representation.
+    void *entry = jit->code;
+    memcpy(&jit->entry, &entry, sizeof(jit->entry));
+    jit->offsets = offsets;
+
+    cvm_free(b.code.data);
+    cvm_free(b.stubs);
+    cvm_free(b.fixups);
+    return jit;
+}
+
+static void cvm_jit_free(struct Cvm_Jit *jit){
+    munmap(jit->code, jit->code_size);
+    cvm_free(jit->offsets);
+    cvm_free(jit);
+}
+
+static void cvm_jit_release(Cvm_Program *program){
+    struct Cvm_Jit *jit = atomic_exchange(&program->jit, NULL);
+    if(jit != NULL){
+        cvm_jit_free(jit);
+    }
+}
+
+static struct Cvm_Jit *cvm_program_jit(Cvm_Program *program){
+    struct Cvm_Jit *jit = atomic_load(&program->jit);
+    if(jit == NULL){
+        struct Cvm_Jit *expected = NULL;
+        jit = cvm_jit_compile(program);
+        if(!atomic_compare_exchange_strong(&program->jit, &expected, jit)){
+            // Another context compiled the same program first; use its code.
+            cvm_jit_free(jit);
+            jit = expected;
+        }
+    }
+    return jit;
+}
+
+// Same semantics as cvm_execute_program. The program is compiled on the first
+// run and the native code is shared by every context attached to it.
+Error cvm_execute_program_jit(Cvm *cvm, int lim){
+    if(lim == 0 || cvm->halt){
+        cvm->fuel = lim;
+        return ERROR_OK;
+    }
+    struct Cvm_Jit *jit = cvm_program_jit(cvm->image);
+
+    Word limit = lim;
+    Error error = ERROR_OK;
+    for(;;){
+        if(cvm->ip < 0 || cvm->ip >= cvm->program_size){
+            error = ERROR_ILLEGAL_INST_ACCESS;
+            break;
+        }
+        int status = jit->entry(cvm, &limit, jit->code + jit->offsets[cvm->ip]);
+        if(status == ERROR_STACK_OVERFLOW && cvm_stack_reserve(cvm, cvm->stack_size + 1)){
+            // The stub stopped before the instruction and charged nothing, so it
+            // just runs again on the bigger stack.
+            continue;
+        }
+        if(status != CVM_JIT_SLOW_PATH){
+            error = (Error) status;
+            break;
+        }
+
+        int retired = 0;
+        error = cvm_ex_inst_limited(cvm, limit < 0 ? -1 : (int) limit, &retired);
+        if(error == ERROR_OK_NO_INST){
+            error = ERROR_OK;
+            continue;
+        }
+        if(error != ERROR_OK){
+            break;
+        }
+        limit -= retired;
+        if(limit == 0 || cvm->halt || cvm->yielded){
+            break;
+        }
+    }
+    cvm->fuel = limit < 0 ? -1 : (int) limit;
+    cvm_output_flush(cvm);
+    return error;
+}
+
+#else
+
+static void cvm_jit_release(Cvm_Program *program){
+    (void) program;
+}
+
+Error cvm_execute_program_jit(Cvm *cvm, int lim){
+    return cvm_execute_program_threaded(cvm, lim);
+}
+
+#endif
+
+// Whether auto can take the unchecked fast path: the program was verified and the
+// VM is in a state the verifier reasoned about. The unchecked path never grows the
+// stack, so it is sized to the proven depth first.
+static int cvm_auto_runs_unchecked(Cvm *cvm, int lim){
+    return lim != 0 && !cvm->halt && cvm_can_run_unchecked(cvm)
+        && cvm_stack_reserve(cvm, cvm->image->max_stack_depth);
+}
+
+// auto runs on the unchecked fast path when it can and on CVM_AUTO_ENGINE otherwise;
+// every other engine runs as selected.
+static Error cvm_execute_run(Cvm *cvm, int lim, Cvm_Engine engine){
+    if(engine == CVM_ENGINE_AUTO){
+        if(cvm_auto_runs_unchecked(cvm, lim)){
+            return cvm_execute_program_unchecked(cvm, lim);
+        }
+        engine = CVM_AUTO_ENGINE;
+    }
+    switch(engine){
+        case CVM_ENGINE_SWITCH:
+            return cvm_execute_program(cvm, lim);
+        case CVM_ENGINE_THREADED:
+            return cvm_execute_program_threaded(cvm, lim);
+        case CVM_ENGINE_JIT:
+            return cvm_execute_program_jit(cvm, lim);
+        case CVM_ENGINE_TOS:
+            return cvm_execute_program_tos(cvm, lim);
+        case CVM_ENGINE_TRACE:
+            return cvm_execute_program_trace(cvm, lim);
+        case CVM_ENGINE_AUTO:
+        default:
+            assert(0 && "cvm_execute_program_with: Unknown engine");
+    }
+}
+
+// Runs until halt, an error or the end of lim. Nothing here switches contexts, so
+// a yield only costs a return and a resume with what is left of the fuel.
+Error cvm_execute_program_with(Cvm *cvm, int lim, Cvm_Engine engine){
+    Error error = ERROR_OK;
+    do{
+        cvm->yielded = 0;
+        error = cvm_execute_run(cvm, lim, engine);
+        lim = cvm->fuel;
+    } while(error == ERROR_OK && cvm->yielded && lim != 0 && !cvm->halt);
+    cvm->yielded = 0;
+    return error;
+}
+typedef enum {
+    CVM_OP_CLASS_STACK = 0,
+    CVM_OP_CLASS_ARITHMETIC,
+    CVM_OP_CLASS_CONTROL,
+    CVM_OP_CLASS_MEMORY,
+    CVM_OP_CLASS_NATIVE,
+    CVM_OP_CLASS_OTHER,
+    CVM_OP_CLASS_COUNT,
+} Cvm_Op_Class;
+
+const char *cvm_op_class_as_cstr(Cvm_Op_Class op_class){
+    switch(op_class){
+        case CVM_OP_CLASS_STACK:
+            return "stack";
+        case CVM_OP_CLASS_ARITHMETIC:
+            return "arithmetic";
+        case CVM_OP_CLASS_CONTROL:
+            return "control";
+        case CVM_OP_CLASS_MEMORY:
+            return "memory";
+        case CVM_OP_CLASS_NATIVE:
+            return "native";
+        case CVM_OP_CLASS_OTHER:
+            return "other";
+        case CVM_OP_CLASS_COUNT:
+        default:
+            assert(0 && "cvm_op_class_as_cstr: Unknown opcode class");
+    }
+}
+
+Cvm_Op_Class inst_op_class(Inst_Type type){
+    switch(type){
+        case INST_PUSH:
+        case INST_DUP:
+        case INST_PUSH2:
+            return CVM_OP_CLASS_STACK;
+        case INST_PLUS:
+        case INST_MINUS:
+        case INST_MULT:
+        case INST_DIV:
+        case INST_EQ:
+        case INST_PLUS_IMM:
+            return CVM_OP_CLASS_ARITHMETIC;
+        case INST_JMP:
+        case INST_JMP_IF:
+        case INST_JMP_IF_EQ:
+        case INST_HALT:
+        case INST_CALL:
+        case INST_RET:
+        case INST_YIELD:
+            return CVM_OP_CLASS_CONTROL;
+        case INST_LOAD:
+        case INST_STORE:
+        case INST_MEMCPY:
+        case INST_MEMSET:
+        case INST_ALLOC:
+        case INST_RESET:
+            return CVM_OP_CLASS_MEMORY;
+        case INST_NATIVE:
+            return CVM_OP_CLASS_NATIVE;
+        case INST_NOP:
+        case INST_PRINT_DEBUG:
+        default:
+            return CVM_OP_CLASS_OTHER;
+    }
+}
+
+// Execution profile of one program. The per-ip arrays have program_size entries;
+// taken and not_taken are only filled in for conditional jumps.
+typedef struct {
+    Word program_size;
+    uint64_t *ip_count;
+    uint64_t *taken;
+    uint64_t *not_taken;
+
+    uint64_t type_count[INST_TYPE_COUNT];
+    uint64_t type_nanos[INST_TYPE_COUNT];
+    uint64_t total_count;
+    uint64_t total_nanos;
+} Cvm_Profile;
+
+void cvm_profile_init(Cvm_Profile *profile, Word program_size){
+    *profile = (Cvm_Profile){0};
+    size_t n = program_size > 0 ? (size_t) program_size : 1;
+    profile->program_size = program_size;
+    profile->ip_count = cvm_calloc(n, sizeof(uint64_t));
+    profile->taken = cvm_calloc(n, sizeof(uint64_t));
+    profile->not_taken = cvm_calloc(n, sizeof(uint64_t));
+    if(profile->ip_count == NULL || profile->taken == NULL || profile->not_taken == NULL){
+        cvm_fail("Out of memory : %s\n", strerror(errno));
+    }
+}
+
+void cvm_profile_destroy(Cvm_Profile *profile){
+    cvm_free(profile->ip_count);
+    cvm_free(profile->taken);
+    cvm_free(profile->not_taken);
+    *profile = (Cvm_Profile){0};
+}
+
+static uint64_t cvm_now_nanos(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+}
+
+// Same semantics as cvm_execute_program, counting every instruction that runs.
+// It is a separate loop so that none of the engines pay for profiling. Time is
+// read once per instruction and the interval charged to the instruction that
+// just ran, so the figures include the cost of reading the clock.
+Error cvm_execute_program_profiled(Cvm *cvm, int lim, Cvm_Profile *profile){
+    Error error = ERROR_OK;
+    uint64_t last = cvm_now_nanos();
+    for(int i=lim; i != 0 && !cvm->halt;){
+        Word ip = cvm->ip;
+        Word sp = cvm->stack_size;
+        int retired = 0;
+        error = cvm_ex_inst_limited(cvm, i, &retired);
+        uint64_t now = cvm_now_nanos();
+
+        if((error == ERROR_OK || error == ERROR_OK_NO_INST) && ip < profile->program_size){
+            Inst_Type type = cvm->program[ip].type;
+            Word length = inst_fused_length(type);
+            if(length > 1 && retired != length){
+                type = inst_fused_head(cvm->program[ip]).type;
+            }
+            profile->ip_count[ip]++;
+            profile->type_count[type]++;
+            profile->type_nanos[type] += now - last;
+            profile->total_count++;
+            profile->total_nanos += now - last;
+            // A taken jmp_if pops its condition; an untaken jmp_if_eq leaves the eq result.
+            if(type == INST_JMP_IF){
+                profile->taken[ip] += cvm->stack_size < sp;
+                profile->not_taken[ip] += cvm->stack_size == sp;
+            }
+            else if(type == INST_JMP_IF_EQ){
+                profile->taken[ip] += cvm->stack_size == sp;
+                profile->not_taken[ip] += cvm->stack_size > sp;
+            }
+        }
+        last = now;
+
+        if(error == ERROR_OK_NO_INST){
+            error = ERROR_OK;
+            continue;
+        }
+        
+        if(error != ERROR_OK){
+            break;
+        }
+        i -= retired;
+    }
+    cvm_output_flush(cvm);
+    return error;
+}
+
+typedef struct {
+    Word ip;
+    uint64_t count;
+} Cvm_Profile_Hot;
+
+static int cvm_profile_hot_compare(const void *a, const void *b){
+    const Cvm_Profile_Hot *x = a;
+    const Cvm_Profile_Hot *y = b;
+    if(x->count != y->count){
+        return x->count < y->count ? 1 : -1;
+    }
+    return x->ip < y->ip ? -1 : x->ip > y->ip;
+}
+
+static double cvm_profile_percent(uint64_t part, uint64_t total){
+    return total > 0 ? 100.0 * (double) part / (double) total : 0.0;
+}
+
+// Human readable summary, hottest first. At most max_ips instructions are listed.
+void cvm_profile_report(FILE *stream, const Cvm_Profile *profile, const Cvm_Program *program, size_t max_ips){
+    fprintf(stream, "Profile: %llu instructions in %.3f ms\n",
+            (unsigned long long) profile->total_count, (double) profile->total_nanos / 1e6);
+
+    Cvm_Profile_Hot types[INST_TYPE_COUNT];
+    for(size_t t = 0; t < INST_TYPE_COUNT; t++){
+        types[t] = (Cvm_Profile_Hot){ .ip = (Word) t, .count = profile->type_count[t] };
+    }
+    qsort(types, INST_TYPE_COUNT, sizeof(types[0]), cvm_profile_hot_compare);
+    // Both tables give every row its share of the instructions run and of the time.
+    fprintf(stream, "\nBy opcode:\n");
+    fprintf(stream, "  %-18s %14s %7s %15s %7s\n", "", "count", "count%", "time", "time%");
+    for(size_t t = 0; t < INST_TYPE_COUNT && types[t].count > 0; t++){
+        Inst_Type type = (Inst_Type) types[t].ip;
+        fprintf(stream, "  %-18s %14llu %6.2f%% %12.3f ms %6.2f%%\n", inst_type_as_sctr(type),
+                (unsigned long long) types[t].count,
+                cvm_profile_percent(types[t].count, profile->total_count),
+                (double) profile->type_nanos[type] / 1e6,
+                cvm_profile_percent(profile->type_nanos[type], profile->total_nanos));
+    }
+
+    uint64_t class_count[CVM_OP_CLASS_COUNT] = {0};
+    uint64_t class_nanos[CVM_OP_CLASS_COUNT] = {0};
+    for(size_t t = 0; t < INST_TYPE_COUNT; t++){
+        Cvm_Op_Class op_class = inst_op_class((Inst_Type) t);
+        class_count[op_class] += profile->type_count[t];
+        class_nanos[op_class] += profile->type_nanos[t];
+    }
+    fprintf(stream, "\nBy class:\n");
+    fprintf(stream, "  %-18s %14s %7s %15s %7s\n", "", "count", "count%", "time", "time%");
+    for(size_t c = 0; c < CVM_OP_CLASS_COUNT; c++){
+        fprintf(stream, "  %-18s %14llu %6.2f%% %12.3f ms %6.2f%%\n", cvm_op_class_as_cstr((Cvm_Op_Class) c),
+                (unsigned long long) class_count[c],
+                cvm_profile_percent(class_count[c], profile->total_count),
+                (double) class_nanos[c] / 1e6,
+                cvm_profile_percent(class_nanos[c], profile->total_nanos));
+    }
+
+    size_t hot_count = 0;
+    Cvm_Profile_Hot *hot = cvm_malloc(sizeof(Cvm_Profile_Hot) * (profile->program_size > 0 ? profile->program_size : 1));
+    if(hot == NULL){
+        cvm_fail("Out of memory : %s\n", strerror(errno));
+    }
+    for(Word ip = 0; ip < profile->program_size; ip++){
+        if(profile->ip_count[ip] > 0){
+            hot[hot_count++] = (Cvm_Profile_Hot){ .ip = ip, .count = profile->ip_count[ip] };
+        }
+    }
+    qsort(hot, hot_count, sizeof(hot[0]), cvm_profile_hot_compare);
+    fprintf(stream, "\nHottest instructions:\n");
+    fprintf(stream, "  %8s %-18s %14s %7s\n", "ip", "", "count", "count%");
+    for(size_t i = 0; i < hot_count && i < max_ips; i++){
+        Word ip = hot[i].ip;
+        Inst inst = program->inst[ip];
+        fprintf(stream, "  %8lld %-18s %14llu %6.2f%%", (long long) ip, inst_type_as_sctr(inst.type),
+                (unsigned long long) hot[i].count, cvm_profile_percent(hot[i].count, profile->total_count));
+        if(inst.type == INST_JMP_IF || inst.type == INST_JMP_IF_EQ){
+            fprintf(stream, "  taken %llu, not taken %llu",
+                    (unsigned long long) profile->taken[ip], (unsigned long long) profile->not_taken[ip]);
+        }
+        fprintf(stream, "\n");
+    }
+    cvm_free(hot);
+}
+
+#define CVM_PROFILE_MAGIC "cvm-profile 1"
+
+// Line oriented text: the magic, the program size, then "ip count taken not_taken"
+// for every instruction that ran.
+void cvm_profile_save(const Cvm_Profile *profile, const char *file_path){
+    FILE *f = fopen(file_path, "w");
+    if(f == NULL){
+        cvm_fail("Could not open file '%s': %s\n", file_path, strerror(errno));
+    }
+    fprintf(f, "%s\n%lld\n", CVM_PROFILE_MAGIC, (long long) profile->program_size);
+    for(Word ip = 0; ip < profile->program_size; ip++){
+        if(profile->ip_count[ip] > 0){
+            fprintf(f, "%lld %llu %llu %llu\n", (long long) ip,
+                    (unsigned long long) profile->ip_count[ip],
+                    (unsigned long long) profile->taken[ip],
+                    (unsigned long long) profile->not_taken[ip]);
+        }
+    }
+    if(ferror(f) || fclose(f) != 0){
+        cvm_fail("Could not write file '%s': %s\n", file_path, strerror(errno));
+    }
+}
+
+void cvm_profile_load(Cvm_Profile *profile, const char *file_path){
+    FILE *f = fopen(file_path, "r");
+    if(f == NULL){
+        cvm_fail("Could not open file '%s': %s\n", file_path, strerror(errno));
+    }
+    char magic[32];
+    long long program_size;
+    if(fgets(magic, sizeof(magic), f) == NULL
+            || strncmp(magic, CVM_PROFILE_MAGIC "\n", sizeof(magic)) != 0
+            || fscanf(f, "%lld", &program_size) != 1 || program_size < 0){
+        cvm_fail("'%s' is not a cvm profile\n", file_path);
+    }
+    cvm_profile_init(profile, program_size);
+
+    long long ip;
+    unsigned long long count, taken, not_taken;
+    int n;
+    while((n = fscanf(f, "%lld %llu %llu %llu", &ip, &count, &taken, &not_taken)) == 4){
+        if(ip < 0 || ip >= program_size){
+            cvm_fail("'%s': ip %lld out of range\n", file_path, (long long) ip);
+        }
+        profile->ip_count[ip] = count;
+        profile->taken[ip] = taken;
+        profile->not_taken[ip] = not_taken;
+        profile->total_count += count;
+    }
+    if(n != EOF){
+        cvm_fail("'%s': malformed profile entry\n", file_path);
+    }
+    fclose(f);
+}
+
+// One program run in a batch. program, input, input_size, limit and engine are
+// filled in by the caller; input is the initial stack, bottom first. When snapshot
+// is set the run starts from it instead of program, with input pushed on top of
+// the saved stack. error, stack and stack_size hold the outcome, with stack
+// malloc'd and owned by the job.
+typedef struct {
+    Cvm_Program *program;
+    Cvm_Snapshot *snapshot;
+    const Word *input;
+    size_t input_size;
+    int limit;
+    Cvm_Engine engine;
+
+    Error error;
+    Word *stack;
+    Word stack_size;
+} Cvm_Batch_Job;
+
+// A worker's share of the batch. The owner takes jobs from the tail and idle
+// workers steal from the head, so a worker that drew cheap jobs helps out the
+// ones that drew expensive ones.
+typedef struct {
+    pthread_mutex_t lock;
+    size_t *jobs;
+    size_t head;
+    size_t tail;
+} Cvm_Batch_Deque;
+
+// Workers take units of lanes consecutive jobs, which run in lockstep when lanes
+// is more than 1, see cvm_run_lockstep.
+typedef struct {
+    Cvm_Batch_Job *jobs;
+    size_t job_count;
+    size_t lanes;
+    Cvm_Batch_Deque *deques;
+    size_t worker_count;
+    size_t stack_capacity;
+    size_t memory_size;
+    Cvm_Output_Mode output_mode;
+} Cvm_Batch;
+
+typedef struct {
+    Cvm_Batch *batch;
+    size_t id;
+} Cvm_Batch_Worker;
+
+static int cvm_batch_take(Cvm_Batch_Deque *deque, int steal, size_t *job){
+    int found = 0;
+    pthread_mutex_lock(&deque->lock);
+    if(deque->head < deque->tail){
+        *job = steal ? deque->jobs[deque->head++] : deque->jobs[--deque->tail];
+        found = 1;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+// Puts cvm in the state the job starts from. Returns 0, with the job's error set,
+// when that state cannot be had.
+static int cvm_batch_start_job(Cvm *cvm, Cvm_Batch_Job *job){
+    if(job->snapshot != NULL){
+        job->error = cvm_restore_snapshot(cvm, job->snapshot);
+        if(job->error != ERROR_OK){
+            return 0;
+        }
+    }
+    else{
+        cvm_attach_program(cvm, job->program);
+    }
+    if(job->input_size > (size_t) (cvm->stack_limit - cvm->stack_size)
+       || !cvm_stack_reserve(cvm, cvm->stack_size + (Word) job->input_size)){
+        job->error = ERROR_STACK_OVERFLOW;
+        return 0;
+    }
+    if(job->input_size > 0){
+        memcpy(cvm->stack + cvm->stack_size, job->input, sizeof(Word) * job->input_size);
+    }
+    cvm->stack_size += job->input_size;
+    return 1;
+}
+
+static void cvm_batch_finish_job(Cvm *cvm, Cvm_Batch_Job *job, Error error){
+    job->error = error;
+    job->stack_size = cvm->stack_size;
+    job->stack = cvm_malloc(sizeof(Word) * (cvm->stack_size > 0 ? cvm->stack_size : 1));
+    if(job->stack == NULL){
+        cvm_fail("Out of memory : %s\n", strerror(errno));
+    }
+    memcpy(job->stack, cvm->stack, sizeof(Word) * cvm->stack_size);
+}
+
+static void cvm_batch_run_job(Cvm *cvm, Cvm_Batch_Job *job){
+    if(cvm_batch_start_job(cvm, job)){
+        cvm_batch_finish_job(cvm, job, cvm_execute_program_with(cvm, job->limit, job->engine));
+    }
+}
+
+typedef struct Cvm_Lockstep Cvm_Lockstep;
+static Cvm_Lockstep *cvm_lockstep_create(size_t lanes, size_t stack_capacity, size_t memory_size, Cvm_Output_Mode output_mode);
+static void cvm_lockstep_destroy(Cvm_Lockstep *lockstep);
+static void cvm_lockstep_run_jobs(Cvm_Lockstep *lockstep, Cvm_Batch_Job *jobs, size_t count);
+
+static void *cvm_batch_worker(void *arg){
+    Cvm_Batch_Worker *worker = arg;
+    Cvm_Batch *batch = worker->batch;
+    Cvm cvm = {0};
+    cvm_init(&cvm, batch->stack_capacity);
+    if(batch->memory_size != CVM_MEMORY_CAPACITY){
+        cvm_set_memory(&cvm, batch->memory_size);
+    }
+    cvm_set_output(&cvm, STDOUT_FILENO, batch->output_mode);
+    Cvm_Lockstep *lockstep = NULL;
+    if(batch->lanes > 1){
+        lockstep = cvm_lockstep_create(batch->lanes, batch->stack_capacity, batch->memory_size, batch->output_mode);
+    }
+
+    // No job spawns new ones, so once the own deque and every victim came up
+    // empty the batch is done.
+    for(;;){
+        size_t job;
+        int found = cvm_batch_take(&batch->deques[worker->id], 0, &job);
+        for(size_t i = 1; !found && i < batch->worker_count; i++){
+            found = cvm_batch_take(&batch->deques[(worker->id + i) % batch->worker_count], 1, &job);
+        }
+        if(!found){
+            break;
+        }
+        if(lockstep == NULL){
+            cvm_batch_run_job(&cvm, &batch->jobs[job]);
+            continue;
+        }
+        size_t first = job * batch->lanes;
+        size_t count = batch->job_count - first < batch->lanes ? batch->job_count - first : batch->lanes;
+        cvm_lockstep_run_jobs(lockstep, &batch->jobs[first], count);
+    }
+
+    if(lockstep != NULL){
+        cvm_lockstep_destroy(lockstep);
+    }
+    cvm_destroy(&cvm);
+    return NULL;
+}
+
+static void cvm_batch_run(Cvm_Batch_Job *jobs, size_t job_count, size_t lanes, size_t thread_count,
+                          size_t stack_capacity, size_t memory_size, Cvm_Output_Mode output_mode){
+    size_t unit_count = (job_count + lanes - 1) / lanes;
+    if(thread_count < 1){
+        thread_count = 1;
+    }
+    if(thread_count > unit_count){
+        thread_count = unit_count > 0 ? unit_count : 1;
+    }
+
+    Cvm_Batch batch = {
+        .jobs = jobs,
+        .job_count = job_count,
+        .lanes = lanes,
+        .deques = cvm_calloc(thread_count, sizeof(Cvm_Batch_Deque)),
+        .worker_count = thread_count,
+        .stack_capacity = stack_capacity,
+        .memory_size = memory_size,
+        .output_mode = output_mode,
+    };
+    size_t *order = cvm_malloc(sizeof(size_t) * (unit_count > 0 ? unit_count : 1));
+    Cvm_Batch_Worker *workers = cvm_malloc(sizeof(Cvm_Batch_Worker) * thread_count);
+    pthread_t *threads = cvm_malloc(sizeof(pthread_t) * thread_count);
+    if(batch.deques == NULL || order == NULL || workers == NULL || threads == NULL){
+        cvm_fail("Out of memory : %s\n", strerror(errno));
+    }
+
+    // Deal out contiguous runs of units. The owner pops from the tail of its run,
+    // so it starts from the end and thieves take from the start.
+    for(size_t i = 0; i < unit_count; i++){
+        order[i] = i;
+    }
+    for(size_t w = 0; w < thread_count; w++){
+        Cvm_Batch_Deque *deque = &batch.deques[w];
+        pthread_mutex_init(&deque->lock, NULL);
+        deque->jobs = order;
+        deque->head = unit_count * w / thread_count;
+        deque->tail = unit_count * (w + 1) / thread_count;
+        workers[w] = (Cvm_Batch_Worker){ .batch = &batch, .id = w };
+    }
+
+    // The calling thread works as worker 0.
+    for(size_t w = 1; w < thread_count; w++){
+        int err = pthread_create(&threads[w], NULL, cvm_batch_worker, &workers[w]);
+        if(err != 0){
+            cvm_fail("Could not start worker thread : %s\n", strerror(err));
+        }
+    }
+    cvm_batch_worker(&workers[0]);
+    for(size_t w = 1; w < thread_count; w++){
+        pthread_join(threads[w], NULL);
+    }
+
+    for(size_t w = 0; w < thread_count; w++){
+        pthread_mutex_destroy(&batch.deques[w].lock);
+    }
+    cvm_free(threads);
+    cvm_free(workers);
+    cvm_free(order);
+    cvm_free(batch.deques);
+}
+
+// Runs every job on up to thread_count threads, each with its own Cvm of
+// stack_capacity words and memory_size bytes of memory writing print_debug output
+// to stdout in output_mode. Programs are shared between jobs and must not be
+// reloaded or reverified while the batch runs. Results land in the jobs
+// themselves, so they come back in input order whatever order they ran in.
+void cvm_run_batch(Cvm_Batch_Job *jobs, size_t job_count, size_t thread_count, size_t stack_capacity, size_t memory_size, Cvm_Output_Mode output_mode){
+    cvm_batch_run(jobs, job_count, 1, thread_count, stack_capacity, memory_size, output_mode);
+}
+
+// Lockstep execution of one program over many inputs. A group of lanes
+// consecutive jobs that start at the same ip with stacks of the same depth shares
+// one instruction stream: every stack slot is a row of lanes words, one per job,
+// and an instruction runs on a whole row at once. Arithmetic and eq go through
+// 256-bit vectors, which the compiler turns into AVX2 where the CPU has it and
+// pairs of SSE2 registers where it does not.
+//
+// A jmp_if the lanes disagree on splits the group in two, each with a lane mask.
+// The split with the lowest ip runs first, so both halves of a forward branch meet
+// again at the join, and splits that reach the same ip at the same depth merge.
+// Anything the rows cannot do (memory, natives, calls, yield, a division by zero,
+// any error, a stack deeper than CVM_LOCKSTEP_DEPTH) hands the lanes concerned
+// over to their own Cvm, which finishes them on the job's engine, and so does a
+// split down to a single lane. Results are exactly those of cvm_run_batch, but
+// print_debug output goes out per lane as each one finishes, so jobs handed back
+// early print first: its order across jobs differs, even on one thread.
+#define CVM_LOCKSTEP_MAX_LANES 16
+#define CVM_LOCKSTEP_DEPTH 256
+
+#define CVM_LANES_WIDTH 4 // lanes come in multiples of this
+
+typedef enum {
+    CVM_LANES_PLUS = 0,
+    CVM_LANES_MINUS,
+    CVM_LANES_MULT,
+    CVM_LANES_EQ,
+} Cvm_Lanes_Op;
+
+#if defined(__GNUC__)
+
+#if defined(__x86_64__)
+#define CVM_LANES_CLONES __attribute__((target_clones("avx2", "default")))
+#else
+#define CVM_LANES_CLONES
+#endif
+
+typedef uint64_t Cvm_Lanes __attribute__((vector_size(CVM_LANES_WIDTH * sizeof(uint64_t))));
+
+// The row operations. mask is all ones in the lanes of the group running and
+// zero elsewhere; the other lanes of a row belong to other splits and keep their
+// values. Unsigned lanes, so overflow wraps like it does on the scalar engines.
+#define CVM_LANES_LOAD(v, p) memcpy(&(v), (p), sizeof(Cvm_Lanes))
+#define CVM_LANES_BLEND(old, new, m) (((old) & ~(m)) | ((new) & (m)))
+
+static CVM_LANES_CLONES void cvm_lanes_binop(Cvm_Lanes_Op op, Word *a, const Word *b, const Word *mask, size_t lanes){
+    for(size_t l = 0; l < lanes; l += CVM_LANES_WIDTH){
+        Cvm_Lanes x, y, m, r;
+        CVM_LANES_LOAD(x, a + l);
+        CVM_LANES_LOAD(y, b + l);
+        CVM_LANES_LOAD(m, mask + l);
+        switch(op){
+            case CVM_LANES_PLUS:
+                r = x + y;
+                break;
+            case CVM_LANES_MINUS:
+                r = x - y;
+                break;
+            case CVM_LANES_MULT:
+                r = x * y;
+                break;
+            case CVM_LANES_EQ:
+                r = (Cvm_Lanes) -(x == y);
+                break;
+            default:
+                assert(0 && "cvm_lanes_binop: Unknown op");
+        }
+        r = CVM_LANES_BLEND(x, r, m);
+        memcpy(a + l, &r, sizeof(r));
+    }
+}
+
+static CVM_LANES_CLONES void cvm_lanes_fill(Word *a, Word value, const Word *mask, size_t lanes){
+    Cvm_Lanes v = { (uint64_t) value, (uint64_t) value, (uint64_t) value, (uint64_t) value };
+    for(size_t l = 0; l < lanes; l += CVM_LANES_WIDTH){
+        Cvm_Lanes x, m;
+        CVM_LANES_LOAD(x, a + l);
+        CVM_LANES_LOAD(m, mask + l);
+        x = CVM_LANES_BLEND(x, v, m);
+        memcpy(a + l, &x, sizeof(x));
+    }
+}
+
+static CVM_LANES_CLONES void cvm_lanes_copy(Word *a, const Word *b, const Word *mask, size_t lanes){
+    for(size_t l = 0; l < lanes; l += CVM_LANES_WIDTH){
+        Cvm_Lanes x, y, m;
+        CVM_LANES_LOAD(x, a + l);
+        CVM_LANES_LOAD(y, b + l);
+        CVM_LANES_LOAD(m, mask + l);
+        x = CVM_LANES_BLEND(x, y, m);
+        memcpy(a + l, &x, sizeof(x));
+    }
+}
+
+#undef CVM_LANES_BLEND
+#undef CVM_LANES_LOAD
+
+#else
+
+// Without vector extensions the rows go lane by lane.
+static void cvm_lanes_binop(Cvm_Lanes_Op op, Word *a, const Word *b, const Word *mask, size_t lanes){
+    for(size_t l = 0; l < lanes; l++){
+        if(mask[l] == 0){
+            continue;
+        }
+        uint64_t x = (uint64_t) a[l], y = (uint64_t) b[l];
+        switch(op){
+            case CVM_LANES_PLUS:
+                a[l] = (Word) (x + y);
+                break;
+            case CVM_LANES_MINUS:
+                a[l] = (Word) (x - y);
+                break;
+            case CVM_LANES_MULT:
+                a[l] = (Word) (x * y);
+                break;
+            case CVM_LANES_EQ:
+                a[l] = x == y;
+                break;
+            default:
+                assert(0 && "cvm_lanes_binop: Unknown op");
+        }
+    }
+}
+
+static void cvm_lanes_fill(Word *a, Word value, const Word *mask, size_t lanes){
+    for(size_t l = 0; l < lanes; l++){
+        if(mask[l] != 0){
+            a[l] = value;
+        }
+    }
+}
+
+static void cvm_lanes_copy(Word *a, const Word *b, const Word *mask, size_t lanes){
+    for(size_t l = 0; l < lanes; l++){
+        if(mask[l] != 0){
+            a[l] = b[l];
+        }
+    }
+}
+
+#endif
+
+// Lanes of one instruction stream. steps is what the group retired since the
+// lanes' counts were last brought up to date, and budget how many more it may
+// retire before one of them reaches its limit, negative for no limit.
+typedef struct {
+    Word ip;
+    Word sp;
+    unsigned mask;
+    Word steps;
+    Word budget;
+    Word lane_mask[CVM_LOCKSTEP_MAX_LANES];
+} Cvm_Lockstep_Group;
+
+struct Cvm_Lockstep {
+    size_t lanes;
+    Word depth;
+    Cvm cvms[CVM_LOCKSTEP_MAX_LANES];
+    Cvm_Batch_Job *jobs[CVM_LOCKSTEP_MAX_LANES];
+    Word retired[CVM_LOCKSTEP_MAX_LANES];
+    // Slot s of lane l is slots[s * lanes + l].
+    Word *slots;
+    Cvm_Lockstep_Group groups[CVM_LOCKSTEP_MAX_LANES];
+    size_t group_count;
+    const Inst *program;
+    Word program_size;
+};
+
+static Cvm_Lockstep *cvm_lockstep_create(size_t lanes, size_t stack_capacity, size_t memory_size, Cvm_Output_Mode output_mode){
+    assert(lanes % CVM_LANES_WIDTH == 0 && lanes <= CVM_LOCKSTEP_MAX_LANES);
+    Cvm_Lockstep *lockstep = cvm_calloc(1, sizeof(Cvm_Lockstep));
+    if(lockstep == NULL){
+        cvm_fail("Out of memory : %s\n", strerror(errno));
+    }
+    lockstep->lanes = lanes;
+    lockstep->depth = stack_capacity < CVM_LOCKSTEP_DEPTH ? (Word) stack_capacity : CVM_LOCKSTEP_DEPTH;
+    lockstep->slots = cvm_calloc((size_t) CVM_LOCKSTEP_DEPTH * lanes, sizeof(Word));
+    if(lockstep->slots == NULL){
+        cvm_fail("Out of memory : %s\n", strerror(errno));
+    }
+    for(size_t l = 0; l < lanes; l++){
+        cvm_init(&lockstep->cvms[l], stack_capacity);
+        if(memory_size != CVM_MEMORY_CAPACITY){
+            cvm_set_memory(&lockstep->cvms[l], memory_size);
+        }
+        cvm_set_output(&lockstep->cvms[l], STDOUT_FILENO, output_mode);
+    }
+    return lockstep;
+}
+
+static void cvm_lockstep_destroy(Cvm_Lockstep *lockstep){
+    for(size_t l = 0; l < lockstep->lanes; l++){
+        cvm_destroy(&lockstep->cvms[l]);
+    }
+    cvm_free(lockstep->slots);
+    cvm_free(lockstep);
+}
+
+static void cvm_lockstep_set_mask(Cvm_Lockstep *lockstep, Cvm_Lockstep_Group *group, unsigned mask){
+    group->mask = mask;
+    for(size_t l = 0; l < lockstep->lanes; l++){
+        group->lane_mask[l] = mask & (1u << l) ? -1 : 0;
+    }
+}
+
+// Brings the lanes' counts up to date and works out the group's new budget.
+static void cvm_lockstep_settle(Cvm_Lockstep *lockstep, Cvm_Lockstep_Group *group){
+    group->budget = -1;
+    for(size_t l = 0; l < lockstep->lanes; l++){
+        if(!(group->mask & (1u << l))){
+            continue;
+        }
+        lockstep->retired[l] += group->steps;
+        int limit = lockstep->jobs[l]->limit;
+        if(limit >= 0 && (group->budget < 0 || limit - lockstep->retired[l] < group->budget)){
+            group->budget = limit - lockstep->retired[l];
+        }
+    }
+    group->steps = 0;
+}
+
+// Hands the lanes in mask back to their own Cvm at the group's ip and depth. A
+// lane that halted is done; any other one finishes on the scalar engine with what
+// is left of its limit.
+static void cvm_lockstep_leave(Cvm_Lockstep *lockstep, size_t index, unsigned mask, int halted){
+    Cvm_Lockstep_Group *group = &lockstep->groups[index];
+    cvm_lockstep_settle(lockstep, group);
+    for(size_t l = 0; l < lockstep->lanes; l++){
+        if(!(mask & (1u << l))){
+            continue;
+        }
+        Cvm *cvm = &lockstep->cvms[l];
+        Cvm_Batch_Job *job = lockstep->jobs[l];
+        // Deeper than the lockstep stack goes only up to the limit, so this fits.
+        cvm_stack_reserve(cvm, group->sp);
+        for(Word s = 0; s < group->sp; s++){
+            cvm->stack[s] = lockstep->slots[(size_t) s * lockstep->lanes + l];
+        }
+        cvm->stack_size = group->sp;
+        cvm->ip = group->ip;
+        Error error = ERROR_OK;
+        if(halted){
+            cvm->halt = 1;
+            cvm_output_flush(cvm);
+        }
+        else{
+            int limit = job->limit < 0 ? -1 : job->limit - (int) lockstep->retired[l];
+            error = cvm_execute_program_with(cvm, limit, job->engine);
+        }
+        cvm_batch_finish_job(cvm, job, error);
+    }
+
+    cvm_lockstep_set_mask(lockstep, group, group->mask & ~mask);
+    if(group->mask == 0){
+        lockstep->groups[index] = lockstep->groups[--lockstep->group_count];
+    }
+    else if((group->mask & (group->mask - 1)) == 0){
+        // One lane on its own gains nothing from the rows.
+        cvm_lockstep_leave(lockstep, index, group->mask, 0);
+    }
+}
+
+// Folds splits that stand at the same ip and depth back into one and returns the
+// one with the lowest ip.
+static size_t cvm_lockstep_pick(Cvm_Lockstep *lockstep){
+    for(size_t i = 0; i < lockstep->group_count; i++){
+        for(size_t j = i + 1; j < lockstep->group_count; j++){
+            Cvm_Lockstep_Group *a = &lockstep->groups[i];
+            Cvm_Lockstep_Group *b = &lockstep->groups[j];
+            if(a->ip != b->ip || a->sp != b->sp){
+                continue;
+            }
+            cvm_lockstep_settle(lockstep, a);
+            cvm_lockstep_settle(lockstep, b);
+            cvm_lockstep_set_mask(lockstep, a, a->mask | b->mask);
+            cvm_lockstep_settle(lockstep, a);
+            lockstep->groups[j--] = lockstep->groups[--lockstep->group_count];
+        }
+    }
+    size_t lowest = 0;
+    for(size_t i = 1; i < lockstep->group_count; i++){
+        if(lockstep->groups[i].ip < lockstep->groups[lowest].ip){
+            lowest = i;
+        }
+    }
+    return lowest;
+}
+
+// Runs the group at index until it leaves, halts, or reaches a jump, after which
+// another split may be the one to run.
+static void cvm_lockstep_step(Cvm_Lockstep *lockstep, size_t index){
+    Cvm_Lockstep_Group *group = &lockstep->groups[index];
+    const size_t lanes = lockstep->lanes;
+    Word *slots = lockstep->slots;
+#define ROW(s) (slots + (size_t) (s) * lanes)
+#define LEAVE() do { cvm_lockstep_leave(lockstep, index, group->mask, 0); return; } while(0)
+
+    for(;;){
+        Word ip = group->ip;
+        Word sp = group->sp;
+        if(ip < 0 || ip >= lockstep->program_size){
+            LEAVE();
+        }
+        Inst inst = inst_fused_head(lockstep->program[ip]);
+        if(inst.type != INST_NOP && group->budget >= 0 && group->steps == group->budget){
+            // Some lanes are out of fuel; the scalar engine stops them where they are.
+            cvm_lockstep_settle(lockstep, group);
+            unsigned spent = 0;
+            for(size_t l = 0; l < lanes; l++){
+                if(group->mask & (1u << l) && lockstep->jobs[l]->limit >= 0
+                   && lockstep->retired[l] >= lockstep->jobs[l]->limit){
+                    spent |= 1u << l;
+                }
+            }
+            cvm_lockstep_leave(lockstep, index, spent, 0);
+            return;
+        }
+        switch(inst.type){
+            case INST_NOP:
+                group->ip++;
+                continue;
+            case INST_PUSH:
+                if(sp >= lockstep->depth){
+                    LEAVE();
+                }
+                cvm_lanes_fill(ROW(sp), inst.operand, group->lane_mask, lanes);
+                group->sp++;
+                group->ip++;
+                break;
+            case INST_DUP:
+                if(sp >= lockstep->depth || inst.operand < 0 || sp - inst.operand <= 0){
+                    LEAVE();
+                }
+                cvm_lanes_copy(ROW(sp), ROW(sp - 1 - inst.operand), group->lane_mask, lanes);
+                group->sp++;
+                group->ip++;
+                break;
+            case INST_PLUS:
+            case INST_MINUS:
+            case INST_MULT:
+            case INST_EQ: {
+                if(sp < 2){
+                    LEAVE();
+                }
+                Cvm_Lanes_Op op = inst.type == INST_PLUS ? CVM_LANES_PLUS
+                                : inst.type == INST_MINUS ? CVM_LANES_MINUS
+                                : inst.type == INST_MULT ? CVM_LANES_MULT
+                                : CVM_LANES_EQ;
+                cvm_lanes_binop(op, ROW(sp - 2), ROW(sp - 1), group->lane_mask, lanes);
+                group->sp--;
+                group->ip++;
+                break;
+            }
+            case INST_DIV: {
+                if(sp < 2){
+                    LEAVE();
+                }
+                // No vector integer division; the rows are divided lane by lane and
+                // the lanes dividing by zero fault on their own.
+                Word *a = ROW(sp - 2);
+                const Word *b = ROW(sp - 1);
+                unsigned zero = 0;
+                for(size_t l = 0; l < lanes; l++){
+                    if(group->mask & (1u << l) && b[l] == 0){
+                        zero |= 1u << l;
+                    }
+                }
+                if(zero != 0){
+                    cvm_lockstep_leave(lockstep, index, zero, 0);
+                    return;
+                }
+                for(size_t l = 0; l < lanes; l++){
+                    if(group->mask & (1u << l)){
+                        a[l] /= b[l];
+                    }
+                }
+                group->sp--;
+                group->ip++;
+                break;
+            }
+            case INST_JMP:
+                group->ip = inst.operand;
+                group->steps++;
+                return;
+            case INST_JMP_IF: {
+                if(sp < 1){
+                    LEAVE();
+                }
+                const Word *condition = ROW(sp - 1);
+                unsigned taken = 0;
+                for(size_t l = 0; l < lanes; l++){
+                    if(group->mask & (1u << l) && condition[l] != 0){
+                        taken |= 1u << l;
+                    }
+                }
+                if(taken == 0){
+                    group->ip++;
+                    break;
+                }
+                group->steps++;
+                if(taken == group->mask){
+                    group->sp--;
+                    group->ip = inst.operand;
+                    return;
+                }
+                cvm_lockstep_settle(lockstep, group);
+                Cvm_Lockstep_Group *split = &lockstep->groups[lockstep->group_count++];
+                *split = (Cvm_Lockstep_Group){ .ip = inst.operand, .sp = sp - 1 };
+                cvm_lockstep_set_mask(lockstep, split, taken);
+                cvm_lockstep_settle(lockstep, split);
+                cvm_lockstep_set_mask(lockstep, group, group->mask & ~taken);
+                cvm_lockstep_settle(lockstep, group);
+                group->ip++;
+                if((taken & (taken - 1)) == 0){
+                    cvm_lockstep_leave(lockstep, lockstep->group_count - 1, taken, 0);
+                }
+                if((group->mask & (group->mask - 1)) == 0){
+                    cvm_lockstep_leave(lockstep, index, group->mask, 0);
+                }
+                return;
+            }
+            case INST_HALT:
+                group->steps++;
+                cvm_lockstep_leave(lockstep, index, group->mask, 1);
+                return;
+            case INST_PRINT_DEBUG:
+                if(sp < 1){
+                    LEAVE();
+                }
+                for(size_t l = 0; l < lanes; l++){
+                    if(group->mask & (1u << l)){
+                        cvm_output_word(&lockstep->cvms[l], ROW(sp - 1)[l]);
+                    }
+                }
+                group->sp--;
+                group->ip++;
+                break;
+            case INST_LOAD:
+            case INST_STORE:
+            case INST_MEMCPY:
+            case INST_MEMSET:
+            case INST_ALLOC:
+            case INST_RESET:
+            case INST_NATIVE:
+            case INST_CALL:
+            case INST_RET:
+            case INST_YIELD:
+            case INST_PLUS_IMM:
+            case INST_PUSH2:
+            case INST_JMP_IF_EQ:
+            default:
+                LEAVE();
+        }
+        group->steps++;
+        if(lockstep->group_count > 1){
+            // Another split may be waiting at this ip to merge.
+            return;
+        }
+    }
+#undef LEAVE
+#undef ROW
+}
+
+// Runs count (at most lanes) jobs: those that start like the first one that
+// starts at all run in lockstep, the others on their own.
+static void cvm_lockstep_run_jobs(Cvm_Lockstep *lockstep, Cvm_Batch_Job *jobs, size_t count){
+    const Cvm *leader = NULL;
+    unsigned mask = 0;
+    for(size_t l = 0; l < count; l++){
+        Cvm *cvm = &lockstep->cvms[l];
+        Cvm_Batch_Job *job = &jobs[l];
+        lockstep->jobs[l] = job;
+        lockstep->retired[l] = 0;
+        if(!cvm_batch_start_job(cvm, job)){
+            continue;
+        }
+        if(leader == NULL && !cvm->halt && cvm->return_stack_size == 0 && cvm->stack_size <= lockstep->depth){
+            leader = cvm;
+        }
+        if(leader != NULL && cvm->image == leader->image && cvm->ip == leader->ip && !cvm->halt
+           && cvm->stack_size == leader->stack_size && cvm->return_stack_size == 0){
+            mask |= 1u << l;
+            continue;
+        }
+        cvm_batch_finish_job(cvm, job, cvm_execute_program_with(cvm, job->limit, job->engine));
+    }
+    if(mask == 0){
+        return;
+    }
+
+    // Lanes past count stay out of every mask; their slots are never looked at.
+    for(size_t l = 0; l < count; l++){
+        if(!(mask & (1u << l))){
+            continue;
+        }
+        for(Word s = 0; s < leader->stack_size; s++){
+            lockstep->slots[(size_t) s * lockstep->lanes + l] = lockstep->cvms[l].stack[s];
+        }
+    }
+    lockstep->program = leader->program;
+    lockstep->program_size = leader->program_size;
+    lockstep->group_count = 1;
+    lockstep->groups[0] = (Cvm_Lockstep_Group){ .ip = leader->ip, .sp = leader->stack_size };
+    cvm_lockstep_set_mask(lockstep, &lockstep->groups[0], mask);
+    cvm_lockstep_settle(lockstep, &lockstep->groups[0]);
+    if((mask & (mask - 1)) == 0){
+        cvm_lockstep_leave(lockstep, 0, mask, 0);
+    }
+    while(lockstep->group_count > 0){
+        cvm_lockstep_step(lockstep, cvm_lockstep_pick(lockstep));
+    }
+}
+
+// Like cvm_run_batch, with groups of lanes consecutive jobs run in lockstep; only
+// the order of print_debug output across jobs differs. lanes is 4, 8 or 16; jobs
+// with the same program should be next to each other.
+void cvm_run_lockstep(Cvm_Batch_Job *jobs, size_t job_count, size_t lanes, size_t thread_count, size_t stack_capacity, size_t memory_size, Cvm_Output_Mode output_mode){
+    cvm_batch_run(jobs, job_count, lanes, thread_count, stack_capacity, memory_size, output_mode);
+}
+
+// Cooperative scheduling of many contexts. Every context runs for a slice of fuel
+// at a time and goes back on its worker's run queue until it halts, fails or has
+// used up its limit; yield hands the rest of a slice back early.
+typedef enum {
+    CVM_SCHED_ROUND_ROBIN = 0,
+    CVM_SCHED_PRIORITY,
+} Cvm_Sched_Policy;
+
+const char *cvm_sched_policy_as_cstr(Cvm_Sched_Policy policy){
+    switch(policy){
+        case CVM_SCHED_ROUND_ROBIN:
+            return "rr";
+        case CVM_SCHED_PRIORITY:
+            return "priority";
+        default:
+            assert(0 && "cvm_sched_policy_as_cstr: Unknown policy");
+    }
+}
+
+int cvm_sched_policy_from_cstr(const char *name, Cvm_Sched_Policy *policy){
+    if(strcmp(name, "rr") == 0){
+        *policy = CVM_SCHED_ROUND_ROBIN;
+        return 1;
+    }
+    if(strcmp(name, "priority") == 0){
+        *policy = CVM_SCHED_PRIORITY;
+        return 1;
+    }
+    return 0;
+}
+
+// Under CVM_SCHED_PRIORITY a context of priority p gets p + 1 shares of its
+// worker: every instruction it retires advances its pass by CVM_SCHED_STRIDE / (p + 1)
+// and the context with the lowest pass runs next. Charging what was actually
+// retired, rather than whole slices, keeps contexts that yield early from paying
+// for fuel they gave back, and no priority can starve another.
+#define CVM_SCHED_STRIDE (1 << 20)
+#define CVM_SCHED_MAX_PRIORITY 255
+
+// One tenant: a context with its program attached, or a snapshot restored, and
+// any input already pushed; see cvm_task_init. limit caps the instructions it may
+// retire in total, negative for none. The rest is filled in by cvm_run_scheduler.
+typedef struct {
+    Cvm cvm;
+    int priority;
+    int limit;
+
+    Error error;
+    int finished; // halted or failed; a context stopped by its limit is not
+    uint64_t retired;
+    uint64_t slices;
+    uint64_t yields;
+
+    uint64_t pass;
+} Cvm_Task;
+
+void cvm_task_init(Cvm_Task *task, Cvm_Program *program, size_t stack_capacity, size_t memory_size, Cvm_Output_Mode output_mode){
+    *task = (Cvm_Task){ .limit = -1 };
+    cvm_init(&task->cvm, stack_capacity);
+    if(memory_size != CVM_MEMORY_CAPACITY){
+        cvm_set_memory(&task->cvm, memory_size);
+    }
+    cvm_set_output(&task->cvm, STDOUT_FILENO, output_mode);
+    cvm_attach_program(&task->cvm, program);
+}
+
+void cvm_task_destroy(Cvm_Task *task){
+    cvm_destroy(&task->cvm);
+}
+
+typedef struct {
+    Cvm_Task *tasks;
+    size_t task_count;
+    size_t worker_count;
+    int slice;
+    Cvm_Sched_Policy policy;
+    Cvm_Engine engine;
+} Cvm_Sched;
+
+typedef struct {
+    Cvm_Sched *sched;
+    size_t id;
+} Cvm_Sched_Worker;
+
+static int cvm_sched_before(const Cvm_Task *a, const Cvm_Task *b){
+    return a->pass < b->pass || (a->pass == b->pass && a < b);
+}
+
+// Binary min-heap on pass, in an array the worker sized for all of its tasks.
+static void cvm_sched_heap_push(Cvm_Task **heap, size_t *count, Cvm_Task *task){
+    size_t i = (*count)++;
+    while(i > 0 && cvm_sched_before(task, heap[(i - 1) / 2])){
+        heap[i] = heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    heap[i] = task;
+}
+
+static Cvm_Task *cvm_sched_heap_pop(Cvm_Task **heap, size_t *count){
+    Cvm_Task *top = heap[0];
+    Cvm_Task *last = heap[--*count];
+    size_t i = 0;
+    for(;;){
+        size_t child = 2 * i + 1;
+        if(child >= *count){
+            break;
+        }
+        if(child + 1 < *count && cvm_sched_before(heap[child + 1], heap[child])){
+            child++;
+        }
+        if(!cvm_sched_before(heap[child], last)){
+            break;
+        }
+        heap[i] = heap[child];
+        i = child;
+    }
+    if(*count > 0){
+        heap[i] = last;
+    }
+    return top;
+}
+
+// Runs one slice of task and returns whether it should be queued again. The
+// engines keep no per-call state, or cache what they decode in the context or
+// program, so a slice allocates nothing once every program has run once.
+static int cvm_sched_run_slice(const Cvm_Sched *sched, Cvm_Task *task){
+    Cvm *cvm = &task->cvm;
+    int fuel = sched->slice;
+    if(task->limit >= 0 && (uint64_t) task->limit - task->retired < (uint64_t) fuel){
+        fuel = (int) ((uint64_t) task->limit - task->retired);
+    }
+
+    cvm->yielded = 0;
+    task->error = cvm_execute_run(cvm, fuel, sched->engine);
+    task->retired += (uint64_t) (fuel - (cvm->fuel > 0 ? cvm->fuel : 0));
+    task->slices++;
+    task->yields += cvm->yielded;
+    cvm->yielded = 0;
+
+    if(task->error != ERROR_OK || cvm->halt){
+        task->finished = 1;
+        return 0;
+    }
+    return task->limit < 0 || task->retired < (uint64_t) task->limit;
+}
+
+static void *cvm_sched_worker(void *arg){
+    Cvm_Sched_Worker *worker = arg;
+    Cvm_Sched *sched = worker->sched;
+    size_t first = sched->task_count * worker->id / sched->worker_count;
+    size_t last = sched->task_count * (worker->id + 1) / sched->worker_count;
+    size_t count = last - first;
+
+    // The run queue holds every task of the worker at most once, so it is sized
+    // once here: a ring for round-robin, a heap for priorities.
+    Cvm_Task **queue = cvm_malloc(sizeof(Cvm_Task *) * (count > 0 ? count : 1));
+    if(queue == NULL){
+        cvm_fail("Out of memory : %s\n", strerror(errno));
+    }
+    size_t queued = 0;
+    for(size_t i = first; i < last; i++){
+        Cvm_Task *task = &sched->tasks[i];
+        task->pass = 0;
+        if(task->cvm.halt || task->limit == 0){
+            task->finished = task->cvm.halt;
+            continue;
+        }
+        queue[queued++] = task;
+    }
+
+    if(sched->policy == CVM_SCHED_ROUND_ROBIN){
+        size_t head = 0;
+        while(queued > 0){
+            Cvm_Task *task = queue[head];
+            head = head + 1 < count ? head + 1 : 0;
+            queued--;
+            if(cvm_sched_run_slice(sched, task)){
+                queue[(head + queued) % count] = task;
+                queued++;
+            }
+        }
+    }
+    else{
+        // Every pass starts at 0, so the array is already a valid heap.
+        while(queued > 0){
+            Cvm_Task *task = cvm_sched_heap_pop(queue, &queued);
+            uint64_t retired = task->retired;
+            int again = cvm_sched_run_slice(sched, task);
+            int priority = task->priority < 0 ? 0 : task->priority > CVM_SCHED_MAX_PRIORITY ? CVM_SCHED_MAX_PRIORITY : task->priority;
+            // A slice that retired nothing still costs one instruction, so it cannot
+            // stay at the front forever.
+            uint64_t charged = task->retired - retired > 0 ? task->retired - retired : 1;
+            task->pass += charged * (CVM_SCHED_STRIDE / (uint64_t) (priority + 1));
+            if(again){
+                cvm_sched_heap_push(queue, &queued, task);
+            }
+        }
+    }
+
+    cvm_free(queue);
+    return NULL;
+}
+
+// Runs every task until it halts, fails or uses up its limit, switching between
+// them every slice instructions and on yield. Tasks are dealt out in contiguous
+// runs to up to thread_count workers and stay on theirs, so each context is only
+// ever touched by one thread. Programs may be shared between tasks and must not
+// be reloaded or reverified while the scheduler runs.
+void cvm_run_scheduler(Cvm_Task *tasks, size_t task_count, size_t thread_count, int slice, Cvm_Sched_Policy policy, Cvm_Engine engine){
+    if(slice < 1){
+        slice = 1;
+    }
+    if(thread_count < 1){
+        thread_count = 1;
+    }
+    if(thread_count > task_count){
+        thread_count = task_count > 0 ? task_count : 1;
+    }
+
+    Cvm_Sched sched = {
+        .tasks = tasks,
+        .task_count = task_count,
+        .worker_count = thread_count,
+        .slice = slice,
+        .policy = policy,
+        .engine = engine,
+    };
+    Cvm_Sched_Worker *workers = cvm_malloc(sizeof(Cvm_Sched_Worker) * thread_count);
+    pthread_t *threads = cvm_malloc(sizeof(pthread_t) * thread_count);
+    if(workers == NULL || threads == NULL){
+        cvm_fail("Out of memory : %s\n", strerror(errno));
+    }
+    for(size_t w = 0; w < thread_count; w++){
+        workers[w] = (Cvm_Sched_Worker){ .sched = &sched, .id = w };
+    }
+
+    // The calling thread works as worker 0.
+    for(size_t w = 1; w < thread_count; w++){
+        int err = pthread_create(&threads[w], NULL, cvm_sched_worker, &workers[w]);
+        if(err != 0){
+            cvm_fail("Could not start worker thread : %s\n", strerror(err));
+        }
+    }
+    cvm_sched_worker(&workers[0]);
+    for(size_t w = 1; w < thread_count; w++){
+        pthread_join(threads[w], NULL);
+    }
+
+    cvm_free(threads);
+    cvm_free(workers);
+}
+
+// A program loaded by the server and shared by every run of it. refs counts the
+// cache's own reference, dropped when the file changes on disk, plus one per run
+// in progress; the last one frees the program.
+typedef struct Cvm_Cached_Program {
+    char *path;
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    uint64_t hash;
+    Cvm_Program program;
+    size_t refs;
+    struct Cvm_Cached_Program *next;
+} Cvm_Cached_Program;
+
+// State shared by the workers of cvm_serve. The program list and reference counts
+// are kept under lock; loads, verification and runs are not, programs are
+// immutable once cached.
+typedef struct {
+    pthread_mutex_t lock;
+    Cvm_Cached_Program *programs;
+    Cvm_Engine engine;
+    size_t stack_capacity;
+    size_t memory_size;
+    int verify;
+    int strict;
+} Cvm_Server;
+
+void cvm_server_init(Cvm_Server *server, Cvm_Engine engine, size_t stack_capacity, size_t memory_size, int verify, int strict){
+    *server = (Cvm_Server){
+        .engine = engine,
+        .stack_capacity = stack_capacity,
+        .memory_size = memory_size,
+        .verify = verify,
+        .strict = strict,
+    };
+    pthread_mutex_init(&server->lock, NULL);
+}
+
+// FNV-1a over the fields of every instruction, so struct padding does not count.
+static uint64_t cvm_program_hash(const Cvm_Program *program){
+    uint64_t hash = 14695981039346656037ull;
+    for(Word i = 0; i < program->size; i++){
+        uint64_t fields[2] = { (uint64_t) program->inst[i].type, (uint64_t) program->inst[i].operand };
+        for(size_t f = 0; f < 2; f++){
+            for(size_t b = 0; b < 8; b++){
+                hash = (hash ^ ((fields[f] >> (b * 8)) & 0xff)) * 1099511628211ull;
+            }
+        }
+    }
+    return hash;
+}
+
+static void cvm_cached_program_release(Cvm_Cached_Program *cached){
+    if(--cached->refs == 0){
+        cvm_program_destroy(&cached->program);
+        cvm_free(cached->path);
+        cvm_free(cached);
+    }
+}
+
+// The link to the entry cached for path, or to the NULL that ends the list.
+// Called with the lock held.
+static Cvm_Cached_Program **cvm_server_find(Cvm_Server *server, const char *path){
+    Cvm_Cached_Program **link = &server->programs;
+    while(*link != NULL && strcmp((*link)->path, path) != 0){
+        link = &(*link)->next;
+    }
+    return link;
+}
+
+// Whether cached was loaded from the file st describes, as it is now.
+static int cvm_cached_program_current(const Cvm_Cached_Program *cached, const struct stat *st){
+    return cached->dev == st->st_dev && cached->ino == st->st_ino && cached->size == st->st_size
+        && cached->mtime.tv_sec == st->st_mtim.tv_sec && cached->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+// Reads the whole file rather than mapping it: a cached program outlives the
+// file, which may be rewritten in place while it is being run.
+static const char *cvm_server_load(Cvm_Server *server, Cvm_Cached_Program *cached, int fd){
+    char *data = cvm_malloc(cached->size > 0 ? (size_t) cached->size : 1);
+    if(data == NULL){
+        cvm_fail("Out of memory : %s\n", strerror(errno));
+    }
+    size_t count = 0;
+    while(count < (size_t) cached->size){
+        ssize_t n = read(fd, data + count, (size_t) cached->size - count);
+        if(n < 0 && errno == EINTR){
+            continue;
+        }
+        if(n <= 0){
+            cvm_free(data);
+            return n < 0 ? strerror(errno) : "file shrank while being read";
+        }
+        count += (size_t) n;
+    }
+    const char *reason = cvm_load_program_from_bytes(&cached->program, data, count);
+    cvm_free(data);
+    if(reason != NULL){
+        return reason;
+    }
+
+    if(server->verify){
+        Cvm_Verify_Diag diag;
+        if(!cvm_verify_program(&cached->program, &diag) && server->strict){
+            cvm_program_destroy(&cached->program);
+            return diag.reason;
+        }
+    }
+    cached->hash = cvm_program_hash(&cached->program);
+    return NULL;
+}
+
+// Finds the program for name, a path or '#' and the hex hash a load reported,
+// and takes a reference to it. A path is stat'ed on every lookup and reloaded
+// when the file changed. Returns NULL and sets reason when there is no program.
+static Cvm_Cached_Program *cvm_server_acquire(Cvm_Server *server, const char *name, const char **reason){
+    Cvm_Cached_Program *result = NULL;
+    if(name[0] == '#'){
+        char *end;
+        errno = 0;
+        uint64_t hash = strtoull(name + 1, &end, 16);
+        if(name[1] == '\0' || *end != '\0' || errno != 0){
+            *reason = "malformed program hash";
+            return NULL;
+        }
+        pthread_mutex_lock(&server->lock);
+        for(Cvm_Cached_Program *cached = server->programs; cached != NULL; cached = cached->next){
+            if(cached->hash == hash){
+                result = cached;
+                result->refs += 1;
+                break;
+            }
+        }
+        pthread_mutex_unlock(&server->lock);
+        if(result == NULL){
+            *reason = "no cached program with that hash";
+        }
+        return result;
+    }
+
+    int fd = open(name, O_RDONLY);
+    struct stat st;
+    if(fd < 0 || fstat(fd, &st) < 0){
+        *reason = strerror(errno);
+        if(fd >= 0){
+            close(fd);
+        }
+        return NULL;
+    }
+
+    pthread_mutex_lock(&server->lock);
+    Cvm_Cached_Program *cached = *cvm_server_find(server, name);
+    if(cached != NULL && cvm_cached_program_current(cached, &st)){
+        result = cached;
+        result->refs += 1;
+    }
+    pthread_mutex_unlock(&server->lock);
+    if(result != NULL){
+        close(fd);
+        return result;
+    }
+
+    // Read, parse and verify without the lock, so requests for other programs
+    // are not held up behind a large file.
+    Cvm_Cached_Program *loaded = cvm_calloc(1, sizeof(Cvm_Cached_Program));
+    char *path = cvm_malloc(strlen(name) + 1);
+    if(loaded == NULL || path == NULL){
+        cvm_fail("Out of memory : %s\n", strerror(errno));
+    }
+    strcpy(path, name);
+    loaded->path = path;
+    loaded->dev = st.st_dev;
+    loaded->ino = st.st_ino;
+    loaded->size = st.st_size;
+    loaded->mtime = st.st_mtim;
+    *reason = cvm_server_load(server, loaded, fd);
+    close(fd);
+    if(*reason != NULL){
+        cvm_free(loaded->path);
+        cvm_free(loaded);
+        return NULL;
+    }
+
+    // Another worker may have loaded the same file in the meantime: keep the
+    // copy it cached and drop this one.
+    pthread_mutex_lock(&server->lock);
+    Cvm_Cached_Program **link = cvm_server_find(server, name);
+    cached = *link;
+    if(cached != NULL && cvm_cached_program_current(cached, &st)){
+        result = cached;
+        result->refs += 1;
+    }
+    else{
+        if(cached != NULL){
+            *link = cached->next;
+            cvm_cached_program_release(cached);
+        }
+        result = loaded;
+        result->refs = 2;
+        result->next = server->programs;
+        server->programs = result;
+        loaded = NULL;
+    }
+    pthread_mutex_unlock(&server->lock);
+    if(loaded != NULL){
+        loaded->refs = 1;
+        cvm_cached_program_release(loaded);
+    }
+    return result;
+}
+
+static void cvm_server_release(Cvm_Server *server, Cvm_Cached_Program *cached){
+    pthread_mutex_lock(&server->lock);
+    cvm_cached_program_release(cached);
+    pthread_mutex_unlock(&server->lock);
+}
+
+// Answers one request line, see cvm_serve_stream. input is scratch space that
+// grows to the largest initial stack seen.
+static void cvm_server_request(Cvm_Server *server, Cvm *cvm, String_view line, Word **input, size_t *input_capacity, FILE *out){
+    String_view command = string_view_chop_by_delim(&line, ' ');
+    line = string_view_trim_left(line);
+    String_view name_sv = string_view_chop_by_delim(&line, ' ');
+    line = string_view_trim_left(line);
+    char name[4096];
+    if(name_sv.count == 0 || name_sv.count >= sizeof(name)){
+        fprintf(out, "fail missing or overlong program name\n");
+        return;
+    }
+    memcpy(name, name_sv.data, name_sv.count);
+    name[name_sv.count] = '\0';
+
+    int run = string_view_eq(command, cstr_as_string_view("run"));
+    if(!run && !string_view_eq(command, cstr_as_string_view("load"))){
+        fprintf(out, "fail unknown command '%.*s'\n", (int) command.count, command.data);
+        return;
+    }
+
+    // Limit first, then the initial stack bottom first.
+    long long limit = -1;
+    size_t input_size = 0;
+    for(size_t i = 0; run && line.count > 0; i++){
+        String_view word = string_view_chop_by_delim(&line, ' ');
+        line = string_view_trim_left(line);
+        char buffer[32];
+        if(word.count == 0 || word.count >= sizeof(buffer)){
+            fprintf(out, "fail invalid word '%.*s'\n", (int) word.count, word.data);
+            return;
+        }
+        memcpy(buffer, word.data, word.count);
+        buffer[word.count] = '\0';
+        char *end;
+        errno = 0;
+        long long value = strtoll(buffer, &end, 10);
+        if(*end != '\0' || errno != 0){
+            fprintf(out, "fail invalid word '%s'\n", buffer);
+            return;
+        }
+        if(i == 0){
+            // As -l: -1 for no limit, never anything that would wrap into it.
+            if(value < -1 || value > INT_MAX){
+                fprintf(out, "fail invalid limit '%s'\n", buffer);
+                return;
+            }
+            limit = value;
+            continue;
+        }
+        if(input_size >= *input_capacity){
+            *input_capacity = *input_capacity == 0 ? 64 : *input_capacity * 2;
+            *input = cvm_realloc(*input, sizeof(Word) * *input_capacity);
+            if(*input == NULL){
+                cvm_fail("Out of memory : %s\n", strerror(errno));
+            }
+        }
+        (*input)[input_size++] = value;
+    }
+
+    const char *reason = NULL;
+    Cvm_Cached_Program *cached = cvm_server_acquire(server, name, &reason);
+    if(cached == NULL){
+        fprintf(out, "fail %s: %s\n", name, reason);
+        return;
+    }
+    if(!run){
+        fprintf(out, "ok #%016llx %lld %d\n", (unsigned long long) cached->hash,
+                (long long) cached->program.size, cached->program.verified);
+        cvm_server_release(server, cached);
+        return;
+    }
+
+    Cvm_Batch_Job job = {
+        .program = &cached->program,
+        .input = *input,
+        .input_size = input_size,
+        .limit = (int) limit,
+        .engine = server->engine,
+    };
+    cvm_batch_run_job(cvm, &job);
+    cvm_server_release(server, cached);
+
+    if(job.error == ERROR_OK || job.error == ERROR_OK_NO_INST){
+        fprintf(out, "ok %lld", (long long) job.stack_size);
+    }
+    else{
+        fprintf(out, "error %d %lld", (int) job.error, (long long) job.stack_size);
+    }
+    for(Word i = 0; i < job.stack_size; i++){
+        fprintf(out, " %lld", (long long) job.stack[i]);
+    }
+    fprintf(out, "\n");
+    cvm_free(job.stack);
+}
+
+// Serves requests from in until end of file, one per line, each answered with
+// one line on out:
+//
+//     load <program>                 ok #<hash> <instructions> <verified>
+//     run <program> <limit> <word>*  ok <n> <word>*  or  error <code> <n> <word>*
+//
+// <program> is a .cvm path or the #<hash> of one loaded before, <limit> as -l,
+// -1 to INT_MAX, and the words the initial stack. The words answered are the final stack and
+// <code> the Error the run stopped with. Anything the server cannot act on is
+// answered with fail and a message. Blank lines are skipped.
+void cvm_serve_stream(Cvm_Server *server, Cvm *cvm, FILE *in, FILE *out){
+    char *buffer = NULL;
+    size_t buffer_capacity = 0;
+    Word *input = NULL;
+    size_t input_capacity = 0;
+    ssize_t n;
+    while((n = getline(&buffer, &buffer_capacity, in)) >= 0){
+        String_view line = string_view_trim((String_view){ .count = (size_t) n, .data = buffer });
+        if(line.count == 0){
+            continue;
+        }
+        cvm_server_request(server, cvm, line, &input, &input_capacity, out);
+        if(fflush(out) != 0){
+            break;
+        }
+    }
+    cvm_free(input);
+    free(buffer);
+}
+
+static Cvm cvm_server_context(const Cvm_Server *server){
+    Cvm cvm = {0};
+    cvm_init(&cvm, server->stack_capacity);
+    if(server->memory_size != CVM_MEMORY_CAPACITY){
+        cvm_set_memory(&cvm, server->memory_size);
+    }
+    // stdout may carry the protocol; print_debug output goes to stderr instead.
+    cvm_set_output(&cvm, STDERR_FILENO, CVM_OUTPUT_TEXT);
+    return cvm;
+}
+
+typedef struct {
+    Cvm_Server *server;
+    int listen_fd;
+} Cvm_Server_Worker;
+
+// Every worker accepts connections itself and serves each to the end, so up to
+// thread_count clients are served at once and the rest wait in the backlog.
+static void *cvm_server_worker(void *arg){
+    Cvm_Server_Worker *worker = arg;
+    Cvm cvm = cvm_server_context(worker->server);
+    for(;;){
+        int fd = accept(worker->listen_fd, NULL, NULL);
+        if(fd < 0){
+            if(errno == EINTR || errno == ECONNABORTED){
+                continue;
+            }
+            cvm_fail("Could not accept connection : %s\n", strerror(errno));
+        }
+        int out_fd = dup(fd);
+        FILE *in = fdopen(fd, "r");
+        FILE *out = out_fd >= 0 ? fdopen(out_fd, "w") : NULL;
+        if(in != NULL && out != NULL){
+            cvm_serve_stream(worker->server, &cvm, in, out);
+        }
+        if(in != NULL){
+            fclose(in);
+        }
+        else{
+            close(fd);
+        }
+        if(out != NULL){
+            fclose(out);
+        }
+        else if(out_fd >= 0){
+            close(out_fd);
+        }
+    }
+    return NULL;
+}
+
+void cvm_serve_stdio(Cvm_Server *server){
+    Cvm cvm = cvm_server_context(server);
+    cvm_serve_stream(server, &cvm, stdin, stdout);
+    cvm_destroy(&cvm);
+}
+
+// Listens on a Unix domain socket at socket_path, replacing a stale one, and
+// serves cvm_serve_stream connections on thread_count workers. Does not return.
+void cvm_serve_socket(Cvm_Server *server, const char *socket_path, size_t thread_count){
+    struct sockaddr_un address = { .sun_family = AF_UNIX };
+    if(strlen(socket_path) >= sizeof(address.sun_path)){
+        cvm_fail("Socket path '%s' is too long\n", socket_path);
+    }
+    strcpy(address.sun_path, socket_path);
+
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(listen_fd < 0){
+        cvm_fail("Could not create socket : %s\n", strerror(errno));
+    }
+    unlink(socket_path);
+    if(bind(listen_fd, (struct sockaddr *) &address, sizeof(address)) < 0){
+        cvm_fail("Could not bind '%s' : %s\n", socket_path, strerror(errno));
+    }
+    if(listen(listen_fd, SOMAXCONN) < 0){
+        cvm_fail("Could not listen on '%s' : %s\n", socket_path, strerror(errno));
+    }
+    // A client that hangs up early must not take the server down with it.
+    signal(SIGPIPE, SIG_IGN);
+
+    if(thread_count < 1){
+        thread_count = 1;
+    }
+    Cvm_Server_Worker worker = { .server = server, .listen_fd = listen_fd };
+    // The calling thread works as the last worker.
+    for(size_t w = 1; w < thread_count; w++){
+        pthread_t thread;
+        int err = pthread_create(&thread, NULL, cvm_server_worker, &worker);
+        if(err != 0){
+            cvm_fail("Could not start worker thread : %s\n", strerror(err));
+        }
+        pthread_detach(thread);
+    }
+    cvm_server_worker(&worker);
+}
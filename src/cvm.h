@@ -0,0 +1,105 @@
+#ifndef CVM_H_
+#define CVM_H_
+
+// libcvm: the VM as a library, for hosts that run many short programs in one
+// long-lived process. Everything hangs off a Cvm_Env, which owns the allocator
+// and the message of the last failure. No call exits the process: failures come
+// back as a Cvm_Status and cvm_env_error says what went wrong.
+//
+// One env, and everything made from it, is used by one thread at a time. Separate
+// envs can be used on separate threads at once.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__GNUC__)
+#define CVM_API __attribute__((visibility("default")))
+#else
+#define CVM_API
+#endif
+
+// Heap allocator for everything an env creates. realloc and free get pointers
+// returned by this allocator only; free is never given NULL. Stacks, which come
+// from a process-wide pool, linear memory and JIT code are page mappings and do
+// not go through it.
+typedef struct {
+    void *(*malloc)(void *user, size_t size);
+    void *(*realloc)(void *user, void *ptr, size_t size);
+    void (*free)(void *user, void *ptr);
+    void *user;
+} Cvm_Allocator;
+
+typedef enum {
+    CVM_OK = 0,
+    // Runtime errors raised by programs.
+    CVM_STACK_OVERFLOW,
+    CVM_STACK_UNDERFLOW,
+    CVM_ILLEGAL_INST,
+    CVM_DIV_BY_ZERO,
+    CVM_ILLEGAL_INST_ACCESS,
+    CVM_ILLEGAL_OPERAND,
+    CVM_ILLEGAL_MEMORY_ACCESS,
+    CVM_OUT_OF_MEMORY,
+    CVM_RETURN_STACK_OVERFLOW,
+    CVM_RETURN_STACK_UNDERFLOW,
+    // Everything else: bad source or bytecode, an unknown engine, a program that
+    // fails verification, an allocation that failed. See cvm_env_error.
+    CVM_FAILED = 64,
+} Cvm_Status;
+
+typedef struct Cvm_Env Cvm_Env;
+typedef struct Cvm_Image Cvm_Image;
+typedef struct Cvm_Context Cvm_Context;
+
+// allocator may be NULL for libc. The allocator is copied.
+CVM_API Cvm_Status cvm_env_create(const Cvm_Allocator *allocator, Cvm_Env **env);
+// Also frees whatever images and contexts of the env are still alive.
+CVM_API void cvm_env_destroy(Cvm_Env *env);
+// Message of the last call on env that returned CVM_FAILED, or "".
+CVM_API const char *cvm_env_error(const Cvm_Env *env);
+
+// Assembles size bytes of cvmasm source. optimize is the -O level; inline_threshold
+// and fuse do what cvmasm -i and -f do, with a negative threshold for no inlining.
+CVM_API Cvm_Status cvm_image_assemble(Cvm_Env *env, const char *source, size_t size,
+                                      int optimize, int inline_threshold, int fuse, Cvm_Image **image);
+// Loads bytecode in either .cvm format from memory; the bytes are copied.
+CVM_API Cvm_Status cvm_image_load(Cvm_Env *env, const void *data, size_t size, Cvm_Image **image);
+CVM_API Cvm_Status cvm_image_load_file(Cvm_Env *env, const char *file_path, Cvm_Image **image);
+// Proves the image safe for the unchecked engine; CVM_FAILED says why not. Contexts
+// on the auto engine pick it up by themselves once this has succeeded.
+CVM_API Cvm_Status cvm_image_verify(Cvm_Image *image);
+// Contexts still attached to image must not run again.
+CVM_API void cvm_image_destroy(Cvm_Image *image);
+
+// 0 for either size picks the cvmi default.
+CVM_API Cvm_Status cvm_context_create(Cvm_Env *env, size_t stack_capacity, size_t memory_size, Cvm_Context **context);
+CVM_API void cvm_context_destroy(Cvm_Context *context);
+// Resets the context to run image from the start with empty stacks and zeroed memory.
+CVM_API Cvm_Status cvm_context_attach(Cvm_Context *context, Cvm_Image *image);
+// auto, the default, or switch, threaded, jit, tos or trace to run every image on
+// that engine whether it was verified or not.
+CVM_API Cvm_Status cvm_context_set_engine(Cvm_Context *context, const char *engine);
+// print_debug output goes to fd, as text or raw words.
+CVM_API Cvm_Status cvm_context_set_output(Cvm_Context *context, int fd, int binary);
+CVM_API Cvm_Status cvm_context_push(Cvm_Context *context, int64_t value);
+// Runs at most limit instructions, all of them when limit is negative, and returns
+// the program's runtime error if it raised one.
+CVM_API Cvm_Status cvm_context_execute(Cvm_Context *context, int limit);
+CVM_API int cvm_context_halted(const Cvm_Context *context);
+// The stack, bottom first; valid until the context runs again.
+CVM_API const int64_t *cvm_context_stack(const Cvm_Context *context, size_t *size);
+
+// What a context holds right now, in bytes. Stacks start small and grow up to the
+// capacity they were created with; memory is counted as far as it was written.
+// The image is shared and not counted.
+typedef struct {
+    size_t stack;
+    size_t return_stack;
+    size_t memory;
+    size_t output;
+    size_t total;
+} Cvm_Stats;
+
+CVM_API void cvm_context_stats(const Cvm_Context *context, Cvm_Stats *stats);
+
+#endif // CVM_H_
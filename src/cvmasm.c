@@ -1,20 +1,76 @@
 #include "./cvm.c"
 
-Cvm cvm = {0};
+Cvm_Program program = {0};
 
 int main(int argc, char *argv[]){
     if(argc < 3){
-        fprintf(stderr, "Usage: %s <source.cvmasm> <output.cvm>\n", argv[0]);
+        fprintf(stderr, "Usage: %s <source.cvmasm> <output.cvm> [-O0|-O1|-O2] [-i N] [-f] [-r]\n", argv[0]);
+        fprintf(stderr, "    -O1 strip NOPs and unreachable code, -O2 also thread jumps and fold constants\n");
+        fprintf(stderr, "    -i  inline calls to leaf routines of at most N instructions\n");
+        fprintf(stderr, "    -f  fuse common instruction sequences into superinstructions\n");
+        fprintf(stderr, "    -r  write the legacy raw Inst format instead of the compact one\n");
         exit(1);
     }
     const char *source_file_path = argv[1];
     const char *output_file_path = argv[2];
+    int fuse = 0;
+    int raw = 0;
+    int level = 0;
+    int inline_threshold = -1;
+
+    for(int i = 3; i < argc; i++){
+        if(strcmp(argv[i], "-f") == 0){
+            fuse = 1;
+        }
+        else if(strcmp(argv[i], "-r") == 0){
+            raw = 1;
+        }
+        else if(strcmp(argv[i], "-i") == 0 && i + 1 < argc){
+            long value;
+            if(!cvm_long_from_cstr(argv[++i], 0, INT_MAX, &value)){
+                fprintf(stderr, "ERROR: -i takes a number from 0 to %d, not '%s'\n", INT_MAX, argv[i]);
+                exit(1);
+            }
+            inline_threshold = (int) value;
+        }
+        else if(strcmp(argv[i], "-O0") == 0 || strcmp(argv[i], "-O1") == 0 || strcmp(argv[i], "-O2") == 0){
+            level = argv[i][2] - '0';
+        }
+        else{
+            fprintf(stderr, "ERROR: Unknown flag '%s'\n", argv[i]);
+            exit(1);
+        }
+    }
 
     String_view source_code = slurp_file(source_file_path);
 
-    cvm.program_size = cvm_translate_source(source_code, cvm.program, CVM_PROGRAM_CAPACITY);
+    size_t program_capacity = 0;
+    program.size = cvm_translate_source(source_code, &program.inst, &program_capacity);
+
+    if(inline_threshold >= 0){
+        size_t program_size = program.size;
+        size_t inlined = cvm_inline_calls(&program.inst, &program_size, &program_capacity, inline_threshold);
+        program.size = program_size;
+        fprintf(stderr, "Inlined %zu calls\n", inlined);
+    }
+
+    if(level > 0){
+        size_t before = program.size;
+        program.size = cvm_optimize_program(program.inst, program.size, level);
+        fprintf(stderr, "Optimized %zu instructions down to %lld\n", before, (long long) program.size);
+    }
+
+    if(fuse){
+        size_t fused = cvm_fuse_program(program.inst, program.size);
+        fprintf(stderr, "Fused %zu instruction sequences\n", fused);
+    }
 
-    cvm_save_program_to_file(cvm.program, cvm.program_size, output_file_path);
+    if(raw){
+        cvm_save_program_to_file_raw(program.inst, program.size, output_file_path);
+    }
+    else{
+        cvm_save_program_to_file(program.inst, program.size, output_file_path);
+    }
     
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,282 @@
+#include "./cvm.c"
+
+#include <sys/wait.h>
+
+#define BENCH_REPETITIONS 5
+
+typedef Error (*Bench_Engine_Fn)(Cvm *cvm, int lim);
+
+typedef struct {
+    const char *name;
+    Bench_Engine_Fn execute;
+} Bench_Engine;
+
+// Every dispatch strategy is called directly so that cvm_execute_program_with
+// does not route verified programs onto the unchecked path behind our back.
+static const Bench_Engine engines[] = {
+    { "switch", cvm_execute_program },
+    { "threaded", cvm_execute_program_threaded },
+    { "tos", cvm_execute_program_tos },
+    { "trace", cvm_execute_program_trace },
+    { "jit", cvm_execute_program_jit },
+    { "unchecked", cvm_execute_program_unchecked },
+};
+
+typedef struct {
+    const char *name;
+    const char *description;
+    void (*generate)(FILE *stream, long scale);
+} Bench_Workload;
+
+// Keeps a counter on top of the stack and closes the loop opened at "loop:".
+static void bench_emit_loop_tail(FILE *stream){
+    fprintf(stream, "push 1\nminus\ndup 0\njmp_if loop\nhalt\n");
+}
+
+static void bench_generate_arith_loop(FILE *stream, long scale){
+    fprintf(stream, "# tight arithmetic loop\npush %ld\nloop:\n", 400000 * scale);
+    // Works on a copy of the counter and folds the result back in as +0.
+    fprintf(stream, "dup 0\npush 3\nmult\npush 7\nplus\npush 5\nminus\npush 2\ndiv\n");
+    fprintf(stream, "dup 0\nmult\npush 11\nplus\npush 0\nmult\nplus\n");
+    bench_emit_loop_tail(stream);
+}
+
+static void bench_generate_dup_chain(FILE *stream, long scale){
+    fprintf(stream, "# deep dup chains\n");
+    for(int i = 0; i < 64; i++){
+        fprintf(stream, "push %d\n", i + 1);
+    }
+    fprintf(stream, "push %ld\nloop:\n", 300000 * scale);
+    for(int i = 0; i < 4; i++){
+        fprintf(stream, "dup %d\ndup %d\nplus\ndup %d\nmult\npush 0\nmult\nplus\n", 60 - i * 7, 20 + i * 9, 40 - i * 3);
+    }
+    bench_emit_loop_tail(stream);
+}
+
+#define BENCH_STATES 16
+
+// Every state tests one bit of the counter and moves to one of two other states,
+// so the jmp_if outcomes follow the counter instead of a fixed pattern.
+static void bench_generate_state_machine(FILE *stream, long scale){
+    fprintf(stream, "# branch heavy state machine\npush %ld\njmp s0\n", 1000000 * scale);
+    for(int s = 0; s < BENCH_STATES; s++){
+        int bit = s % 5;
+        fprintf(stream, "s%d:\n", s);
+        fprintf(stream, "push 1\nminus\ndup 0\njmp_if s%d_live\nhalt\ns%d_live:\n", s, s);
+        fprintf(stream, "dup 0\npush %d\ndiv\ndup 0\npush 2\ndiv\npush 2\nmult\neq\n", 1 << bit);
+        fprintf(stream, "jmp_if s%d_even\nplus\njmp s%d\n", s, (s * 7 + 3) % BENCH_STATES);
+        fprintf(stream, "s%d_even:\njmp s%d\n", s, (s + 1) % BENCH_STATES);
+    }
+}
+
+static void bench_generate_straight_line(FILE *stream, long scale){
+    fprintf(stream, "# large straight line program\npush 0\n");
+    for(long i = 0; i < 250000 * scale; i++){
+        fprintf(stream, "push %ld\nplus\n", i % 1000);
+    }
+    fprintf(stream, "halt\n");
+}
+
+static const Bench_Workload workloads[] = {
+    { "arith_loop", "tight arithmetic loop", bench_generate_arith_loop },
+    { "dup_chain", "deep dup chains", bench_generate_dup_chain },
+    { "state_machine", "branch heavy jmp_if state machine", bench_generate_state_machine },
+    { "straight_line", "large straight line program", bench_generate_straight_line },
+};
+
+static double bench_now_ms(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec * 1e3 + (double) ts.tv_nsec / 1e6;
+}
+
+// Runs a tool with its output discarded and returns the wall time in ms.
+static double bench_time_tool(char *const argv[]){
+    double start = bench_now_ms();
+    pid_t pid = fork();
+    if(pid < 0){
+        fprintf(stderr, "ERROR: Could not fork : %s\n", strerror(errno));
+        exit(1);
+    }
+    if(pid == 0){
+        int null = open("/dev/null", O_WRONLY);
+        if(null >= 0){
+            dup2(null, STDOUT_FILENO);
+            dup2(null, STDERR_FILENO);
+        }
+        execv(argv[0], argv);
+        _exit(127);
+    }
+    int status;
+    if(waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0){
+        fprintf(stderr, "ERROR: '%s' failed\n", argv[0]);
+        exit(1);
+    }
+    return bench_now_ms() - start;
+}
+
+// Instructions as counted by -l, i.e. without NOPs.
+static uint64_t bench_count_instructions(Cvm *cvm, Cvm_Program *program){
+    uint64_t count = 0;
+    cvm_attach_program(cvm, program);
+    while(!cvm->halt){
+        int retired = 0;
+        Error error = cvm_ex_inst_limited(cvm, -1, &retired);
+        if(error != ERROR_OK && error != ERROR_OK_NO_INST){
+            fprintf(stderr, "ERROR: Benchmark program failed: %s\n", error_as_cstr(error));
+            exit(1);
+        }
+        count += retired;
+    }
+    return count;
+}
+
+void usage(FILE *stream, const char *program_name){
+    fprintf(stream, "Usage: %s [-o results.json] [-d workdir] [-t tooldir] [-r repetitions] [-x scale] [-h]\n", program_name);
+    fprintf(stream, "    -o  where to write the JSON results (default bench.json)\n");
+    fprintf(stream, "    -d  directory for the generated workloads (default bench)\n");
+    fprintf(stream, "    -t  directory holding cvmasm and decvmasm (default .)\n");
+    fprintf(stream, "    -r  runs per measurement, the fastest one is reported (default %d)\n", BENCH_REPETITIONS);
+    fprintf(stream, "    -x  multiplies every workload size (default 1)\n");
+}
+
+int main(int argc, char *argv[]){
+    const char *output_path = "bench.json";
+    const char *work_dir = "bench";
+    const char *tool_dir = ".";
+    int repetitions = BENCH_REPETITIONS;
+    long scale = 1;
+
+    for(int i = 1; i < argc; i++){
+        if(strcmp(argv[i], "-h") == 0){
+            usage(stdout, argv[0]);
+            exit(0);
+        }
+        if(i + 1 >= argc){
+            usage(stderr, argv[0]);
+            fprintf(stderr, "ERROR: Unknown flag or missing value '%s'\n", argv[i]);
+            exit(1);
+        }
+        if(strcmp(argv[i], "-o") == 0){
+            output_path = argv[++i];
+        }
+        else if(strcmp(argv[i], "-d") == 0){
+            work_dir = argv[++i];
+        }
+        else if(strcmp(argv[i], "-t") == 0){
+            tool_dir = argv[++i];
+        }
+        else if(strcmp(argv[i], "-r") == 0){
+            repetitions = atoi(argv[++i]);
+        }
+        else if(strcmp(argv[i], "-x") == 0){
+            scale = atol(argv[++i]);
+        }
+        else{
+            usage(stderr, argv[0]);
+            fprintf(stderr, "ERROR: Unknown flag '%s'\n", argv[i]);
+            exit(1);
+        }
+    }
+    if(repetitions < 1 || scale < 1){
+        fprintf(stderr, "ERROR: Repetitions and scale must be at least 1\n");
+        exit(1);
+    }
+    if(mkdir(work_dir, 0755) < 0 && errno != EEXIST){
+        fprintf(stderr, "ERROR: Could not create directory '%s': %s\n", work_dir, strerror(errno));
+        exit(1);
+    }
+
+    FILE *json = fopen(output_path, "w");
+    if(json == NULL){
+        fprintf(stderr, "ERROR: Could not open file '%s': %s\n", output_path, strerror(errno));
+        exit(1);
+    }
+    fprintf(json, "{\n  \"version\": 1,\n  \"repetitions\": %d,\n  \"scale\": %ld,\n  \"workloads\": [\n", repetitions, scale);
+
+    char cvmasm_path[4096], decvmasm_path[4096];
+    snprintf(cvmasm_path, sizeof(cvmasm_path), "%s/cvmasm", tool_dir);
+    snprintf(decvmasm_path, sizeof(decvmasm_path), "%s/decvmasm", tool_dir);
+
+    Cvm cvm = {0};
+    cvm_init(&cvm, CVM_STACK_CAPACITY);
+
+    for(size_t w = 0; w < ARRAY_SIZE(workloads); w++){
+        const Bench_Workload *workload = &workloads[w];
+        char source_path[4096], program_path[4096];
+        snprintf(source_path, sizeof(source_path), "%s/%s.cvmasm", work_dir, workload->name);
+        snprintf(program_path, sizeof(program_path), "%s/%s.cvm", work_dir, workload->name);
+
+        FILE *source = fopen(source_path, "w");
+        if(source == NULL){
+            fprintf(stderr, "ERROR: Could not open file '%s': %s\n", source_path, strerror(errno));
+            exit(1);
+        }
+        workload->generate(source, scale);
+        fclose(source);
+
+        double assemble_ms = 0, load_ms = 0, disassemble_ms = 0;
+        Cvm_Program program = {0};
+        for(int r = 0; r < repetitions; r++){
+            char *assemble[] = { cvmasm_path, source_path, program_path, NULL };
+            double ms = bench_time_tool(assemble);
+            assemble_ms = r == 0 || ms < assemble_ms ? ms : assemble_ms;
+
+            char *disassemble[] = { decvmasm_path, program_path, NULL };
+            ms = bench_time_tool(disassemble);
+            disassemble_ms = r == 0 || ms < disassemble_ms ? ms : disassemble_ms;
+
+            double start = bench_now_ms();
+            cvm_load_program_from_file(&program, program_path);
+            if(!cvm_verify_program(&program, NULL)){
+                fprintf(stderr, "ERROR: Benchmark program '%s' does not verify\n", program_path);
+                exit(1);
+            }
+            ms = bench_now_ms() - start;
+            load_ms = r == 0 || ms < load_ms ? ms : load_ms;
+        }
+
+        uint64_t instructions = bench_count_instructions(&cvm, &program);
+        Word expected_size = cvm.stack_size;
+        Word expected_top = cvm.stack[cvm.stack_size - 1];
+
+        printf("%s (%s): %lld instructions, %llu executed\n", workload->name, workload->description,
+                (long long) program.size, (unsigned long long) instructions);
+        printf("    assemble %.3f ms, load %.3f ms, disassemble %.3f ms\n", assemble_ms, load_ms, disassemble_ms);
+        fprintf(json, "    {\n      \"name\": \"%s\",\n      \"program_size\": %lld,\n      \"instructions\": %llu,\n",
+                workload->name, (long long) program.size, (unsigned long long) instructions);
+        fprintf(json, "      \"assemble_ms\": %.6f,\n      \"load_ms\": %.6f,\n      \"disassemble_ms\": %.6f,\n      \"engines\": {\n",
+                assemble_ms, load_ms, disassemble_ms);
+
+        for(size_t e = 0; e < ARRAY_SIZE(engines); e++){
+            double run_ms = 0;
+            for(int r = 0; r < repetitions; r++){
+                cvm_attach_program(&cvm, &program);
+                double start = bench_now_ms();
+                Error error = engines[e].execute(&cvm, -1);
+                double ms = bench_now_ms() - start;
+                if(error != ERROR_OK || cvm.stack_size != expected_size || cvm.stack[cvm.stack_size - 1] != expected_top){
+                    fprintf(stderr, "ERROR: %s engine disagrees on %s: %s\n", engines[e].name, workload->name, error_as_cstr(error));
+                    exit(1);
+                }
+                run_ms = r == 0 || ms < run_ms ? ms : run_ms;
+            }
+            double ns_per_inst = run_ms * 1e6 / (double) instructions;
+            double inst_per_sec = (double) instructions / (run_ms / 1e3);
+            printf("    %-10s %10.3f ms %8.3f ns/inst %14.0f inst/s\n", engines[e].name, run_ms, ns_per_inst, inst_per_sec);
+            fprintf(json, "        \"%s\": { \"run_ms\": %.6f, \"ns_per_inst\": %.6f, \"inst_per_sec\": %.0f }%s\n",
+                    engines[e].name, run_ms, ns_per_inst, inst_per_sec, e + 1 < ARRAY_SIZE(engines) ? "," : "");
+        }
+        fprintf(json, "      }\n    }%s\n", w + 1 < ARRAY_SIZE(workloads) ? "," : "");
+        cvm_program_destroy(&program);
+    }
+
+    fprintf(json, "  ]\n}\n");
+    if(ferror(json) || fclose(json) != 0){
+        fprintf(stderr, "ERROR: Could not write file '%s': %s\n", output_path, strerror(errno));
+        exit(1);
+    }
+    cvm_destroy(&cvm);
+    printf("Results written to %s\n", output_path);
+    return 0;
+}
@@ -0,0 +1,506 @@
+#include "./cvm.c"
+
+// Translates a .cvm program into a C translation unit that runs it natively. The
+// output includes cvm.c for the runtime (output, memory, natives, cvm_dump_stack),
+// so it builds with `cc -O2 -I<dir of cvm.c> -o prog prog.c -lpthread` and then
+// behaves like `cvmi <program.cvm>` with the same -S and -M.
+//
+// Every instruction becomes straight-line C behind a label, jumps become gotos and
+// ret a switch over the return points. Programs that verify, with a proven depth
+// that fits the stack, keep the stack in a local array indexed by constants, offset
+// by the depth a routine was called at inside routines, with no bounds checks left;
+// everything else keeps every check of cvm_ex_inst.
+
+Cvm_Program program = {0};
+
+// How the translated code reaches the stack. A verified program knows the depth at
+// every ip, so slots are constants, or constants past a local fp, the depth the
+// running routine was called at; otherwise they are relative to a local sp.
+typedef struct {
+    FILE *out;
+    const Cvm_Program *program;
+    int verified;
+} Cvmc;
+
+// The depth n words below the top at instruction ip of a verified program.
+static void cvmc_depth(char *buffer, size_t size, const Cvmc *c, Word ip, Word n){
+    Word depth = c->program->stack_depth[ip] - n;
+    if(c->program->routine[ip] < 0){
+        snprintf(buffer, size, "%lld", (long long) depth);
+    }
+    else if(depth == 0){
+        snprintf(buffer, size, "fp");
+    }
+    else{
+        snprintf(buffer, size, "fp%+lld", (long long) depth);
+    }
+}
+
+// Slot n from the top, 1 being the top, at instruction ip.
+static void cvmc_slot(char *buffer, size_t size, const Cvmc *c, Word ip, Word n){
+    if(c->verified){
+        char depth[48];
+        cvmc_depth(depth, sizeof(depth), c, ip, n);
+        snprintf(buffer, size, "s[%s]", depth);
+    }
+    else{
+        snprintf(buffer, size, "stack[sp - %lld]", (long long) n);
+    }
+}
+
+// value as a C constant expression of type Word.
+static void cvmc_word(char *buffer, size_t size, Word value){
+    if(value == INT64_MIN){
+        snprintf(buffer, size, "INT64_MIN");
+    }
+    else{
+        snprintf(buffer, size, "%lldLL", (long long) value);
+    }
+}
+
+static void cvmc_fail(const Cvmc *c, Word ip, const char *error){
+    if(c->verified){
+        char depth[48];
+        cvmc_depth(depth, sizeof(depth), c, ip, 0);
+        fprintf(c->out, "    CVMC_FAIL(%lld, %s, %s);\n", (long long) ip, depth, error);
+    }
+    else{
+        fprintf(c->out, "    CVMC_FAIL(%lld, sp, %s);\n", (long long) ip, error);
+    }
+}
+
+// Checks the checked engines make before touching the stack; the verifier proved
+// them for verified programs.
+static void cvmc_need(const Cvmc *c, Word ip, Word pops, Word pushes){
+    if(c->verified){
+        return;
+    }
+    if(pops > 0){
+        fprintf(c->out, "    if(sp < %lld) CVMC_FAIL(%lld, sp, ERROR_STACK_UNDERFLOW);\n", (long long) pops, (long long) ip);
+    }
+    if(pushes > 0){
+        fprintf(c->out, "    if(sp > capacity - %lld) CVMC_GROW(%lld, %lld);\n", (long long) pushes, (long long) ip, (long long) pushes);
+    }
+}
+
+static void cvmc_move(const Cvmc *c, Word delta){
+    if(!c->verified && delta != 0){
+        fprintf(c->out, "    sp += %lld;\n", (long long) delta);
+    }
+}
+
+// Control goes to target: a label inside the program, or the same fault the
+// interpreter raises when it fetches from outside it.
+static void cvmc_goto(const Cvmc *c, Word ip, Word target, const char *indent){
+    if(target >= 0 && target <= c->program->size){
+        fprintf(c->out, "%sgoto ip_%lld;\n", indent, (long long) target);
+    }
+    else if(c->verified){
+        char depth[48];
+        cvmc_depth(depth, sizeof(depth), c, ip, 0);
+        fprintf(c->out, "%sCVMC_FAIL(%lld, %s, ERROR_ILLEGAL_INST_ACCESS);\n", indent, (long long) target, depth);
+    }
+    else{
+        fprintf(c->out, "%sCVMC_FAIL(%lld, sp, ERROR_ILLEGAL_INST_ACCESS);\n", indent, (long long) target);
+    }
+}
+
+static void cvmc_binary(const Cvmc *c, Word ip, const char *expression){
+    char a[64], b[64];
+    cvmc_slot(a, sizeof(a), c, ip, 2);
+    cvmc_slot(b, sizeof(b), c, ip, 1);
+    cvmc_need(c, ip, 2, 0);
+    fprintf(c->out, "    %s = ", a);
+    fprintf(c->out, expression, a, b);
+    fprintf(c->out, ";\n");
+    cvmc_move(c, -1);
+}
+
+static void cvmc_inst(const Cvmc *c, Word ip){
+    Inst inst = c->program->inst[ip];
+    FILE *out = c->out;
+    char top[64], second[64], third[64], push[64];
+    cvmc_slot(top, sizeof(top), c, ip, 1);
+    cvmc_slot(second, sizeof(second), c, ip, 2);
+    cvmc_slot(third, sizeof(third), c, ip, 3);
+    cvmc_slot(push, sizeof(push), c, ip, 0);
+
+    switch(inst.type){
+        case INST_NOP:
+            break;
+        case INST_PUSH: {
+            char value[32];
+            cvmc_word(value, sizeof(value), inst.operand);
+            cvmc_need(c, ip, 0, 1);
+            fprintf(out, "    %s = %s;\n", push, value);
+            cvmc_move(c, 1);
+            break;
+        }
+        case INST_DUP: {
+            if(!c->verified){
+                fprintf(out, "    if(sp > capacity - 1) CVMC_GROW(%lld, 1);\n", (long long) ip);
+                if(inst.operand < 0){
+                    cvmc_fail(c, ip, "ERROR_ILLEGAL_OPERAND");
+                    break;
+                }
+                fprintf(out, "    if(sp <= %lldLL) CVMC_FAIL(%lld, sp, ERROR_STACK_UNDERFLOW);\n", (long long) inst.operand, (long long) ip);
+            }
+            char source[64];
+            cvmc_slot(source, sizeof(source), c, ip, inst.operand + 1);
+            fprintf(out, "    %s = %s;\n", push, source);
+            cvmc_move(c, 1);
+            break;
+        }
+        case INST_PLUS:
+            cvmc_binary(c, ip, "(Word) ((uint64_t) %s + (uint64_t) %s)");
+            break;
+        case INST_MINUS:
+            cvmc_binary(c, ip, "(Word) ((uint64_t) %s - (uint64_t) %s)");
+            break;
+        case INST_MULT:
+            cvmc_binary(c, ip, "(Word) ((uint64_t) %s * (uint64_t) %s)");
+            break;
+        case INST_DIV:
+            cvmc_need(c, ip, 2, 0);
+            fprintf(out, "    if(%s == 0) ", top);
+            cvmc_fail(c, ip, "ERROR_DIV_BY_ZERO");
+            fprintf(out, "    %s /= %s;\n", second, top);
+            cvmc_move(c, -1);
+            break;
+        case INST_EQ:
+            cvmc_binary(c, ip, "%s == %s");
+            break;
+        case INST_JMP:
+            cvmc_goto(c, ip, inst.operand, "    ");
+            break;
+        case INST_JMP_IF:
+            cvmc_need(c, ip, 1, 0);
+            fprintf(out, "    if(%s){\n", top);
+            if(!c->verified){
+                fprintf(out, "        sp -= 1;\n");
+            }
+            cvmc_goto(c, ip, inst.operand, "        ");
+            fprintf(out, "    }\n");
+            break;
+        case INST_HALT:
+            if(c->verified){
+                char depth[48];
+                cvmc_depth(depth, sizeof(depth), c, ip, 0);
+                fprintf(out, "    sp = %s;\n", depth);
+            }
+            fprintf(out, "    ip = %lld;\n    cvm->halt = 1;\n    goto done;\n", (long long) ip);
+            break;
+        case INST_PRINT_DEBUG:
+            cvmc_need(c, ip, 1, 0);
+            fprintf(out, "    cvm_output_word(cvm, %s);\n", top);
+            cvmc_move(c, -1);
+            break;
+        case INST_LOAD:
+            cvmc_need(c, ip, 1, 0);
+            fprintf(out, "    if(!cvm_memory_range_ok(cvm, %s, sizeof(Word))) ", top);
+            cvmc_fail(c, ip, "ERROR_ILLEGAL_MEMORY_ACCESS");
+            fprintf(out, "    memcpy(&%s, cvm_memory(cvm) + %s, sizeof(Word));\n", top, top);
+            break;
+        case INST_STORE:
+            cvmc_need(c, ip, 2, 0);
+            fprintf(out, "    if(!cvm_memory_range_ok(cvm, %s, sizeof(Word))) ", second);
+            cvmc_fail(c, ip, "ERROR_ILLEGAL_MEMORY_ACCESS");
+            fprintf(out, "    memcpy(cvm_memory(cvm) + %s, &%s, sizeof(Word));\n", second, top);
+            fprintf(out, "    cvm_memory_touch(cvm, %s, sizeof(Word));\n", second);
+            cvmc_move(c, -2);
+            break;
+        case INST_MEMCPY:
+            cvmc_need(c, ip, 3, 0);
+            fprintf(out, "    if(!cvm_memory_range_ok(cvm, %s, %s) || !cvm_memory_range_ok(cvm, %s, %s)) ", third, top, second, top);
+            cvmc_fail(c, ip, "ERROR_ILLEGAL_MEMORY_ACCESS");
+            fprintf(out, "    memory = cvm_memory(cvm);\n");
+            fprintf(out, "    memmove(memory + %s, memory + %s, %s);\n", third, second, top);
+            fprintf(out, "    cvm_memory_touch(cvm, %s, %s);\n", third, top);
+            cvmc_move(c, -3);
+            break;
+        case INST_MEMSET:
+            cvmc_need(c, ip, 3, 0);
+            fprintf(out, "    if(!cvm_memory_range_ok(cvm, %s, %s)) ", third, top);
+            cvmc_fail(c, ip, "ERROR_ILLEGAL_MEMORY_ACCESS");
+            fprintf(out, "    memset(cvm_memory(cvm) + %s, (unsigned char) %s, %s);\n", third, second, top);
+            fprintf(out, "    cvm_memory_touch(cvm, %s, %s);\n", third, top);
+            cvmc_move(c, -3);
+            break;
+        case INST_ALLOC:
+            cvmc_need(c, ip, 1, 0);
+            fprintf(out, "    if(%s < 0) ", top);
+            cvmc_fail(c, ip, "ERROR_ILLEGAL_OPERAND");
+            fprintf(out, "    address = (cvm->arena + sizeof(Word) - 1) & ~(sizeof(Word) - 1);\n");
+            fprintf(out, "    if(address > cvm->memory_size || (uint64_t) %s > cvm->memory_size - address) ", top);
+            cvmc_fail(c, ip, "ERROR_OUT_OF_MEMORY");
+            fprintf(out, "    cvm->arena = address + (size_t) %s;\n", top);
+            fprintf(out, "    %s = (Word) address;\n", top);
+            break;
+        case INST_RESET:
+            fprintf(out, "    cvm->arena = 0;\n");
+            break;
+        case INST_NATIVE: {
+            // The registry is fixed once cvm.c is compiled in, so the native is
+            // resolved here; a run always sees the same one.
+            const Cvm_Native *native = cvm_native_at(inst.operand);
+            if(native == NULL){
+                cvmc_fail(c, ip, "ERROR_ILLEGAL_OPERAND");
+                break;
+            }
+            Word grow = native->results > native->arity ? native->results - native->arity : 0;
+            cvmc_need(c, ip, native->arity, grow);
+            char frame[64];
+            cvmc_slot(frame, sizeof(frame), c, ip, native->arity);
+            fprintf(out, "    error = cvm_native_at(%lld)->fn(cvm, &%s);\n", (long long) inst.operand, frame);
+            fprintf(out, "    if(error != ERROR_OK) ");
+            cvmc_fail(c, ip, "error");
+            cvmc_move(c, native->results - native->arity);
+            break;
+        }
+        case INST_CALL:
+            fprintf(out, "    if(rsp >= cvm->return_stack_capacity && !cvm_return_stack_reserve(cvm, rsp + 1)) ");
+            cvmc_fail(c, ip, "ERROR_RETURN_STACK_OVERFLOW");
+            fprintf(out, "    cvm->return_stack[rsp++] = %lld;\n", (long long) ip + 1);
+            // The routine's depths count from here.
+            if(c->verified && c->program->routine[ip] < 0){
+                fprintf(out, "    fp = %lld;\n", (long long) c->program->stack_depth[ip]);
+            }
+            else if(c->verified && c->program->stack_depth[ip] != 0){
+                fprintf(out, "    fp += %lld;\n", (long long) c->program->stack_depth[ip]);
+            }
+            cvmc_goto(c, ip, inst.operand, "    ");
+            break;
+        case INST_RET: {
+            fprintf(out, "    if(rsp < 1) ");
+            cvmc_fail(c, ip, "ERROR_RETURN_STACK_UNDERFLOW");
+            fprintf(out, "    switch(cvm->return_stack[--rsp]){\n");
+            // Only calls push return addresses, so these are all there can be. A
+            // verified routine only returns past its own calls, back to the
+            // caller's fp.
+            for(Word i = 0; i < c->program->size; i++){
+                Word point = i + 1;
+                if(c->program->inst[i].type != INST_CALL){
+                    continue;
+                }
+                if(!c->verified){
+                    fprintf(out, "        case %lld: goto ip_%lld;\n", (long long) point, (long long) point);
+                    continue;
+                }
+                if(c->program->inst[i].operand != c->program->routine[ip]
+                   || c->program->stack_depth[i] == CVM_DEPTH_UNREACHABLE){
+                    continue;
+                }
+                fprintf(out, "        case %lld: fp -= %lld; goto ip_%lld;\n", (long long) point,
+                        (long long) c->program->stack_depth[i], (long long) point);
+            }
+            fprintf(out, "        default: ");
+            cvmc_fail(c, ip, "ERROR_ILLEGAL_INST_ACCESS");
+            fprintf(out, "    }\n");
+            break;
+        }
+        case INST_YIELD:
+            // A translated program is the only one in its process; like cvmi, it
+            // just carries on.
+            break;
+        case INST_PLUS_IMM:
+        case INST_PUSH2:
+        case INST_JMP_IF_EQ:
+        default:
+            cvmc_fail(c, ip, "ERROR_ILLEGAL_INST");
+            break;
+    }
+}
+
+static int cvmc_falls_through(Inst_Type type){
+    return type != INST_JMP && type != INST_HALT && type != INST_CALL && type != INST_RET;
+}
+
+void cvmc_translate(FILE *out, const Cvm_Program *program, const char *input_path, size_t stack_capacity, size_t memory_size){
+    Word size = program->size;
+    char *labels = cvm_calloc((size_t) size + 1, 1);
+    if(labels == NULL){
+        cvm_fail("Out of memory : %s\n", strerror(errno));
+    }
+    for(Word i = 0; i < size; i++){
+        Inst inst = program->inst[i];
+        if(inst.type == INST_JMP || inst.type == INST_JMP_IF || inst.type == INST_CALL){
+            if(inst.operand >= 0 && inst.operand <= size){
+                labels[inst.operand] = 1;
+            }
+        }
+        if(inst.type == INST_CALL){
+            labels[i + 1] = 1;
+        }
+    }
+
+    Cvmc c = {
+        .out = out,
+        .program = program,
+        .verified = program->verified && (size_t) program->max_stack_depth <= stack_capacity,
+    };
+
+    fprintf(out, "// Generated by cvmc from %s. Build with\n", input_path);
+    fprintf(out, "//     cc -O2 -I<directory of cvm.c> -o <program> <this file> -lpthread\n");
+    fprintf(out, "#include \"cvm.c\"\n\n");
+    fprintf(out, "#define CVMC_STACK_CAPACITY %zu\n", stack_capacity);
+    fprintf(out, "#define CVMC_MEMORY_SIZE %zu\n\n", memory_size);
+    fprintf(out, "#define CVMC_FAIL(at, depth, e) do{ ip = (at); sp = (depth); error = (e); goto done; }while(0)\n");
+    fprintf(out, "#define CVMC_GROW(at, n) do{ \\\n");
+    fprintf(out, "        if(!cvm_stack_reserve(cvm, sp + (n))) CVMC_FAIL(at, sp, ERROR_STACK_OVERFLOW); \\\n");
+    fprintf(out, "        stack = cvm->stack; capacity = cvm->stack_capacity; \\\n");
+    fprintf(out, "    }while(0)\n\n");
+    fprintf(out, "static Error cvmc_run(Cvm *cvm){\n");
+    if(c.verified){
+        fprintf(out, "    // Verified: %lld words deep at most.\n", (long long) program->max_stack_depth);
+        fprintf(out, "    Word s[%lld] = {0};\n", (long long) (program->max_stack_depth > 0 ? program->max_stack_depth : 1));
+        fprintf(out, "    Word fp = 0;\n");
+        fprintf(out, "    (void) fp;\n");
+    }
+    else{
+        fprintf(out, "    Word *stack = cvm->stack;\n");
+        fprintf(out, "    Word capacity = cvm->stack_capacity;\n");
+        fprintf(out, "    (void) capacity;\n");
+    }
+    fprintf(out, "    Word sp = 0;\n");
+    fprintf(out, "    Word ip = 0;\n");
+    fprintf(out, "    Word rsp = 0;\n");
+    fprintf(out, "    size_t address = 0;\n");
+    fprintf(out, "    char *memory = NULL;\n");
+    fprintf(out, "    Error error = ERROR_OK;\n");
+    fprintf(out, "    (void) address;\n");
+    fprintf(out, "    (void) memory;\n");
+    fprintf(out, "\n");
+
+    for(Word i = 0; i < size; i++){
+        if(labels[i]){
+            fprintf(out, "ip_%lld:\n", (long long) i);
+        }
+        fprintf(out, "    // %s %lld\n", inst_type_as_sctr(program->inst[i].type), (long long) program->inst[i].operand);
+        if(c.verified && program->stack_depth[i] == CVM_DEPTH_UNREACHABLE){
+            // Unreachable; only here for the labels.
+            cvmc_fail(&c, i, "ERROR_ILLEGAL_INST");
+            continue;
+        }
+        cvmc_inst(&c, i);
+    }
+    // Running off the end, or returning to just past it.
+    if(labels[size] || size == 0 || cvmc_falls_through(program->inst[size - 1].type)){
+        fprintf(out, "ip_%lld:\n", (long long) size);
+        fprintf(out, "    CVMC_FAIL(%lld, sp, ERROR_ILLEGAL_INST_ACCESS);\n", (long long) size);
+    }
+    fprintf(out, "\ndone:\n");
+    if(c.verified){
+        // Proven to fit under the limit, so the reserve cannot fail.
+        fprintf(out, "    cvm_stack_reserve(cvm, sp);\n");
+        fprintf(out, "    memcpy(cvm->stack, s, sizeof(Word) * (size_t) sp);\n");
+    }
+    fprintf(out, "    cvm->stack_size = sp;\n");
+    fprintf(out, "    cvm->ip = ip;\n");
+    fprintf(out, "    cvm->return_stack_size = rsp;\n");
+    fprintf(out, "    cvm_output_flush(cvm);\n");
+    fprintf(out, "    return error;\n");
+    fprintf(out, "}\n\n");
+
+    fprintf(out, "int main(int argc, char *argv[]){\n");
+    fprintf(out, "    Cvm_Output_Mode output_mode = CVM_OUTPUT_TEXT;\n");
+    fprintf(out, "    for(int i = 1; i < argc; i++){\n");
+    fprintf(out, "        if(strcmp(argv[i], \"-B\") != 0){\n");
+    fprintf(out, "            fprintf(stderr, \"Usage: %%s [-B]\\n\", argv[0]);\n");
+    fprintf(out, "            fprintf(stderr, \"ERROR: Unknown flag '%%s'\\n\", argv[i]);\n");
+    fprintf(out, "            return 1;\n");
+    fprintf(out, "        }\n");
+    fprintf(out, "        output_mode = CVM_OUTPUT_BINARY;\n");
+    fprintf(out, "    }\n\n");
+    fprintf(out, "    static Cvm cvm = {0};\n");
+    fprintf(out, "    cvm_init(&cvm, CVMC_STACK_CAPACITY);\n");
+    fprintf(out, "    if(CVMC_MEMORY_SIZE != CVM_MEMORY_CAPACITY){\n");
+    fprintf(out, "        cvm_set_memory(&cvm, CVMC_MEMORY_SIZE);\n");
+    fprintf(out, "    }\n");
+    fprintf(out, "    cvm_set_output(&cvm, STDOUT_FILENO, output_mode);\n\n");
+    fprintf(out, "    Error error = cvmc_run(&cvm);\n");
+    fprintf(out, "    if(error != ERROR_OK){\n");
+    fprintf(out, "        fprintf(stderr, \"ERROR: %%s\\n\", error_as_cstr(error));\n");
+    fprintf(out, "        return 1;\n");
+    fprintf(out, "    }\n\n");
+    fprintf(out, "    cvm_dump_stack(output_mode == CVM_OUTPUT_BINARY ? stderr : stdout, &cvm);\n");
+    fprintf(out, "    return 0;\n");
+    fprintf(out, "}\n");
+
+    cvm_free(labels);
+}
+
+int main(int argc, char *argv[]){
+    const char *program_name = argv[0];
+    const char *input_file_path = NULL;
+    const char *output_file_path = NULL;
+    size_t stack_capacity = CVM_STACK_CAPACITY;
+    size_t memory_size = CVM_MEMORY_CAPACITY;
+
+    for(int i = 1; i < argc; i++){
+        long value;
+        if(strcmp(argv[i], "-S") == 0 && i + 1 < argc){
+            if(!cvm_long_from_cstr(argv[++i], 1, CVM_STACK_CAPACITY_MAX, &value)){
+                fprintf(stderr, "ERROR: -S takes a number from 1 to %ld, not '%s'\n", CVM_STACK_CAPACITY_MAX, argv[i]);
+                exit(1);
+            }
+            stack_capacity = (size_t) value;
+        }
+        else if(strcmp(argv[i], "-M") == 0 && i + 1 < argc){
+            if(!cvm_long_from_cstr(argv[++i], 1, CVM_MEMORY_CAPACITY_MAX, &value)){
+                fprintf(stderr, "ERROR: -M takes a number from 1 to %ld, not '%s'\n", CVM_MEMORY_CAPACITY_MAX, argv[i]);
+                exit(1);
+            }
+            memory_size = (size_t) value;
+        }
+        else if(argv[i][0] != '-' && input_file_path == NULL){
+            input_file_path = argv[i];
+        }
+        else if(argv[i][0] != '-' && output_file_path == NULL){
+            output_file_path = argv[i];
+        }
+        else{
+            input_file_path = NULL;
+            break;
+        }
+    }
+    if(input_file_path == NULL || output_file_path == NULL){
+        fprintf(stderr, "Usage: %s <program.cvm> <output.c> [-S stack] [-M memory]\n", program_name);
+        fprintf(stderr, "    -S  stack capacity in words the program runs with (default %d)\n", CVM_STACK_CAPACITY);
+        fprintf(stderr, "    -M  linear memory size in bytes (default %d)\n", CVM_MEMORY_CAPACITY);
+        exit(1);
+    }
+
+    Cvm_Program loaded = {0};
+    cvm_load_program_from_file(&loaded, input_file_path);
+
+    // Without a limit a fused instruction does exactly what its sequence does, and
+    // the sequence is still in place after it, so only the heads are translated.
+    Inst *plain = cvm_malloc(sizeof(Inst) * (loaded.size > 0 ? (size_t) loaded.size : 1));
+    if(plain == NULL){
+        cvm_fail("Out of memory : %s\n", strerror(errno));
+    }
+    for(Word i = 0; i < loaded.size; i++){
+        plain[i] = inst_fused_head(loaded.inst[i]);
+    }
+    cvm_load_program_from_memory(&program, plain, (size_t) loaded.size);
+    cvm_free(plain);
+    cvm_program_destroy(&loaded);
+
+    Cvm_Verify_Diag diag;
+    if(!cvm_verify_program(&program, &diag)){
+        fprintf(stderr, "%s: keeping every check, ", input_file_path);
+        cvm_verify_diag_print(stderr, &program, &diag);
+    }
+
+    FILE *out = fopen(output_file_path, "w");
+    if(out == NULL){
+        fprintf(stderr, "ERROR: Could not open file '%s': %s\n", output_file_path, strerror(errno));
+        exit(1);
+    }
+    cvmc_translate(out, &program, input_file_path, stack_capacity, memory_size);
+    if(fclose(out) != 0){
+        fprintf(stderr, "ERROR: Could not write file '%s': %s\n", output_file_path, strerror(errno));
+        exit(1);
+    }
+    return 0;
+}
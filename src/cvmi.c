@@ -2,6 +2,15 @@
 
 Cvm cvm = {0};
 
+#define MAX_PROGRAM_FILES 256
+#define PROFILE_HOT_IPS 20
+#define DEFAULT_SLICE 10000
+
+typedef struct {
+    Word *words;
+    size_t count;
+} Input;
+
 char *shift_args(int *argc, char ***argv, int shift){
     assert(*argc >= shift && *argc > 0);
     char *result = **argv;
@@ -11,32 +20,332 @@ char *shift_args(int *argc, char ***argv, int shift){
 }
 
 void usage(FILE *stream, const char *program_name){
-    fprintf(stream, "Usage: %s <program.cvm> [-l limit] [-h]\n", program_name);
+    fprintf(stream, "Usage: %s <program.cvm>... [-l limit] [-e auto|switch|threaded|jit|tos|trace] [-S stack] [-M memory] [-b inputs] [--lanes n] [-j threads] [-B] [-s] [-n] [--profile] [--profile-out file] [--snapshot file] [--snapshot-out file] [--sched rr|priority] [--slice fuel] [--priority p] [-h]\n", program_name);
+    fprintf(stream, "       %s --serve <socket|-> [-e engine] [-S stack] [-M memory] [-j threads] [-s] [-n]\n", program_name);
+    fprintf(stream, "    -e  auto (default) runs verified programs on the unchecked engine and the rest on\n");
+    fprintf(stream, "        %s; any other engine runs every program, verified or not\n", cvm_engine_as_cstr(CVM_AUTO_ENGINE));
+    fprintf(stream, "    -S  stack limit in words; stacks start small and grow up to it (default %d)\n", CVM_STACK_CAPACITY);
+    fprintf(stream, "    -M  linear memory size in bytes (default %d)\n", CVM_MEMORY_CAPACITY);
+    fprintf(stream, "    -b  run every program once per line of inputs, each line an initial stack\n");
+    fprintf(stream, "    --lanes  run -b inputs through each program in lockstep, 4, 8 or 16 at a time;\n");
+    fprintf(stream, "             for many inputs to a short, branch-light program; final stacks are\n");
+    fprintf(stream, "             as without it, but print_debug output of different inputs comes out\n");
+    fprintf(stream, "             in the order they finish, even with -j 1\n");
+    fprintf(stream, "    -j  worker threads for batch runs (default: one per online CPU)\n");
+    fprintf(stream, "    -B  print_debug writes raw native-endian words; the final stack goes to stderr\n");
+    fprintf(stream, "    --profile      count and time every instruction on the checked interpreter,\n");
+    fprintf(stream, "                   print a report to stderr and save the counts for decvmasm -p\n");
+    fprintf(stream, "    --profile-out  where to save the counts (default cvm.prof)\n");
+    fprintf(stream, "    --snapshot      start from a saved state instead of a program file; with -b\n");
+    fprintf(stream, "                    every input is pushed on top of the saved stack\n");
+    fprintf(stream, "    --snapshot-out  save the state after the run, e.g. one stopped by -l\n");
+    fprintf(stream, "    --sched     run every program and input as its own context, switching between\n");
+    fprintf(stream, "                them every --slice instructions and on yield; -l caps each context\n");
+    fprintf(stream, "    --slice     fuel per time slice (default %d)\n", DEFAULT_SLICE);
+    fprintf(stream, "    --priority  share of its worker, 0 to %d, for the program files after it\n", CVM_SCHED_MAX_PRIORITY);
+    fprintf(stream, "    --serve  stay resident and run programs on request, over a Unix domain socket\n");
+    fprintf(stream, "             served by -j workers, or over stdin and stdout for '-'; programs are\n");
+    fprintf(stream, "             cached until their file changes, see cvm_serve_stream for the protocol\n");
+    fprintf(stream, "    -s  strict: refuse to run programs that fail verification\n");
+    fprintf(stream, "    -n  skip verification and always run on the checked engine\n");
 }
 
-int main(int argc, char *argv[]){
+// The value of a numeric flag, or a usage error when it is not a whole number
+// from min to max.
+long flag_number(const char *program_name, const char *flag, const char *text, long min, long max){
+    long value;
+    if(!cvm_long_from_cstr(text, min, max, &value)){
+        usage(stderr, program_name);
+        fprintf(stderr, "ERROR: %s takes a number from %ld to %ld, not '%s'\n", flag, min, max, text);
+        exit(1);
+    }
+    return value;
+}
 
-    int program_limit = -1;
-    const char *program_file = NULL;
-    const char *program_name = shift_args(&argc, &argv, 1);
+// Every line of the file is one input: whitespace separated words pushed bottom
+// first. An empty line is a run on an empty stack.
+Input *load_inputs(const char *file_path, size_t *input_count){
+    String_view source = slurp_file(file_path);
+    size_t capacity = 16;
+    Input *inputs = malloc(sizeof(Input) * capacity);
+    if(inputs == NULL){
+        fprintf(stderr, "ERROR: Out of memory : %s\n", strerror(errno));
+        exit(1);
+    }
+    *input_count = 0;
 
-    if(argc < 1){
-        usage(stderr, program_name);
-        fprintf(stderr, "ERROR: No program file provided\n");
+    size_t line_number = 0;
+    while(source.count > 0){
+        String_view line = string_view_chop_by_delim(&source, '\n');
+        line_number += 1;
+
+        Input input = {
+            .words = malloc(sizeof(Word) * (line.count / 2 + 1)),
+            .count = 0,
+        };
+        if(input.words == NULL){
+            fprintf(stderr, "ERROR: Out of memory : %s\n", strerror(errno));
+            exit(1);
+        }
+        line = string_view_trim(line);
+        while(line.count > 0){
+            String_view word = string_view_chop_by_delim(&line, ' ');
+            char buffer[32];
+            if(word.count == 0 || word.count >= sizeof(buffer)){
+                fprintf(stderr, "ERROR: %s:%zu: Invalid input word '%.*s'\n", file_path, line_number, (int) word.count, word.data);
+                exit(1);
+            }
+            memcpy(buffer, word.data, word.count);
+            buffer[word.count] = '\0';
+            char *end;
+            errno = 0;
+            long long value = strtoll(buffer, &end, 10);
+            if(*end != '\0' || errno != 0){
+                fprintf(stderr, "ERROR: %s:%zu: Invalid input word '%s'\n", file_path, line_number, buffer);
+                exit(1);
+            }
+            input.words[input.count++] = value;
+            line = string_view_trim_left(line);
+        }
+
+        if(*input_count >= capacity){
+            capacity *= 2;
+            inputs = realloc(inputs, sizeof(Input) * capacity);
+            if(inputs == NULL){
+                fprintf(stderr, "ERROR: Out of memory : %s\n", strerror(errno));
+                exit(1);
+            }
+        }
+        inputs[(*input_count)++] = input;
+    }
+    return inputs;
+}
+
+// Every program against every input as a context of its own, all of them alive
+// at once and time-sliced by cvm_run_scheduler, reported like a batch plus what
+// each context used.
+int run_scheduled(Cvm_Program *programs, const char **program_files, const int *program_priorities, size_t program_count,
+                  Cvm_Snapshot *snapshot, const Input *inputs, size_t input_count, int have_inputs,
+                  int limit, size_t stack_capacity, size_t memory_size, Cvm_Output_Mode output_mode,
+                  size_t thread_count, int slice, Cvm_Sched_Policy policy, Cvm_Engine engine){
+    size_t task_count = program_count * input_count;
+    Cvm_Task *tasks = calloc(task_count > 0 ? task_count : 1, sizeof(Cvm_Task));
+    if(tasks == NULL){
+        fprintf(stderr, "ERROR: Out of memory : %s\n", strerror(errno));
         exit(1);
     }
+    for(size_t t = 0; t < task_count; t++){
+        Cvm_Task *task = &tasks[t];
+        const Input *input = &inputs[t % input_count];
+        cvm_task_init(task, &programs[t / input_count], stack_capacity, memory_size, output_mode);
+        task->priority = program_priorities[t / input_count];
+        task->limit = limit;
+        if(snapshot != NULL){
+            task->error = cvm_restore_snapshot(&task->cvm, snapshot);
+        }
+        if(task->error == ERROR_OK
+           && (input->count > (size_t) (task->cvm.stack_limit - task->cvm.stack_size)
+               || !cvm_stack_reserve(&task->cvm, task->cvm.stack_size + (Word) input->count))){
+            task->error = ERROR_STACK_OVERFLOW;
+        }
+        if(task->error != ERROR_OK){
+            // Never runs: a limit of 0 keeps it off the run queues.
+            task->limit = 0;
+            continue;
+        }
+        if(input->count > 0){
+            memcpy(task->cvm.stack + task->cvm.stack_size, input->words, sizeof(Word) * input->count);
+        }
+        task->cvm.stack_size += input->count;
+    }
+
+    cvm_run_scheduler(tasks, task_count, thread_count, slice, policy, engine);
+
+    FILE *report = output_mode == CVM_OUTPUT_BINARY ? stderr : stdout;
+    int failed = 0;
+    for(size_t t = 0; t < task_count; t++){
+        Cvm_Task *task = &tasks[t];
+        fprintf(report, "== %s", program_files[t / input_count]);
+        if(have_inputs){
+            fprintf(report, " [input %zu]", t % input_count + 1);
+        }
+        fprintf(report, " ==\n");
+        Cvm_Stats stats;
+        cvm_stats(&task->cvm, &stats);
+        fprintf(report, "Retired %llu instructions in %llu slices, %llu yields, %zu bytes of context\n",
+                (unsigned long long) task->retired, (unsigned long long) task->slices, (unsigned long long) task->yields,
+                stats.total);
+        if(task->error != ERROR_OK){
+            fprintf(report, "ERROR: %s\n\n", error_as_cstr(task->error));
+            failed = 1;
+        }
+        else{
+            cvm_dump_stack(report, &task->cvm);
+        }
+        cvm_task_destroy(task);
+    }
+    free(tasks);
+    return failed;
+}
+
+int main(int argc, char *argv[]){
 
-    program_file = shift_args(&argc, &argv, 1);
+    int program_limit = -1;
+    Cvm_Engine engine = CVM_DEFAULT_ENGINE;
+    size_t stack_capacity = CVM_STACK_CAPACITY;
+    size_t memory_size = CVM_MEMORY_CAPACITY;
+    int verify = 1;
+    int strict = 0;
+    const char *inputs_file = NULL;
+    long thread_count = sysconf(_SC_NPROCESSORS_ONLN);
+    const char *program_files[MAX_PROGRAM_FILES];
+    int program_priorities[MAX_PROGRAM_FILES];
+    size_t program_file_count = 0;
+    size_t lanes = 1;
+    int sched = 0;
+    Cvm_Sched_Policy sched_policy = CVM_SCHED_ROUND_ROBIN;
+    int slice = DEFAULT_SLICE;
+    int priority = 0;
+    int profile = 0;
+    Cvm_Output_Mode output_mode = CVM_OUTPUT_TEXT;
+    const char *profile_file = "cvm.prof";
+    const char *snapshot_file = NULL;
+    const char *snapshot_out = NULL;
+    const char *serve = NULL;
+    const char *program_name = shift_args(&argc, &argv, 1);
 
     while(argc > 0){
         const char *flag = shift_args(&argc, &argv, 1);
-        if(strcmp(flag, "-l") == 0){
+        if(flag[0] != '-'){
+            if(program_file_count >= MAX_PROGRAM_FILES){
+                fprintf(stderr, "ERROR: Too many program files, at most %d\n", MAX_PROGRAM_FILES);
+                exit(1);
+            }
+            program_priorities[program_file_count] = priority;
+            program_files[program_file_count++] = flag;
+        }else if(strcmp(flag, "-l") == 0){
             if(argc < 1){
                 usage(stderr, program_name);
                 fprintf(stderr, "ERROR: No limit provided\n");
                 exit(1);
             }
-            program_limit = atoi(shift_args(&argc, &argv, 1));
+            program_limit = (int) flag_number(program_name, flag, shift_args(&argc, &argv, 1), -1, INT_MAX);
+        }else if(strcmp(flag, "-e") == 0){
+            if(argc < 1){
+                usage(stderr, program_name);
+                fprintf(stderr, "ERROR: No engine provided\n");
+                exit(1);
+            }
+            const char *engine_name = shift_args(&argc, &argv, 1);
+            if(!cvm_engine_from_cstr(engine_name, &engine)){
+                usage(stderr, program_name);
+                fprintf(stderr, "ERROR: Unknown engine '%s'\n", engine_name);
+                exit(1);
+            }
+        }else if(strcmp(flag, "-S") == 0){
+            if(argc < 1){
+                usage(stderr, program_name);
+                fprintf(stderr, "ERROR: No stack capacity provided\n");
+                exit(1);
+            }
+            stack_capacity = (size_t) flag_number(program_name, flag, shift_args(&argc, &argv, 1), 1, CVM_STACK_CAPACITY_MAX);
+        }else if(strcmp(flag, "-M") == 0){
+            if(argc < 1){
+                usage(stderr, program_name);
+                fprintf(stderr, "ERROR: No memory size provided\n");
+                exit(1);
+            }
+            memory_size = (size_t) flag_number(program_name, flag, shift_args(&argc, &argv, 1), 1, CVM_MEMORY_CAPACITY_MAX);
+        }else if(strcmp(flag, "-b") == 0){
+            if(argc < 1){
+                usage(stderr, program_name);
+                fprintf(stderr, "ERROR: No inputs file provided\n");
+                exit(1);
+            }
+            inputs_file = shift_args(&argc, &argv, 1);
+        }else if(strcmp(flag, "--lanes") == 0){
+            if(argc < 1){
+                usage(stderr, program_name);
+                fprintf(stderr, "ERROR: No lane count provided\n");
+                exit(1);
+            }
+            lanes = (size_t) flag_number(program_name, flag, shift_args(&argc, &argv, 1), 4, 16);
+            if(lanes != 4 && lanes != 8 && lanes != 16){
+                usage(stderr, program_name);
+                fprintf(stderr, "ERROR: Lane count must be 4, 8 or 16\n");
+                exit(1);
+            }
+        }else if(strcmp(flag, "-j") == 0){
+            if(argc < 1){
+                usage(stderr, program_name);
+                fprintf(stderr, "ERROR: No thread count provided\n");
+                exit(1);
+            }
+            thread_count = flag_number(program_name, flag, shift_args(&argc, &argv, 1), 1, INT_MAX);
+        }else if(strcmp(flag, "-B") == 0){
+            output_mode = CVM_OUTPUT_BINARY;
+        }else if(strcmp(flag, "--profile") == 0){
+            profile = 1;
+        }else if(strcmp(flag, "--profile-out") == 0){
+            if(argc < 1){
+                usage(stderr, program_name);
+                fprintf(stderr, "ERROR: No profile file provided\n");
+                exit(1);
+            }
+            profile_file = shift_args(&argc, &argv, 1);
+            profile = 1;
+        }else if(strcmp(flag, "--snapshot") == 0){
+            if(argc < 1){
+                usage(stderr, program_name);
+                fprintf(stderr, "ERROR: No snapshot file provided\n");
+                exit(1);
+            }
+            snapshot_file = shift_args(&argc, &argv, 1);
+        }else if(strcmp(flag, "--snapshot-out") == 0){
+            if(argc < 1){
+                usage(stderr, program_name);
+                fprintf(stderr, "ERROR: No snapshot file provided\n");
+                exit(1);
+            }
+            snapshot_out = shift_args(&argc, &argv, 1);
+        }else if(strcmp(flag, "--sched") == 0){
+            if(argc < 1){
+                usage(stderr, program_name);
+                fprintf(stderr, "ERROR: No scheduling policy provided\n");
+                exit(1);
+            }
+            const char *policy_name = shift_args(&argc, &argv, 1);
+            if(!cvm_sched_policy_from_cstr(policy_name, &sched_policy)){
+                usage(stderr, program_name);
+                fprintf(stderr, "ERROR: Unknown scheduling policy '%s'\n", policy_name);
+                exit(1);
+            }
+            sched = 1;
+        }else if(strcmp(flag, "--slice") == 0){
+            if(argc < 1){
+                usage(stderr, program_name);
+                fprintf(stderr, "ERROR: No slice provided\n");
+                exit(1);
+            }
+            slice = (int) flag_number(program_name, flag, shift_args(&argc, &argv, 1), 1, INT_MAX);
+        }else if(strcmp(flag, "--priority") == 0){
+            if(argc < 1){
+                usage(stderr, program_name);
+                fprintf(stderr, "ERROR: No priority provided\n");
+                exit(1);
+            }
+            priority = (int) flag_number(program_name, flag, shift_args(&argc, &argv, 1), 0, CVM_SCHED_MAX_PRIORITY);
+        }else if(strcmp(flag, "--serve") == 0){
+            if(argc < 1){
+                usage(stderr, program_name);
+                fprintf(stderr, "ERROR: No socket path provided\n");
+                exit(1);
+            }
+            serve = shift_args(&argc, &argv, 1);
+        }else if(strcmp(flag, "-s") == 0){
+            strict = 1;
+        }else if(strcmp(flag, "-n") == 0){
+            verify = 0;
         }else if(strcmp(flag, "-h") == 0){
             usage(stdout, program_name);
             exit(0);
@@ -48,15 +357,191 @@ int main(int argc, char *argv[]){
         }
     }
 
-    cvm_load_program_from_file(&cvm, program_file);
-    
-    Error error = cvm_execute_program(&cvm, program_limit);
+    if(strict && !verify){
+        usage(stderr, program_name);
+        fprintf(stderr, "ERROR: -s and -n are mutually exclusive\n");
+        exit(1);
+    }
 
-    if(error != ERROR_OK){
-        fprintf(stderr, "ERROR: %s\n", error_as_cstr(error));
-        return 1;
+    if(serve != NULL){
+        if(program_file_count > 0 || snapshot_file != NULL || snapshot_out != NULL || inputs_file != NULL || profile){
+            usage(stderr, program_name);
+            fprintf(stderr, "ERROR: --serve takes its programs from the requests\n");
+            exit(1);
+        }
+        Cvm_Server server;
+        cvm_server_init(&server, engine, stack_capacity, memory_size, verify, strict);
+        if(strcmp(serve, "-") == 0){
+            cvm_serve_stdio(&server);
+        }
+        else{
+            cvm_serve_socket(&server, serve, (size_t) thread_count);
+        }
+        return 0;
+    }
+
+    if(snapshot_file != NULL){
+        if(program_file_count > 0){
+            usage(stderr, program_name);
+            fprintf(stderr, "ERROR: --snapshot takes the place of the program files\n");
+            exit(1);
+        }
+        program_priorities[program_file_count] = priority;
+        program_files[program_file_count++] = snapshot_file;
+    }
+    if(program_file_count == 0){
+        usage(stderr, program_name);
+        fprintf(stderr, "ERROR: No program file provided\n");
+        exit(1);
     }
 
-    cvm_dump_stack(stdout, &cvm);
-    return 0;
-} 
\ No newline at end of file
+    if(lanes > 1 && (inputs_file == NULL || sched || profile)){
+        usage(stderr, program_name);
+        fprintf(stderr, "ERROR: --lanes runs -b inputs, without --sched or --profile\n");
+        exit(1);
+    }
+    if(profile && sched){
+        usage(stderr, program_name);
+        fprintf(stderr, "ERROR: --profile and --sched are mutually exclusive\n");
+        exit(1);
+    }
+    if(profile && (program_file_count > 1 || inputs_file != NULL)){
+        usage(stderr, program_name);
+        fprintf(stderr, "ERROR: --profile takes a single program and no batch inputs\n");
+        exit(1);
+    }
+    if(snapshot_out != NULL && (program_file_count > 1 || inputs_file != NULL || sched)){
+        usage(stderr, program_name);
+        fprintf(stderr, "ERROR: --snapshot-out takes a single program and no batch inputs\n");
+        exit(1);
+    }
+
+    Cvm_Program programs[MAX_PROGRAM_FILES] = {0};
+    Cvm_Snapshot snapshot = {0};
+    for(size_t i = 0; i < program_file_count; i++){
+        Cvm_Program *program = &programs[i];
+        if(snapshot_file != NULL){
+            cvm_load_snapshot(&snapshot, snapshot_file);
+            program = &snapshot.program;
+        }
+        else{
+            cvm_load_program_from_file(program, program_files[i]);
+        }
+        if(verify){
+            Cvm_Verify_Diag diag;
+            if(!cvm_verify_program(program, &diag) && strict){
+                fprintf(stderr, "%s: ", program_files[i]);
+                cvm_verify_diag_print(stderr, program, &diag);
+                exit(1);
+            }
+        }
+    }
+
+    if(program_file_count == 1 && inputs_file == NULL && !sched){
+        cvm_init(&cvm, stack_capacity);
+        if(memory_size != CVM_MEMORY_CAPACITY){
+            cvm_set_memory(&cvm, memory_size);
+        }
+        cvm_set_output(&cvm, STDOUT_FILENO, output_mode);
+
+        if(snapshot_file != NULL){
+            Error error = cvm_restore_snapshot(&cvm, &snapshot);
+            if(error != ERROR_OK){
+                fprintf(stderr, "ERROR: %s\n", error_as_cstr(error));
+                return 1;
+            }
+        }
+        else{
+            cvm_attach_program(&cvm, &programs[0]);
+        }
+
+        Error error;
+        if(profile){
+            Cvm_Profile prof;
+            cvm_profile_init(&prof, cvm.program_size);
+            error = cvm_execute_program_profiled(&cvm, program_limit, &prof);
+            cvm_profile_save(&prof, profile_file);
+            cvm_profile_report(stderr, &prof, cvm.image, PROFILE_HOT_IPS);
+            cvm_profile_destroy(&prof);
+        }
+        else{
+            error = cvm_execute_program_with(&cvm, program_limit, engine);
+        }
+
+        if(error != ERROR_OK){
+            fprintf(stderr, "ERROR: %s\n", error_as_cstr(error));
+            return 1;
+        }
+
+        if(snapshot_out != NULL){
+            cvm_save_snapshot(&cvm, snapshot_out);
+        }
+
+        cvm_dump_stack(output_mode == CVM_OUTPUT_BINARY ? stderr : stdout, &cvm);
+        return 0;
+    }
+
+    // Batch: every program against every input, run across the worker pool and
+    // reported in program-major input order.
+    Input no_input = {0};
+    Input *inputs = &no_input;
+    size_t input_count = 1;
+    if(inputs_file != NULL){
+        inputs = load_inputs(inputs_file, &input_count);
+    }
+
+    size_t job_count = program_file_count * input_count;
+    if(sched){
+        return run_scheduled(programs, program_files, program_priorities, program_file_count,
+                             snapshot_file != NULL ? &snapshot : NULL, inputs, input_count, inputs_file != NULL,
+                             program_limit, stack_capacity, memory_size, output_mode,
+                             (size_t) thread_count, slice, sched_policy, engine);
+    }
+    Cvm_Batch_Job *jobs = calloc(job_count > 0 ? job_count : 1, sizeof(Cvm_Batch_Job));
+    if(jobs == NULL){
+        fprintf(stderr, "ERROR: Out of memory : %s\n", strerror(errno));
+        exit(1);
+    }
+    for(size_t p = 0; p < program_file_count; p++){
+        for(size_t i = 0; i < input_count; i++){
+            jobs[p * input_count + i] = (Cvm_Batch_Job){
+                .program = &programs[p],
+                .snapshot = snapshot_file != NULL ? &snapshot : NULL,
+                .input = inputs[i].words,
+                .input_size = inputs[i].count,
+                .limit = program_limit,
+                .engine = engine,
+            };
+        }
+    }
+
+    if(lanes > 1){
+        cvm_run_lockstep(jobs, job_count, lanes, (size_t) thread_count, stack_capacity, memory_size, output_mode);
+    }
+    else{
+        cvm_run_batch(jobs, job_count, (size_t) thread_count, stack_capacity, memory_size, output_mode);
+    }
+
+    // In binary mode stdout carries only the words the programs printed.
+    FILE *report = output_mode == CVM_OUTPUT_BINARY ? stderr : stdout;
+    int failed = 0;
+    for(size_t j = 0; j < job_count; j++){
+        const Cvm_Batch_Job *job = &jobs[j];
+        fprintf(report, "== %s", program_files[j / input_count]);
+        if(inputs_file != NULL){
+            fprintf(report, " [input %zu]", j % input_count + 1);
+        }
+        fprintf(report, " ==\n");
+        if(job->error != ERROR_OK){
+            fprintf(report, "ERROR: %s\n\n", error_as_cstr(job->error));
+            failed = 1;
+            continue;
+        }
+        Cvm result = {
+            .stack = job->stack,
+            .stack_size = job->stack_size,
+        };
+        cvm_dump_stack(report, &result);
+    }
+    return failed;
+}
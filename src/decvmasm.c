@@ -1,20 +1,36 @@
 #include "./cvm.c"
 
-Cvm cvm = {0};
+Cvm_Program program = {0};
 
 int main(int argc, char *argv[]){
 
-    if(argc < 2){
-        fprintf(stderr, "Usage: %s <program.cvm>\n", argv[0]);
+    if(argc != 2 && !(argc == 4 && strcmp(argv[2], "-p") == 0)){
+        fprintf(stderr, "Usage: %s <program.cvm> [-p profile]\n", argv[0]);
+        fprintf(stderr, "    -p  prefix every instruction with its hit count from cvmi --profile\n");
         exit(1);
     }
 
     const char *input_file_path = argv[1];
 
-    cvm_load_program_from_file(&cvm, input_file_path);
+    cvm_load_program_from_file(&program, input_file_path);
 
-    for(Word i = 0; i < cvm.program_size; i++){
-        Inst inst = cvm.program[i];
+    Cvm_Profile profile = {0};
+    int annotate = argc == 4;
+    if(annotate){
+        cvm_profile_load(&profile, argv[3]);
+        if(profile.program_size != program.size){
+            fprintf(stderr, "ERROR: Profile '%s' is for a program of %lld instructions, not %lld\n",
+                    argv[3], (long long) profile.program_size, (long long) program.size);
+            exit(1);
+        }
+    }
+
+    for(Word i = 0; i < program.size; i++){
+        Inst inst = program.inst[i];
+        if(annotate){
+            printf("%12llu %6.2f%%  ", (unsigned long long) profile.ip_count[i],
+                    profile.total_count > 0 ? 100.0 * (double) profile.ip_count[i] / (double) profile.total_count : 0.0);
+        }
         switch(inst.type){
             case INST_NOP:
                 printf("NOP\n");
@@ -52,10 +68,70 @@ int main(int argc, char *argv[]){
             case INST_PRINT_DEBUG:
                 printf("PRINT_DEBUG\n");
                 break;
+            case INST_PLUS_IMM:
+                printf("PLUS_IMM %lld\n", (long long) inst.operand);
+                break;
+            case INST_PUSH2:
+                if(i + 1 < program.size){
+                    printf("PUSH2 %lld %lld\n", (long long) inst.operand, (long long) program.inst[i + 1].operand);
+                }
+                else{
+                    printf("PUSH2 %lld ?\n", (long long) inst.operand);
+                }
+                break;
+            case INST_JMP_IF_EQ:
+                if(i + 3 < program.size){
+                    printf("JMP_IF_EQ %lld %lld\n", (long long) inst.operand, (long long) program.inst[i + 3].operand);
+                }
+                else{
+                    printf("JMP_IF_EQ %lld ?\n", (long long) inst.operand);
+                }
+                break;
+            case INST_LOAD:
+                printf("LOAD\n");
+                break;
+            case INST_STORE:
+                printf("STORE\n");
+                break;
+            case INST_MEMCPY:
+                printf("MEMCPY\n");
+                break;
+            case INST_MEMSET:
+                printf("MEMSET\n");
+                break;
+            case INST_ALLOC:
+                printf("ALLOC\n");
+                break;
+            case INST_RESET:
+                printf("RESET\n");
+                break;
+            case INST_NATIVE: {
+                const Cvm_Native *native = cvm_native_at(inst.operand);
+                if(native != NULL){
+                    printf("NATIVE %s\n", native->name);
+                }
+                else{
+                    printf("NATIVE #%lld\n", (long long) inst.operand);
+                }
+                break;
+            }
+            case INST_CALL:
+                printf("CALL %lld\n", (long long) inst.operand);
+                break;
+            case INST_RET:
+                printf("RET\n");
+                break;
+            case INST_YIELD:
+                printf("YIELD\n");
+                break;
             default:
                 fprintf(stderr, "ERROR: Unknown instruction\n");
                 exit(1);
         }
+        if(annotate && (inst.type == INST_JMP_IF || inst.type == INST_JMP_IF_EQ) && profile.ip_count[i] > 0){
+            printf("%22s; taken %llu, not taken %llu\n", "",
+                    (unsigned long long) profile.taken[i], (unsigned long long) profile.not_taken[i]);
+        }
     }   
 
 
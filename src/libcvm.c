@@ -0,0 +1,522 @@
+// The API in cvm.h on top of cvm.c. Every call puts the env's allocator and a
+// failure handler in place for its own duration; a fatal error inside cvm.c then
+// lands in the handler, which keeps the message and longjmps back to the call,
+// and the call returns CVM_FAILED instead of the process exiting.
+#include "./cvm.c"
+
+#include <setjmp.h>
+
+_Static_assert((int) CVM_OK == (int) ERROR_OK, "Cvm_Status must mirror Error");
+_Static_assert((int) CVM_STACK_OVERFLOW == (int) ERROR_STACK_OVERFLOW, "Cvm_Status must mirror Error");
+_Static_assert((int) CVM_STACK_UNDERFLOW == (int) ERROR_STACK_UNDERFLOW, "Cvm_Status must mirror Error");
+_Static_assert((int) CVM_ILLEGAL_INST == (int) ERROR_ILLEGAL_INST, "Cvm_Status must mirror Error");
+_Static_assert((int) CVM_DIV_BY_ZERO == (int) ERROR_DIV_BY_ZERO, "Cvm_Status must mirror Error");
+_Static_assert((int) CVM_ILLEGAL_INST_ACCESS == (int) ERROR_ILLEGAL_INST_ACCESS, "Cvm_Status must mirror Error");
+_Static_assert((int) CVM_ILLEGAL_OPERAND == (int) ERROR_ILLEGAL_OPERAND, "Cvm_Status must mirror Error");
+_Static_assert((int) CVM_ILLEGAL_MEMORY_ACCESS == (int) ERROR_ILLEGAL_MEMORY_ACCESS, "Cvm_Status must mirror Error");
+_Static_assert((int) CVM_OUT_OF_MEMORY == (int) ERROR_OUT_OF_MEMORY, "Cvm_Status must mirror Error");
+_Static_assert((int) CVM_RETURN_STACK_OVERFLOW == (int) ERROR_RETURN_STACK_OVERFLOW, "Cvm_Status must mirror Error");
+_Static_assert((int) CVM_RETURN_STACK_UNDERFLOW == (int) ERROR_RETURN_STACK_UNDERFLOW, "Cvm_Status must mirror Error");
+_Static_assert((int) CVM_FAILED > (int) ERROR_OK_NO_INST, "Cvm_Status must not overlap Error");
+
+// Header in front of every block handed to cvm.c. All live blocks of an env are
+// on one list, so cvm_env_destroy reclaims everything, and each block remembers
+// the call that allocated it, so a constructor that fails can take back exactly
+// what it made.
+typedef union Cvm_Env_Block {
+    struct {
+        union Cvm_Env_Block *prev;
+        union Cvm_Env_Block *next;
+        uint64_t call;
+    } link;
+    max_align_t align;
+} Cvm_Env_Block;
+
+struct Cvm_Env {
+    Cvm_Allocator user;
+    Cvm_Allocator tracked;
+    Cvm_Env_Block blocks;
+    uint64_t calls;
+    uint64_t call;
+    jmp_buf *fail;
+    Cvm_Image *images;
+    Cvm_Context *contexts;
+    char error[512];
+};
+
+struct Cvm_Image {
+    Cvm_Env *env;
+    Cvm_Program program;
+    Cvm_Image *prev;
+    Cvm_Image *next;
+};
+
+struct Cvm_Context {
+    Cvm_Env *env;
+    Cvm cvm;
+    Cvm_Engine engine;
+    Cvm_Context *prev;
+    Cvm_Context *next;
+};
+
+static void *cvm_lib_libc_malloc(void *user, size_t size){
+    (void) user;
+    return malloc(size);
+}
+
+static void *cvm_lib_libc_realloc(void *user, void *ptr, size_t size){
+    (void) user;
+    return realloc(ptr, size);
+}
+
+static void cvm_lib_libc_free(void *user, void *ptr){
+    (void) user;
+    free(ptr);
+}
+
+static void cvm_lib_link(Cvm_Env *env, Cvm_Env_Block *block){
+    block->link.prev = &env->blocks;
+    block->link.next = env->blocks.link.next;
+    block->link.next->link.prev = block;
+    env->blocks.link.next = block;
+}
+
+static void cvm_lib_unlink(Cvm_Env_Block *block){
+    block->link.prev->link.next = block->link.next;
+    block->link.next->link.prev = block->link.prev;
+}
+
+static void *cvm_lib_malloc(void *user, size_t size){
+    Cvm_Env *env = user;
+    if(size > SIZE_MAX - sizeof(Cvm_Env_Block)){
+        return NULL;
+    }
+    Cvm_Env_Block *block = env->user.malloc(env->user.user, sizeof(Cvm_Env_Block) + size);
+    if(block == NULL){
+        return NULL;
+    }
+    block->link.call = env->call;
+    cvm_lib_link(env, block);
+    return block + 1;
+}
+
+static void *cvm_lib_realloc(void *user, void *ptr, size_t size){
+    Cvm_Env *env = user;
+    if(size > SIZE_MAX - sizeof(Cvm_Env_Block)){
+        return NULL;
+    }
+    Cvm_Env_Block *block = (Cvm_Env_Block *) ptr - 1;
+    cvm_lib_unlink(block);
+    Cvm_Env_Block *moved = env->user.realloc(env->user.user, block, sizeof(Cvm_Env_Block) + size);
+    if(moved == NULL){
+        cvm_lib_link(env, block);
+        return NULL;
+    }
+    cvm_lib_link(env, moved);
+    return moved + 1;
+}
+
+static void cvm_lib_free(void *user, void *ptr){
+    Cvm_Env *env = user;
+    Cvm_Env_Block *block = (Cvm_Env_Block *) ptr - 1;
+    cvm_lib_unlink(block);
+    env->user.free(env->user.user, block);
+}
+
+// Frees every block allocated by the given call that is still alive.
+static void cvm_lib_free_call(Cvm_Env *env, uint64_t call){
+    Cvm_Env_Block *block = env->blocks.link.next;
+    while(block != &env->blocks){
+        Cvm_Env_Block *next = block->link.next;
+        if(block->link.call == call){
+            cvm_lib_unlink(block);
+            env->user.free(env->user.user, block);
+        }
+        block = next;
+    }
+}
+
+static _Thread_local Cvm_Env *cvm_lib_env = NULL;
+
+static void cvm_lib_fail(const char *message){
+    Cvm_Env *env = cvm_lib_env;
+    size_t count = strlen(message);
+    while(count > 0 && message[count - 1] == '\n'){
+        count--;
+    }
+    if(count >= sizeof(env->error)){
+        count = sizeof(env->error) - 1;
+    }
+    memcpy(env->error, message, count);
+    env->error[count] = '\0';
+    longjmp(*env->fail, 1);
+}
+
+// The hooks of the calls this one runs inside of, if any, put back on leave.
+typedef struct {
+    Cvm_Env *env;
+    const Cvm_Allocator *allocator;
+    void (*fail_handler)(const char *message);
+    jmp_buf *fail;
+    uint64_t call;
+} Cvm_Lib_Call;
+
+static Cvm_Lib_Call cvm_lib_enter(Cvm_Env *env, jmp_buf *fail){
+    Cvm_Lib_Call outer = {
+        .env = cvm_lib_env,
+        .allocator = cvm_allocator,
+        .fail_handler = cvm_fail_handler,
+        .fail = env->fail,
+        .call = env->call,
+    };
+    cvm_lib_env = env;
+    cvm_allocator = &env->tracked;
+    cvm_fail_handler = cvm_lib_fail;
+    env->fail = fail;
+    env->call = ++env->calls;
+    return outer;
+}
+
+static void cvm_lib_leave(Cvm_Env *env, const Cvm_Lib_Call *outer){
+    cvm_lib_env = outer->env;
+    cvm_allocator = outer->allocator;
+    cvm_fail_handler = outer->fail_handler;
+    env->fail = outer->fail;
+    env->call = outer->call;
+}
+
+// Reports a failure detected in this file the same way cvm.c reports its own.
+#define CVM_LIB_FAIL(...) cvm_fail(__VA_ARGS__)
+
+Cvm_Status cvm_env_create(const Cvm_Allocator *allocator, Cvm_Env **env){
+    Cvm_Allocator user = {
+        .malloc = cvm_lib_libc_malloc,
+        .realloc = cvm_lib_libc_realloc,
+        .free = cvm_lib_libc_free,
+    };
+    if(allocator != NULL){
+        user = *allocator;
+    }
+    *env = user.malloc(user.user, sizeof(Cvm_Env));
+    if(*env == NULL){
+        return CVM_FAILED;
+    }
+    **env = (Cvm_Env){
+        .user = user,
+        .tracked = {
+            .malloc = cvm_lib_malloc,
+            .realloc = cvm_lib_realloc,
+            .free = cvm_lib_free,
+            .user = *env,
+        },
+    };
+    (*env)->blocks.link.prev = &(*env)->blocks;
+    (*env)->blocks.link.next = &(*env)->blocks;
+    return CVM_OK;
+}
+
+void cvm_env_destroy(Cvm_Env *env){
+    while(env->contexts != NULL){
+        cvm_context_destroy(env->contexts);
+    }
+    while(env->images != NULL){
+        cvm_image_destroy(env->images);
+    }
+    // Whatever failed calls left behind.
+    Cvm_Env_Block *block = env->blocks.link.next;
+    while(block != &env->blocks){
+        Cvm_Env_Block *next = block->link.next;
+        env->user.free(env->user.user, block);
+        block = next;
+    }
+    Cvm_Allocator user = env->user;
+    user.free(user.user, env);
+}
+
+const char *cvm_env_error(const Cvm_Env *env){
+    return env->error;
+}
+
+static Cvm_Image *cvm_lib_image_new(Cvm_Env *env){
+    Cvm_Image *image = cvm_malloc(sizeof(Cvm_Image));
+    if(image == NULL){
+        CVM_LIB_FAIL("Out of memory\n");
+    }
+    *image = (Cvm_Image){ .env = env };
+    return image;
+}
+
+static void cvm_lib_image_publish(Cvm_Env *env, Cvm_Image *image){
+    image->next = env->images;
+    if(env->images != NULL){
+        env->images->prev = image;
+    }
+    env->images = image;
+}
+
+Cvm_Status cvm_image_assemble(Cvm_Env *env, const char *source, size_t size,
+                              int optimize, int inline_threshold, int fuse, Cvm_Image **image){
+    jmp_buf fail;
+    Cvm_Lib_Call outer = cvm_lib_enter(env, &fail);
+    if(setjmp(fail) != 0){
+        cvm_lib_free_call(env, env->call);
+        cvm_lib_leave(env, &outer);
+        return CVM_FAILED;
+    }
+
+    Cvm_Image *result = cvm_lib_image_new(env);
+    String_view text = { .count = size, .data = source };
+    Inst *inst = NULL;
+    size_t capacity = 0;
+    size_t program_size = cvm_translate_source(text, &inst, &capacity);
+    if(inline_threshold >= 0){
+        cvm_inline_calls(&inst, &program_size, &capacity, (size_t) inline_threshold);
+    }
+    if(optimize > 0){
+        program_size = cvm_optimize_program(inst, program_size, optimize);
+    }
+    if(fuse){
+        cvm_fuse_program(inst, program_size);
+    }
+    if(inst == NULL){
+        inst = cvm_malloc(sizeof(Inst));
+        if(inst == NULL){
+            CVM_LIB_FAIL("Out of memory\n");
+        }
+    }
+    result->program.inst = inst;
+    result->program.size = (Word) program_size;
+    cvm_analyze_blocks(&result->program);
+
+    cvm_lib_image_publish(env, result);
+    cvm_lib_leave(env, &outer);
+    *image = result;
+    return CVM_OK;
+}
+
+Cvm_Status cvm_image_load(Cvm_Env *env, const void *data, size_t size, Cvm_Image **image){
+    jmp_buf fail;
+    Cvm_Lib_Call outer = cvm_lib_enter(env, &fail);
+    if(setjmp(fail) != 0){
+        cvm_lib_free_call(env, env->call);
+        cvm_lib_leave(env, &outer);
+        return CVM_FAILED;
+    }
+
+    Cvm_Image *result = cvm_lib_image_new(env);
+    const char *reason = cvm_load_program_from_bytes(&result->program, data, size);
+    if(reason != NULL){
+        CVM_LIB_FAIL("Could not load program: %s\n", reason);
+    }
+
+    cvm_lib_image_publish(env, result);
+    cvm_lib_leave(env, &outer);
+    *image = result;
+    return CVM_OK;
+}
+
+Cvm_Status cvm_image_load_file(Cvm_Env *env, const char *file_path, Cvm_Image **image){
+    jmp_buf fail;
+    Cvm_Lib_Call outer = cvm_lib_enter(env, &fail);
+    if(setjmp(fail) != 0){
+        cvm_lib_free_call(env, env->call);
+        cvm_lib_leave(env, &outer);
+        return CVM_FAILED;
+    }
+
+    Cvm_Image *result = cvm_lib_image_new(env);
+    cvm_load_program_from_file(&result->program, file_path);
+
+    cvm_lib_image_publish(env, result);
+    cvm_lib_leave(env, &outer);
+    *image = result;
+    return CVM_OK;
+}
+
+Cvm_Status cvm_image_verify(Cvm_Image *image){
+    Cvm_Env *env = image->env;
+    jmp_buf fail;
+    Cvm_Lib_Call outer = cvm_lib_enter(env, &fail);
+    if(setjmp(fail) != 0){
+        cvm_lib_leave(env, &outer);
+        return CVM_FAILED;
+    }
+
+    Cvm_Verify_Diag diag = {0};
+    if(!cvm_verify_program(&image->program, &diag)){
+        CVM_LIB_FAIL("Verification failed at ip %lld, stack depth %lld: %s\n",
+                (long long) diag.ip, (long long) diag.depth, diag.reason);
+    }
+
+    cvm_lib_leave(env, &outer);
+    return CVM_OK;
+}
+
+void cvm_image_destroy(Cvm_Image *image){
+    Cvm_Env *env = image->env;
+    jmp_buf fail;
+    Cvm_Lib_Call outer = cvm_lib_enter(env, &fail);
+    if(setjmp(fail) == 0){
+        cvm_program_destroy(&image->program);
+    }
+    if(image->prev != NULL){
+        image->prev->next = image->next;
+    }
+    else{
+        env->images = image->next;
+    }
+    if(image->next != NULL){
+        image->next->prev = image->prev;
+    }
+    cvm_free(image);
+    cvm_lib_leave(env, &outer);
+}
+
+Cvm_Status cvm_context_create(Cvm_Env *env, size_t stack_capacity, size_t memory_size, Cvm_Context **context){
+    jmp_buf fail;
+    Cvm_Lib_Call outer = cvm_lib_enter(env, &fail);
+    if(setjmp(fail) != 0){
+        cvm_lib_free_call(env, env->call);
+        cvm_lib_leave(env, &outer);
+        return CVM_FAILED;
+    }
+
+    Cvm_Context *result = cvm_malloc(sizeof(Cvm_Context));
+    if(result == NULL){
+        CVM_LIB_FAIL("Out of memory\n");
+    }
+    *result = (Cvm_Context){ .env = env, .engine = CVM_DEFAULT_ENGINE };
+    cvm_init(&result->cvm, stack_capacity > 0 ? stack_capacity : CVM_STACK_CAPACITY);
+    if(memory_size > 0 && memory_size != CVM_MEMORY_CAPACITY){
+        cvm_set_memory(&result->cvm, memory_size);
+    }
+
+    result->next = env->contexts;
+    if(env->contexts != NULL){
+        env->contexts->prev = result;
+    }
+    env->contexts = result;
+    cvm_lib_leave(env, &outer);
+    *context = result;
+    return CVM_OK;
+}
+
+void cvm_context_destroy(Cvm_Context *context){
+    Cvm_Env *env = context->env;
+    jmp_buf fail;
+    Cvm_Lib_Call outer = cvm_lib_enter(env, &fail);
+    if(setjmp(fail) == 0){
+        // Flushing pending output is the only thing here that can fail.
+        cvm_destroy(&context->cvm);
+    }
+    if(context->prev != NULL){
+        context->prev->next = context->next;
+    }
+    else{
+        env->contexts = context->next;
+    }
+    if(context->next != NULL){
+        context->next->prev = context->prev;
+    }
+    cvm_free(context);
+    cvm_lib_leave(env, &outer);
+}
+
+Cvm_Status cvm_context_attach(Cvm_Context *context, Cvm_Image *image){
+    Cvm_Env *env = context->env;
+    jmp_buf fail;
+    Cvm_Lib_Call outer = cvm_lib_enter(env, &fail);
+    if(setjmp(fail) != 0){
+        cvm_lib_leave(env, &outer);
+        return CVM_FAILED;
+    }
+
+    if(image->env != env){
+        CVM_LIB_FAIL("Image and context belong to different envs\n");
+    }
+    cvm_attach_program(&context->cvm, &image->program);
+
+    cvm_lib_leave(env, &outer);
+    return CVM_OK;
+}
+
+Cvm_Status cvm_context_set_engine(Cvm_Context *context, const char *engine){
+    Cvm_Engine selected;
+    if(!cvm_engine_from_cstr(engine, &selected)){
+        snprintf(context->env->error, sizeof(context->env->error), "Unknown engine '%s'", engine);
+        return CVM_FAILED;
+    }
+    context->engine = selected;
+    return CVM_OK;
+}
+
+Cvm_Status cvm_context_set_output(Cvm_Context *context, int fd, int binary){
+    Cvm_Env *env = context->env;
+    jmp_buf fail;
+    Cvm_Lib_Call outer = cvm_lib_enter(env, &fail);
+    if(setjmp(fail) != 0){
+        cvm_lib_leave(env, &outer);
+        return CVM_FAILED;
+    }
+
+    cvm_set_output(&context->cvm, fd, binary ? CVM_OUTPUT_BINARY : CVM_OUTPUT_TEXT);
+
+    cvm_lib_leave(env, &outer);
+    return CVM_OK;
+}
+
+Cvm_Status cvm_context_push(Cvm_Context *context, int64_t value){
+    Cvm *cvm = &context->cvm;
+    if(cvm->stack_size >= cvm->stack_capacity){
+        // Growing can fail to map a bigger stack.
+        Cvm_Env *env = context->env;
+        jmp_buf fail;
+        Cvm_Lib_Call outer = cvm_lib_enter(env, &fail);
+        if(setjmp(fail) != 0){
+            cvm_lib_leave(env, &outer);
+            return CVM_FAILED;
+        }
+        int grown = cvm_stack_reserve(cvm, cvm->stack_size + 1);
+        cvm_lib_leave(env, &outer);
+        if(!grown){
+            return CVM_STACK_OVERFLOW;
+        }
+    }
+    cvm->stack[cvm->stack_size++] = value;
+    return CVM_OK;
+}
+
+Cvm_Status cvm_context_execute(Cvm_Context *context, int limit){
+    Cvm_Env *env = context->env;
+    jmp_buf fail;
+    Cvm_Lib_Call outer = cvm_lib_enter(env, &fail);
+    if(setjmp(fail) != 0){
+        cvm_lib_leave(env, &outer);
+        return CVM_FAILED;
+    }
+
+    if(context->cvm.image == NULL){
+        CVM_LIB_FAIL("No image attached\n");
+    }
+    Error error = cvm_execute_program_with(&context->cvm, limit, context->engine);
+    if(error == ERROR_OK_NO_INST){
+        error = ERROR_OK;
+    }
+
+    cvm_lib_leave(env, &outer);
+    return (Cvm_Status) error;
+}
+
+int cvm_context_halted(const Cvm_Context *context){
+    return context->cvm.halt;
+}
+
+const int64_t *cvm_context_stack(const Cvm_Context *context, size_t *size){
+    *size = (size_t) context->cvm.stack_size;
+    return context->cvm.stack;
+}
+
+void cvm_context_stats(const Cvm_Context *context, Cvm_Stats *stats){
+    cvm_stats(&context->cvm, stats);
+    stats->total += sizeof(*context) - sizeof(context->cvm);
+}
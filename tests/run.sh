@@ -0,0 +1,156 @@
+#!/bin/sh
+# Runs the tools built by make all against the programs under tests/ and reports
+# every case that does not hold. Run from the repository root: make test.
+#
+#   programs/  every engine, verified or not, at every cvmasm optimization level,
+#              must print what the checked switch engine prints for the plain build,
+#              and stop where it stops when -l cuts the run short or --sched slices it;
+#              so must the C cvmc emits for each level, built with $CC
+#   verify/    the first line, "# expect: <diagnostic>" or "# expect: ok", is what
+#              cvmi -s has to say about the program
+#   lanes/     run over the .inputs next to them with --lanes, must end in the final
+#              stacks of a plain -b run and print the same lines, in any order
+#
+# The serve case talks the cvm_serve_stream protocol over stdin and stdout, and the
+# flags cases run the examples with malformed arguments, which the tools must
+# refuse with a usage error.
+
+CC=${CC:-cc}
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+cases=0
+failures=0
+
+fail(){
+    echo "FAIL: $*"
+    failures=$((failures + 1))
+}
+
+# expect_same <name> <expected file> <actual file>
+expect_same(){
+    cases=$((cases + 1))
+    if ! cmp -s "$2" "$3"; then
+        fail "$1"
+        diff "$2" "$3" | head -n 10
+    fi
+}
+
+for source in tests/programs/*.cvmasm; do
+    name=$(basename "$source" .cvmasm)
+    if ! ./cvmasm "$source" "$tmp/$name.cvm" >/dev/null 2>&1; then
+        fail "$name: does not assemble"
+        continue
+    fi
+    ./cvmi "$tmp/$name.cvm" -n -e switch >"$tmp/$name.expected" 2>&1
+
+    for build in -O0 -O1 -O2 -f; do
+        ./cvmasm "$source" "$tmp/$name$build.cvm" $build >/dev/null 2>&1
+        for limit in 7 23; do
+            ./cvmi "$tmp/$name$build.cvm" -n -e switch -l $limit >"$tmp/$name$build.limited$limit" 2>&1
+        done
+        for engine in auto switch threaded jit tos trace; do
+            for verify in "" -n; do
+                ./cvmi "$tmp/$name$build.cvm" -e $engine $verify >"$tmp/actual" 2>&1
+                expect_same "$name $build -e $engine $verify" "$tmp/$name.expected" "$tmp/actual"
+                for limit in 7 23; do
+                    ./cvmi "$tmp/$name$build.cvm" -e $engine $verify -l $limit >"$tmp/actual" 2>&1
+                    expect_same "$name $build -e $engine $verify -l $limit" "$tmp/$name$build.limited$limit" "$tmp/actual"
+                done
+            done
+        done
+
+        if ./cvmc "$tmp/$name$build.cvm" "$tmp/$name$build.c" >"$tmp/cc" 2>&1 \
+           && $CC -O2 -I src -o "$tmp/$name$build.bin" "$tmp/$name$build.c" -lpthread >"$tmp/cc" 2>&1; then
+            "$tmp/$name$build.bin" >"$tmp/actual" 2>&1
+            expect_same "$name $build cvmc" "$tmp/$name.expected" "$tmp/actual"
+        else
+            cases=$((cases + 1))
+            fail "$name $build cvmc: does not build"
+            head -n 10 "$tmp/cc"
+        fi
+    done
+
+    # Two contexts sliced every 3 instructions resume mid-block where switch does.
+    ./cvmi "$tmp/$name.cvm" "$tmp/$name.cvm" --sched rr --slice 3 -e switch >"$tmp/$name.sched" 2>&1
+    for engine in auto threaded trace; do
+        ./cvmi "$tmp/$name.cvm" "$tmp/$name.cvm" --sched rr --slice 3 -e $engine >"$tmp/actual" 2>&1
+        expect_same "$name --sched -e $engine" "$tmp/$name.sched" "$tmp/actual"
+    done
+done
+
+for source in tests/verify/*.cvmasm; do
+    name=$(basename "$source" .cvmasm)
+    expect=$(sed -n '1s/^# expect: //p' "$source")
+    ./cvmasm "$source" "$tmp/$name.cvm" >/dev/null 2>&1
+    cases=$((cases + 1))
+    if ./cvmi "$tmp/$name.cvm" -s >/dev/null 2>"$tmp/diag"; then
+        [ "$expect" = ok ] || fail "verify $name: accepted, expected '$expect'"
+    elif [ "$expect" = ok ]; then
+        fail "verify $name: rejected: $(cat "$tmp/diag")"
+    elif ! grep -qF ": $expect" "$tmp/diag"; then
+        fail "verify $name: expected '$expect', got: $(cat "$tmp/diag")"
+    fi
+done
+
+for source in tests/lanes/*.cvmasm; do
+    name=$(basename "$source" .cvmasm)
+    inputs=${source%.cvmasm}.inputs
+    ./cvmasm "$source" "$tmp/$name.cvm" >/dev/null 2>&1
+    for limit in 37 1000; do
+        ./cvmi "$tmp/$name.cvm" -b "$inputs" -j 1 -l $limit >"$tmp/scalar" 2>&1
+        sort "$tmp/scalar" >"$tmp/scalar.sorted"
+        sed -n '/^== /,$p' "$tmp/scalar" >"$tmp/scalar.stacks"
+        for lanes in 4 8 16; do
+            ./cvmi "$tmp/$name.cvm" -b "$inputs" -j 1 -l $limit --lanes $lanes >"$tmp/lockstep" 2>&1
+            sort "$tmp/lockstep" >"$tmp/lockstep.sorted"
+            sed -n '/^== /,$p' "$tmp/lockstep" >"$tmp/lockstep.stacks"
+            expect_same "lanes $name -l $limit --lanes $lanes: output" "$tmp/scalar.sorted" "$tmp/lockstep.sorted"
+            expect_same "lanes $name -l $limit --lanes $lanes: stacks" "$tmp/scalar.stacks" "$tmp/lockstep.stacks"
+        done
+    done
+done
+
+# cvmi --serve - answers each request line with one line; malformed requests,
+# limits out of range included, are answered with fail and never run.
+cat >"$tmp/requests" <<EOF
+run examples/123.cvm -1
+run examples/123.cvm 2 7
+run examples/123.cvm 4294967295
+run examples/123.cvm -2
+run examples/123.cvm x
+stop examples/123.cvm
+run tests/missing.cvm
+EOF
+cat >"$tmp/replies" <<EOF
+ok 1 6
+ok 3 7 1 2
+fail invalid limit '4294967295'
+fail invalid limit '-2'
+fail invalid word 'x'
+fail unknown command 'stop'
+fail tests/missing.cvm
+EOF
+./cvmi --serve - <"$tmp/requests" 2>/dev/null | sed 's/^\(fail tests\/missing.cvm\):.*/\1/' >"$tmp/actual"
+expect_same "serve" "$tmp/replies" "$tmp/actual"
+
+# expect_refused <command...>
+expect_refused(){
+    cases=$((cases + 1))
+    if "$@" >/dev/null 2>&1; then
+        fail "accepted: $*"
+    fi
+}
+
+for flags in "-S abc" "-S 0" "-S 18446744073709551617" "-M 12x" "-M 0" "-l -7" "-l 1x" \
+             "-j 0" "--slice 0" "--priority 256" "-b /dev/null --sched rr --slice -3" \
+             "-b /dev/null --lanes 8x" "-b /dev/null --lanes 12"; do
+    expect_refused ./cvmi examples/123.cvm $flags
+done
+expect_refused ./cvmc examples/123.cvm "$tmp/123.c" -S abc
+expect_refused ./cvmc examples/123.cvm "$tmp/123.c" -M 99999999999999999999
+expect_refused ./cvmasm examples/123.cvmasm "$tmp/123.cvm" -i abc
+expect_refused ./cvmasm examples/123.cvmasm "$tmp/123.cvm" -i -1
+
+echo "$((cases - failures))/$cases passed"
+[ "$failures" -eq 0 ]